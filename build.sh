@@ -24,11 +24,39 @@ fi
 if [[ "$BUILD_MODULE" == "" ]]; then
   BUILD_MODULE=1
 fi
+# THREADS=1 builds everything with pthreads (all the libraries must match)
+if [[ "$THREADS" == "" ]]; then
+  THREADS=0
+fi
+# SIMD=1 needs a browser with WASM SIMD
+if [[ "$SIMD" == "" ]]; then
+  SIMD=0
+fi
 EXTRA_MAKE_ARGS=-j8
 
 MODULE_BUILD_TESTS=OFF
 MODULE_BUILD_TYPE=Release
 
+if [[ $THREADS -ne 0 ]]; then
+  OPENH264_OPT_FLAGS="-O3 -pthread"
+  OPENCV_THREAD_ARGS=--threads
+  FFMPEG_THREAD_ARGS="--enable-pthreads --extra-cflags=-pthread --extra-ldflags=-pthread"
+  MODULE_THREADS=ON
+else
+  OPENH264_OPT_FLAGS="-O3"
+  OPENCV_THREAD_ARGS=
+  FFMPEG_THREAD_ARGS=--disable-pthreads
+  MODULE_THREADS=OFF
+fi
+
+if [[ $SIMD -ne 0 ]]; then
+  OPENCV_SIMD_ARGS=--simd
+  MODULE_SIMD=ON
+else
+  OPENCV_SIMD_ARGS=
+  MODULE_SIMD=OFF
+fi
+
 ######
 BUILDDIR=build
 OPENH264_SRCDIR=${PWD}/openh264
@@ -70,7 +98,7 @@ if [[ $BUILD_OPENH264 -ne 0 ]]; then
   echo "*** Building OpenH264 ***"
   echo "*************************"
 
-  emmake make $EXTRA_MAKE_ARGS PREFIX="${OPENH264_BUILDDIR}" -f ${OPENH264_SRCDIR}/Makefile install
+  emmake make $EXTRA_MAKE_ARGS PREFIX="${OPENH264_BUILDDIR}" CFLAGS_OPT="${OPENH264_OPT_FLAGS}" -f ${OPENH264_SRCDIR}/Makefile install
 
   checkError "Build OpenH264"
 
@@ -88,7 +116,7 @@ if [[ $BUILD_OPENCV -ne 0 ]]; then
   echo "*** Building OpenCV ***"
   echo "***********************"
 
-  python ${OPENCV_SRCDIR}/platforms/js/build_js.py . --build_wasm # --threads --simd
+  python ${OPENCV_SRCDIR}/platforms/js/build_js.py . --build_wasm $OPENCV_THREAD_ARGS $OPENCV_SIMD_ARGS
   
   checkError "Build OpenCV"
 
@@ -130,7 +158,7 @@ if [[ $BUILD_FFMPEG -ne 0 ]]; then
               --disable-swresample \
               --disable-swscale \
               --disable-postproc \
-              --disable-pthreads \
+              $FFMPEG_THREAD_ARGS \
               --enable-libopenh264 \
               --disable-sdl2
   
@@ -157,7 +185,7 @@ if [[ $BUILD_MODULE -ne 0 ]]; then
   echo "******************************"
   echo "*** Configuring VideoUtils ***"
   echo "******************************"
-  emconfigure cmake .. -DCMAKE_BUILD_TYPE=${MODULE_BUILD_TYPE} -DINCLUDE_TESTS=${MODULE_BUILD_TESTS}
+  emconfigure cmake .. -DCMAKE_BUILD_TYPE=${MODULE_BUILD_TYPE} -DINCLUDE_TESTS=${MODULE_BUILD_TESTS} -DVST_THREADS=${MODULE_THREADS} -DVST_SIMD=${MODULE_SIMD}
   
   checkError "Configuring VideoUtils"
 
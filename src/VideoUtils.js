@@ -18,7 +18,10 @@ class MessageClient {
     });
   }
 
-  callMethod(method, args) {
+  // onProgress (optional) is called with each partial result the worker sends
+  // transfer (optional): ArrayBuffers in args to hand to the worker rather than
+  // copy; they are unusable here afterwards
+  callMethod(method, args, onProgress, transfer) {
     console.assert(this.worker);
     console.assert(method);
 
@@ -27,8 +30,8 @@ class MessageClient {
     const msg = { id, method, args };
 
     return new Promise((resolve,reject) => {
-      this._pending[id] = { resolve, reject };
-      return this.worker.postMessage(msg);
+      this._pending[id] = { resolve, reject, onProgress };
+      return this.worker.postMessage(msg, transfer || []);
     });
   }
 
@@ -52,7 +55,12 @@ class MessageClient {
       let p = this._pending[msg.id];
       console.assert(p);
 
-      if (p) {
+      if (p && msg.progress !== undefined) {
+        if (p.onProgress) {
+          p.onProgress(msg.progress);
+        }
+      }
+      else if (p) {
         delete this._pending[msg.id];
         if (msg.error) {
           p.reject(msg.error);
@@ -87,28 +95,80 @@ export class VideoUtils {
     return this.client.callMethod('dumpMetaData', [db,filename]);
   }
 
+  // options: {
+  //  scanPackets    // also count every frame and list the keyframe times
+  // }
+  // Files stored as Blobs (e.g. a File from an <input>) are read range by
+  // range, so only the headers are loaded.  Any other record (ArrayBuffer,
+  // Uint8Array, and the files this library writes, which stay Uint8Arrays so
+  // that every reader can load them) is loaded whole by IndexedDB itself
+  // before it can be read at all.
   // returns: Promise<{
   //  avgFrameRate,
   //  realFrameRate, // may be 0
-  //  numFrames,     // may be 0
+  //  numFrames,     // may be 0 (exact with scanPackets)
   //  duration,
-  //  rotation       // rotation angle in degrees
+  //  rotation       // clockwise rotation angle in degrees
   //  vidWidth
   //  vidHeight
+  //  vidCodec
+  //  vidPixelFormat // full range 'yuvj' formats are reported as 'yuv' unless scanPackets
+  //  vidBitRate     // bits/sec, may be 0
+  //  bitRate        // whole file, bits/sec, may be 0
+  //  audio          // { codec, sampleRate, channels, bitRate } or null
+  //  keyframeTimes  // only with scanPackets: keyframe decode times in seconds
   // }>
-  readMetaData(db, filename) {
-    return this.client.callMethod('readMetaData', [db,filename]);
+  readMetaData(db, filename, options) {
+    const scanPackets = !!(options && options.scanPackets);
+    return this.client.callMethod('readMetaData', [db,filename,scanPackets]);
   }
 
 
-  // returns: Promise<>
-  transcodeRotation(db, src, dst) {
-    return this.client.callMethod('transcodeRotation', [db,src,dst]);
+  // Reads the metadata of every file in one worker call.  onResult (optional)
+  // is called as each file finishes with { index, filename, meta } or
+  // { index, filename, error }, where meta is what readMetaData() returns.
+  // returns: Promise<{
+  //  count,
+  //  failed,
+  //  seconds,
+  //  filesPerSecond
+  // }>
+  readMetaDataBatch(db, filenames, onResult) {
+    return this.client.callMethod('readMetaDataBatch', [db,filenames], onResult);
   }
 
+
+  // options (optional): {
+  //  threads  // decoder and encoder threads, 0/unset = one per core; needs the threaded build
+  //  segments // > 1: transcode this many GOP-aligned ranges in parallel; needs the threaded build
+  //  encode: {        // all optional
+  //    preset         // 'fast' (low-end devices), 'balanced' (default) or 'archival'; the fields below override it
+  //    rateControl    // 'bitrate' (default), 'quality', 'buffer' or 'off'
+  //    bitRate        // bits/sec, default 2500000; the ceiling in 'quality' mode
+  //    quality        // largest quantizer allowed, 1 (best) to 51
+  //    complexity     // 'low', 'medium' (default) or 'high'
+  //    gopSize        // frames between keyframes
+  //    maxDimension   // downscale so neither side of the output is larger
+  //  }
+  //  rotationMode // 'bake' (default): rotate the pictures and re-encode
+  //               // 'matrix': copy the packets, rotation in the MP4/MOV track header only
+  //               // 'strip': copy the packets, no rotation in the file; apply `rotation` with CSS
+  //  alwaysReencode // 'bake' copies unrotated H.264 without encode options unless this is true
+  // }
+  // returns: Promise<{
+  //  reencoded,      // false if the video packets were copied
+  //  rotation,       // clockwise degrees the output still needs when shown
+  //  rotationInFile, // true if the player gets the rotation from the file
+  //  reason          // why the video was or wasn't re-encoded
+  // }>
+  transcodeRotation(db, src, dst, options) {
+    return this.client.callMethod('transcodeRotation', [db,src,dst,options || {}]);
+  }
+
+  // options (optional): same as transcodeRotation()
   // returns: Promise<>
-  transmuxStripMeta(db, src, dst) {
-    return this.client.callMethod('transmuxStripMeta', [db,src,dst]);
+  transmuxStripMeta(db, src, dst, options) {
+    return this.client.callMethod('transmuxStripMeta', [db,src,dst,options || {}]);
   }
 
   createTrackingContext(x, y, radius) {
@@ -119,10 +179,89 @@ export class VideoUtils {
     return this.client.callMethod('destroyTrackingContext', [trackingCtxId]);
   }
 
+  // buffer: the frame as RGBA, or as width * height bytes of luma (e.g. the Y
+  // plane of an I420 or NV12 VideoFrame), which is all the tracker looks at and
+  // a quarter of the size
   trackObjectNextFrame(trackingCtxId,timeStamp,width,height,buffer) {
     return this.client.callMethod('trackObjectNextFrame', [trackingCtxId,timeStamp,width,height,buffer]);
   }
 
+  // Tracks the objects of several tracking contexts in one frame, which
+  // crosses to the worker once for all of them.  buffer: as trackObjectNextFrame()
+  // The contexts share one background model per set of trackingCtxIds, so pass
+  // the same set for every frame of a video, and a different one per video.
+  // returns: Promise<[
+  //  { trackingCtxId, x, y, timeStamp } or { trackingCtxId, error }, ...
+  // ]> in the order of trackingCtxIds
+  trackObjectsNextFrame(trackingCtxIds,timeStamp,width,height,buffer) {
+    return this.client.callMethod('trackObjectsNextFrame', [trackingCtxIds,timeStamp,width,height,buffer]);
+  }
+
+  // returns: Promise<{ frames, failures, msPerFrame }> for the context so far
+  getTrackingStats(trackingCtxId) {
+    return this.client.callMethod('getTrackingStats', [trackingCtxId]);
+  }
+
+  // Tracks the object at x,y (radius: its size) through a stored video, which
+  // the worker decodes itself, so no frames are posted to it.  x and y are in
+  // the picture as shown, after any rotation.
+  // options (optional): {
+  //  startTime // seconds; the frame x,y is in. Default 0
+  //  endTime   // seconds; default the end of the video
+  // }
+  // onPositions (optional) is called with batches of
+  //  [{ timeStamp, x, y } or { timeStamp, error }, ...] as the video is tracked
+  // returns: Promise<{ frames, failures, seconds }>
+  trackObjectInVideo(db, filename, x, y, radius, options, onPositions) {
+    const startTime = (options && options.startTime) || 0;
+    const endTime = (options && options.endTime) || 0;
+    return this.client.callMethod('trackObjectInVideo', [db,filename,x,y,radius,startTime,endTime], onPositions);
+  }
+
+  // Allocates count (default 2) persistent frame buffers of width x height in
+  // the worker, replacing any allocated before.  format: 'rgba' (default) or
+  // 'luma' (see trackObjectNextFrame()).  Write a frame into a slot
+  // and pass its index to trackObject(s)NextFrameInSlot(); with two slots the
+  // next frame can be written while the worker tracks in the other one.  A slot
+  // is busy until the promise of the call that uses it settles.
+  // returns: Promise<{
+  //  width,
+  //  height,
+  //  views  // a Uint8Array per slot over the worker's memory, to write frames
+  //         // into directly (e.g. VideoFrame.copyTo(views[i])); null unless the
+  //         // memory can be shared (threaded build), in which case pass the
+  //         // frames to the *InSlot calls instead
+  // }>
+  async allocateFrameSlots(width, height, count, format) {
+    const channels = format === 'luma' ? 1 : 4;
+    const slots = await this.client.callMethod('allocateFrameSlots', [width,height,channels,count || 2]);
+    const size = slots.width * slots.height * slots.channels;
+    return {
+      width: slots.width,
+      height: slots.height,
+      views: slots.memory ? slots.offsets.map((offset) => new Uint8Array(slots.memory, offset, size)) : null
+    };
+  }
+
+  // the views of allocateFrameSlots() are invalid afterwards
+  freeFrameSlots() {
+    return this.client.callMethod('freeFrameSlots', []);
+  }
+
+  // Like trackObjectNextFrame(), for the frame in a slot from allocateFrameSlots().
+  // buffer (optional): the frame to put in the slot first, if it wasn't
+  // written through the slot's view; it is transferred to the worker, not copied
+  trackObjectNextFrameInSlot(trackingCtxId,timeStamp,slot,buffer) {
+    return this.client.callMethod('trackObjectNextFrameInSlot', [trackingCtxId,timeStamp,slot,buffer || null],
+                                  undefined, buffer ? [buffer] : []);
+  }
+
+  // Like trackObjectsNextFrame(), for the frame in a slot; buffer as above
+  trackObjectsNextFrameInSlot(trackingCtxIds,timeStamp,slot,buffer) {
+    return this.client.callMethod('trackObjectsNextFrameInSlot', [trackingCtxIds,timeStamp,slot,buffer || null],
+                                  undefined, buffer ? [buffer] : []);
+  }
+
   shutdown() {
     if (this.client) {
       this.client.shutdown();
@@ -0,0 +1,77 @@
+#include "chunkedbuffer.h"
+
+#include <algorithm>
+#include <cstring>
+
+const size_t ChunkedBuffer::kDefaultChunkSize;
+
+
+ChunkedBuffer::ChunkedBuffer(size_t chunkSize)
+  : chunkSize(chunkSize ? chunkSize : kDefaultChunkSize)
+{
+}
+
+
+size_t ChunkedBuffer::ChunkSize(size_t i) const
+{
+  if (i + 1 < chunks.size())
+    return chunkSize;
+  return size - i * chunkSize;
+}
+
+
+void ChunkedBuffer::Reserve(size_t bytes)
+{
+  chunks.reserve((bytes + chunkSize - 1) / chunkSize);
+}
+
+
+uint8_t* ChunkedBuffer::ChunkFor(size_t pos)
+{
+  size_t index = pos / chunkSize;
+  while (chunks.size() <= index)
+    chunks.emplace_back(new uint8_t[chunkSize]);
+  return chunks[index].get();
+}
+
+
+void ChunkedBuffer::Write(size_t pos, const uint8_t *buf, size_t n)
+{
+  // zero fill a gap left by seeking past the end
+  while (size < pos)
+  {
+    size_t offset = size % chunkSize;
+    size_t len = std::min(chunkSize - offset, pos - size);
+    std::memset(ChunkFor(size) + offset, 0, len);
+    size += len;
+  }
+
+  while (n > 0)
+  {
+    size_t offset = pos % chunkSize;
+    size_t len = std::min(chunkSize - offset, n);
+    std::memcpy(ChunkFor(pos) + offset, buf, len);
+    pos += len;
+    buf += len;
+    n   -= len;
+  }
+
+  size = std::max(size, pos);
+}
+
+
+int ChunkedBuffer::WriteAt(int64_t offset, const uint8_t *buf, int n)
+{
+  if (offset < 0 || n < 0)
+    return -1;
+
+  Write(static_cast<size_t>(offset), buf, static_cast<size_t>(n));
+  return n;
+}
+
+
+void ChunkedBuffer::Clear()
+{
+  chunks.clear();
+  size = 0;
+}
@@ -0,0 +1,50 @@
+#ifndef __VST_CHUNKED_BUFFER_H__
+#define __VST_CHUNKED_BUFFER_H__
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "outputsink.h"
+
+// Growable byte buffer made of fixed-size blocks.  Growing never moves bytes
+// that have already been written, and any written offset can be overwritten
+// in place (the MP4 muxer seeks back to patch the moov/mdat headers).
+class ChunkedBuffer : public OutputSink
+{
+public:
+  static const size_t kDefaultChunkSize = 0x100000; // 1 MiB
+
+  explicit ChunkedBuffer(size_t chunkSize = kDefaultChunkSize);
+
+  ChunkedBuffer(const ChunkedBuffer&) = delete;
+  ChunkedBuffer& operator=(const ChunkedBuffer&) = delete;
+
+  int64_t Size() const override { return size; }
+  bool Empty() const { return size == 0; }
+
+  // chunk access for scatter-gather consumers; all chunks but the last are full
+  size_t NumChunks() const { return chunks.size(); }
+  const uint8_t* ChunkData(size_t i) const { return chunks[i].get(); }
+  size_t ChunkSize(size_t i) const;
+
+  // reserve room in the chunk table for roughly `bytes` of output (no chunks are allocated)
+  void Reserve(size_t bytes);
+
+  // write `n` bytes at `pos`, growing as needed; a gap between Size() and pos is zero filled
+  void Write(size_t pos, const uint8_t *buf, size_t n);
+
+  int WriteAt(int64_t offset, const uint8_t *buf, int n) override;
+
+  void Clear();
+
+private:
+  uint8_t* ChunkFor(size_t pos);
+
+  const size_t chunkSize;
+  size_t size = 0;
+  std::vector<std::unique_ptr<uint8_t[]>> chunks;
+};
+
+#endif
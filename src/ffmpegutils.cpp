@@ -1,14 +1,28 @@
 #include "ffmpegutils.h"
+#include "framepool.h"
+#include "framerotator.h"
+#include "packetindex.h"
 #include <cstdlib>
+#include <cmath>
 #include <cstring>
 #include <algorithm>
 #include <cctype>
 
+#if VST_HAVE_THREADS
+#include "spscqueue.h"
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <thread>
+#endif
+
 extern "C" {
 #include <libavfilter/avfilter.h>
 #include <libavfilter/buffersink.h>
 #include <libavfilter/buffersrc.h>
 #include <libavutil/avutil.h>
+#include <libavutil/display.h>
+#include <libavutil/pixdesc.h>
 #include <libavfilter/version.h>
 #include <libavutil/version.h>
 }
@@ -28,7 +42,61 @@ namespace
   }
 
   //////////////////////////////
-  struct ReadContext
+  // opaque object behind every AVIOContext made by CreateIOReadContext()
+  struct InputContext
+  {
+    virtual ~InputContext() {}
+
+    virtual int Read(uint8_t *buf, int bufSize) = 0;
+    virtual int64_t Seek(int64_t offset, int whence) = 0;
+
+    AVIOContext *io = nullptr; ///< owning context, used to tell buffered reads from direct ones
+    IOReadStats stats;
+
+    void CountRead(const uint8_t *buf, int bufSize)
+    {
+      ++stats.readCalls;
+      stats.bytesCopied += bufSize;
+
+      // bytes landing in the AVIO buffer get copied a second time by avio_read()
+      if (io && buf >= io->buffer && buf < io->buffer + io->buffer_size)
+        stats.bytesBuffered += bufSize;
+    }
+
+    // resolve a seek request against a stream of totalSize bytes currently at pos
+    static int64_t SeekPosition(int64_t pos, int64_t totalSize, int64_t offset, int whence)
+    {
+      switch (whence & ~AVSEEK_FORCE)
+      {
+        case SEEK_SET:
+          pos = offset;
+          break;
+
+        case SEEK_CUR:
+          pos += offset;
+          break;
+
+        case SEEK_END:
+          pos = totalSize + offset;
+          break;
+
+        default:
+          av_log(NULL, AV_LOG_DEBUG, "InputContext::Seek: Unhandled whence=%d\n", whence);
+          return AVERROR(EINVAL);
+      }
+
+      if (pos < 0 || pos > totalSize) {
+        av_log(NULL, AV_LOG_ERROR, "InputContext::Seek: out of bounds: %lld (size=%lld)\n", (long long)pos, (long long)totalSize);
+        return AVERROR(EINVAL);
+      }
+
+      return pos;
+    }
+  };
+
+
+  //////////////////////////////
+  struct ReadContext : public InputContext
   {
     ReadContext(const uint8_t *base, int64_t size)
       : base(base), ptr(base), size(size), totalSize(size) {}
@@ -42,62 +110,133 @@ namespace
     int64_t size; ///< size left in the buffer
     const int64_t totalSize;
 
-    int Read(uint8_t *buf, int bufSize)
+    int Read(uint8_t *buf, int bufSize) override
     {
-      bufSize = FFMIN(bufSize, size);
+      bufSize = (int)FFMIN((int64_t)bufSize, size);
+      if (bufSize <= 0)
+        return AVERROR_EOF;
 
       // copy internal buffer data to buf
       std::memcpy(buf, ptr, bufSize);
       ptr  += bufSize;
       size -= bufSize;
 
+      CountRead(buf, bufSize);
+
       VERBOSE_LOGGING av_log(NULL, AV_LOG_DEBUG, "\t read: size=%lld (%lld)\n", size, totalSize - size);
 
       return bufSize;
     }
 
-    int64_t Seek(int64_t offset, int whence)
+    int64_t Seek(int64_t offset, int whence) override
     {
       if (whence & AVSEEK_SIZE) {
         return totalSize;
       }
 
-      switch (whence)
-      {
-        case SEEK_SET:
-        ptr = base + offset;
-        size = totalSize - offset;
-        break;
+      ++stats.seekCalls;
 
-        case SEEK_CUR:
-        ptr += offset;
-        size -= offset;
-        break;
+      int64_t pos = SeekPosition(totalSize - size, totalSize, offset, whence);
+      if (pos < 0)
+        return pos;
 
-        case SEEK_END:
-        // verify
-        ptr = base + size + offset;
-        size = -offset;
-        break;
+      ptr  = base + pos;
+      size = totalSize - pos;
 
-        default:
-          av_log(NULL, AV_LOG_DEBUG, "ReadContext::Seek: Unhandled whence=%d\n", whence);
+      VERBOSE_LOGGING av_log(NULL, AV_LOG_DEBUG, "\t seek: size=%lld (%lld)\n", size, totalSize - size);
+
+      return pos;
+    }
+  };
+
+
+  //////////////////////////////
+  // Pulls bytes from an InputSource on demand.  Small reads are served from a
+  // read-ahead buffer, large ones (packet payloads) go straight to the caller.
+  struct SourceReadContext : public InputContext
+  {
+    SourceReadContext(std::shared_ptr<InputSource> source, size_t readAheadSize)
+      : source(source), totalSize(source->Size()), readAhead(readAheadSize) {}
+
+    ~SourceReadContext() {
+      VERBOSE_LOGGING av_log(NULL, AV_LOG_DEBUG, "SourceReadContext deleted\n");
+    }
+
+    std::shared_ptr<InputSource> source;
+    const int64_t totalSize;
+    int64_t pos = 0;
+
+    std::vector<uint8_t> readAhead;
+    int64_t readAheadStart = 0;
+    int64_t readAheadSize = 0; ///< valid bytes in readAhead
+
+    int Fetch(int64_t offset, uint8_t *buf, int size)
+    {
+      int n = source->ReadAt(offset, buf, size);
+      if (n < 0) {
+        av_log(NULL, AV_LOG_ERROR, "SourceReadContext: read failed at %lld (%d)\n", (long long)offset, n);
+        return AVERROR(EIO);
       }
 
-      VERBOSE_LOGGING av_log(NULL, AV_LOG_DEBUG, "\t seek: size=%lld (%lld)\n", size, totalSize - size);
+      ++stats.sourceReads;
+      stats.sourceBytes += n;
+      return n;
+    }
+
+    int Read(uint8_t *buf, int bufSize) override
+    {
+      bufSize = (int)FFMIN((int64_t)bufSize, totalSize - pos);
+      if (bufSize <= 0)
+        return AVERROR_EOF;
+
+      int n = 0;
+      if (readAhead.empty() || bufSize >= (int64_t)readAhead.size())
+      {
+        n = Fetch(pos, buf, bufSize);
+      }
+      else
+      {
+        if (pos < readAheadStart || pos >= readAheadStart + readAheadSize)
+        {
+          n = Fetch(pos, readAhead.data(), (int)readAhead.size());
+          if (n < 0)
+            return n;
+          readAheadStart = pos;
+          readAheadSize  = n;
+        }
+
+        n = (int)FFMIN((int64_t)bufSize, readAheadStart + readAheadSize - pos);
+        std::memcpy(buf, readAhead.data() + (pos - readAheadStart), n);
+      }
+
+      if (n <= 0)
+        return n < 0 ? n : AVERROR_EOF;
+
+      pos += n;
+      CountRead(buf, n);
+
+      return n;
+    }
 
-      // TODO: bounds check
+    int64_t Seek(int64_t offset, int whence) override
+    {
+      if (whence & AVSEEK_SIZE) {
+        return totalSize;
+      }
 
+      ++stats.seekCalls;
 
-      // do we return the current pos
-      return totalSize - size; // return current offset (?)
+      int64_t newPos = SeekPosition(pos, totalSize, offset, whence);
+      if (newPos >= 0)
+        pos = newPos;
+      return newPos;
     }
   };
 
   int ReadPacket(void *opaque, uint8_t *buf, int bufSize)
   {
     VERBOSE_LOGGING av_log(NULL, AV_LOG_DEBUG, "   <> READ: (buf_size=%d)\n", bufSize);
-    auto *bd = (ReadContext*)opaque;
+    auto *bd = (InputContext*)opaque;
     return bd->Read(buf, bufSize);
   }
 
@@ -105,7 +244,7 @@ namespace
   int64_t Seek(void *opaque, int64_t offset, int whence)
   {
     VERBOSE_LOGGING av_log(NULL, AV_LOG_DEBUG, "   <> SEEK: offset=%lld, whence=%d\n", offset, whence);
-    auto *bd = (ReadContext*)opaque;
+    auto *bd = (InputContext*)opaque;
     return bd->Seek(offset, whence);
   }
 
@@ -113,75 +252,60 @@ namespace
   //////////////////////////////
   struct WriteContext
   {
-    WriteContext(std::vector<uint8_t> &bytes) : bytes(bytes) {}
+    WriteContext(OutputSink &bytes) : bytes(bytes) {}
     ~WriteContext() {
       VERBOSE_LOGGING av_log(NULL, AV_LOG_DEBUG, "WriteContext destroyed.\n");
     }
 
     int Write(uint8_t *buf, int buf_size)
     {
-      if (pos == bytes.size()) // append bytes
-      {
-        bytes.insert(bytes.end(), buf, buf + buf_size);
-        pos = bytes.size();
-      }
-      else if (pos < bytes.size()) // overwrite bytes
-      {
-#if 0
-        // remove current bytes
-        {
-          auto start = bytes.begin() + pos;
-          auto end = start + buf_size;
-          bytes.erase(start, end);
-        }
-
-        // insert new bytes
-        bytes.insert(bytes.begin()+pos, buf, buf + buf_size);
-#else
-        // TODO: make sure we don't overrun the buffer
-        auto *ptr = bytes.data()+pos;
-        std::memcpy(ptr, buf, buf_size);
-#endif
-
-        pos += buf_size;
-      }
-      else {
-        av_log(NULL, AV_LOG_ERROR, "INVALID Write Position: %d, size=%d\n", (int)pos, (int)bytes.size());
+      // appends and seek-back overwrites (e.g. the mp4 moov patch) both land in place
+      int n = bytes.WriteAt(pos, buf, buf_size);
+      if (n < 0) {
+        av_log(NULL, AV_LOG_ERROR, "WriteContext: write failed at %lld\n", (long long)pos);
+        return AVERROR(EIO);
       }
+      pos += n;
 
-      return buf_size;
+      return n;
     }
 
     int64_t Seek(int64_t offset, int whence)
     {
       if (whence & AVSEEK_SIZE) {
-        return bytes.size();
+        return bytes.Size();
       }
 
-      switch (whence)
+      int64_t newPos = pos;
+      switch (whence & ~AVSEEK_FORCE)
       {
         case SEEK_SET:
-          pos = offset;
+          newPos = offset;
           break;
 
         case SEEK_CUR:
-          // verify
-          pos += offset;
+          newPos += offset;
           break;
 
         case SEEK_END:
-          // verify
-          pos = bytes.size() - offset;
+          newPos = bytes.Size() + offset;
           break;
 
         default:
           av_log(NULL, AV_LOG_DEBUG, "WriteContext::Seek: Unhandled whence=%d\n", whence);
+          return AVERROR(EINVAL);
+      }
+
+      if (newPos < 0) {
+        av_log(NULL, AV_LOG_ERROR, "INVALID Write Position: %lld, size=%lld\n", (long long)newPos, (long long)bytes.Size());
+        return AVERROR(EINVAL);
       }
 
+      pos = newPos;
       return pos;
     }
 
-    std::vector<uint8_t> &bytes;
+    OutputSink &bytes;
     int64_t pos = 0;
   };
 
@@ -251,49 +375,209 @@ void InitFFmpegUtils()
 }
 
 
-AVFormatContext* CreateInputFormatContext(const uint8_t *buf, int size, int &outErrCode)
+namespace
+{
+  // reads the bits of an H.264 NAL unit, skipping emulation prevention bytes
+  struct NALBitReader
+  {
+    const uint8_t *buf;
+    int size;
+    int pos = 0;   // byte
+    int bit = 0;   // next bit in buf[pos], from the top
+    int zeros = 0; // 0x00 bytes in a row before pos
+    bool overrun = false;
+
+    NALBitReader(const uint8_t *buf, int size) : buf(buf), size(size) {}
+
+    int ReadBit()
+    {
+      if (bit == 0) {
+        // 00 00 03 -> 00 00
+        if (zeros >= 2 && pos < size && buf[pos] == 3) {
+          ++pos;
+          zeros = 0;
+        }
+        if (pos >= size) {
+          overrun = true;
+          return 0;
+        }
+        zeros = buf[pos] ? 0 : zeros + 1;
+      }
+
+      int b = (buf[pos] >> (7 - bit)) & 1;
+      if (++bit == 8) {
+        bit = 0;
+        ++pos;
+      }
+      return b;
+    }
+
+    int ReadBits(int n)
+    {
+      int v = 0;
+      while (n--)
+        v = (v << 1) | ReadBit();
+      return v;
+    }
+
+    // Exp-Golomb
+    int ReadUE()
+    {
+      int leadingZeros = 0;
+      while (!ReadBit() && !overrun)
+        if (++leadingZeros > 31)
+          overrun = true;
+      return overrun ? 0 : (1 << leadingZeros) - 1 + ReadBits(leadingZeros);
+    }
+  };
+
+  AVPixelFormat PixelFormatFor(int chromaFormat, int bitDepth)
+  {
+    static const AVPixelFormat formats[][2] = {
+      { AV_PIX_FMT_GRAY8,   AV_PIX_FMT_GRAY10LE },
+      { AV_PIX_FMT_YUV420P, AV_PIX_FMT_YUV420P10LE },
+      { AV_PIX_FMT_YUV422P, AV_PIX_FMT_YUV422P10LE },
+      { AV_PIX_FMT_YUV444P, AV_PIX_FMT_YUV444P10LE },
+    };
+
+    if (chromaFormat < 0 || chromaFormat > 3 || (bitDepth != 8 && bitDepth != 10))
+      return AV_PIX_FMT_NONE;
+    return formats[chromaFormat][bitDepth == 10];
+  }
+
+  // sps: the NAL unit, header byte included
+  AVPixelFormat H264SPSPixelFormat(const uint8_t *sps, int size)
+  {
+    NALBitReader r(sps, size);
+    if ((r.ReadBits(8) & 0x1f) != 7)
+      return AV_PIX_FMT_NONE;
+
+    int profile = r.ReadBits(8);
+    r.ReadBits(16); // constraint flags, level
+    r.ReadUE();     // seq_parameter_set_id
+
+    int chromaFormat = 1;
+    int bitDepth = 8;
+    // the profiles that code chroma_format_idc and the bit depths (7.3.2.1.1)
+    switch (profile) {
+      case 100: case 110: case 122: case 244: case 44:
+      case 83: case 86: case 118: case 128: case 138:
+      case 139: case 134: case 135:
+        chromaFormat = r.ReadUE();
+        if (chromaFormat == 3)
+          r.ReadBit(); // separate_colour_plane_flag
+        bitDepth = r.ReadUE() + 8;
+        break;
+    }
+
+    return r.overrun ? AV_PIX_FMT_NONE : PixelFormatFor(chromaFormat, bitDepth);
+  }
+
+  AVPixelFormat H264PixelFormat(const uint8_t *extra, int size)
+  {
+    // avcC: the SPS count is in byte 5 and the first SPS follows its 16-bit length
+    if (size >= 8 && extra[0] == 1) {
+      int spsSize = (extra[6] << 8) | extra[7];
+      if ((extra[5] & 0x1f) == 0 || 8 + spsSize > size)
+        return AV_PIX_FMT_NONE;
+      return H264SPSPixelFormat(extra + 8, spsSize);
+    }
+
+    // Annex B: look for an SPS after a start code
+    for (int i = 0; i + 3 < size; ++i) {
+      if (extra[i] == 0 && extra[i + 1] == 0 && extra[i + 2] == 1 && (extra[i + 3] & 0x1f) == 7)
+        return H264SPSPixelFormat(extra + i + 3, size - i - 3);
+    }
+    return AV_PIX_FMT_NONE;
+  }
+
+  AVPixelFormat HEVCPixelFormat(const uint8_t *extra, int size)
+  {
+    // hvcC carries chromaFormat and bitDepthLumaMinus8 in the low bits of bytes 16 and 17
+    if (size < 23 || extra[0] != 1)
+      return AV_PIX_FMT_NONE;
+    return PixelFormatFor(extra[16] & 3, (extra[17] & 7) + 8);
+  }
+
+  // the decoder's output format as far as the codec headers tell; full range
+  // (yuvj) only shows up once a frame is decoded
+  AVPixelFormat HeaderPixelFormat(const AVCodecParameters *par)
+  {
+    if (par->format != AV_PIX_FMT_NONE)
+      return (AVPixelFormat)par->format;
+    if (!par->extradata)
+      return AV_PIX_FMT_NONE;
+
+    switch (par->codec_id) {
+      case AV_CODEC_ID_H264: return H264PixelFormat(par->extradata, par->extradata_size);
+      case AV_CODEC_ID_HEVC: return HEVCPixelFormat(par->extradata, par->extradata_size);
+      default:               return AV_PIX_FMT_NONE;
+    }
+  }
+}
+
+
+// true when the container headers alone filled in everything GetVideoMetaData() needs.
+// Both frame rates have to be there: the mov demuxer only sets r_frame_rate for
+// constant frame rate tracks (one stts entry), and a variable rate clip needs
+// the full probe to work it out from the timestamps.  The pixel format has to
+// come from the H.264/HEVC parameter sets; other codecs get the full probe.
+static bool HasVideoHeaderInfo(AVFormatContext *ic)
+{
+  AVStream *st = GetFirstStreamForType(ic, AVMEDIA_TYPE_VIDEO);
+  return st &&
+         st->codecpar->codec_id != AV_CODEC_ID_NONE &&
+         st->codecpar->width > 0 &&
+         st->codecpar->height > 0 &&
+         st->avg_frame_rate.num > 0 &&
+         st->r_frame_rate.num > 0 &&
+         HeaderPixelFormat(st->codecpar) != AV_PIX_FMT_NONE;
+}
+
+
+// takes ownership of avio_ctx
+static AVFormatContext* OpenInputFormatContext(AVIOContext *avio_ctx, ProbeMode probe, int &outErrCode)
 {
-  bool success = false;
   AVFormatContext *fmt_ctx = NULL;
-  AVIOContext *avio_ctx = NULL;
-  uint8_t *buffer = NULL, *avio_ctx_buffer = NULL;
-  size_t buffer_size, avio_ctx_buffer_size = 4096;
   int ret = 0;
-  int errCode = 0;
 
-  // fill opaque structure used by the AVIOContext read callback
-  VERBOSE_LOGGING av_log(NULL, AV_LOG_DEBUG, "FILE_INFO: size=%d, base=%p\n", size, buf);
   if (!(fmt_ctx = avformat_alloc_context())) {
-    ret = AVERROR(ENOMEM);
-    goto end;
-  }
-
-  avio_ctx = CreateIOReadContext(buf, size, errCode);
-  if (!avio_ctx) {
-    ret = errCode;
-    goto end;
+    FreeIOReadContext(avio_ctx);
+    outErrCode = AVERROR(ENOMEM);
+    return nullptr;
   }
 
   fmt_ctx->pb = avio_ctx;
   ret = avformat_open_input(&fmt_ctx, NULL, NULL, NULL);
   if (ret < 0) {
+    // avformat_open_input() frees fmt_ctx on failure, but not our custom I/O context
     av_log(NULL, AV_LOG_ERROR, "Could not open input\n");
+    FreeIOReadContext(avio_ctx);
+    fmt_ctx = nullptr;
+    goto end;
+  }
+
+  // MP4/MOV headers carry the dimensions, frame rate and frame count, so there is
+  // no need to decode frames unless something is missing
+  if (probe == ProbeMode::HeaderOnly && HasVideoHeaderInfo(fmt_ctx)) {
+    VERBOSE_LOGGING av_log(NULL, AV_LOG_DEBUG, "Skipping avformat_find_stream_info()\n");
+    // only set here: avformat_find_stream_info() takes a set format as already probed
+    AVStream *st = GetFirstStreamForType(fmt_ctx, AVMEDIA_TYPE_VIDEO);
+    st->codecpar->format = HeaderPixelFormat(st->codecpar);
     goto end;
   }
 
   ret = avformat_find_stream_info(fmt_ctx, NULL);
   if (ret < 0) {
     av_log(NULL, AV_LOG_ERROR, "Could not find stream information\n");
+    FreeInputFormatContext(fmt_ctx);
+    fmt_ctx = nullptr;
     goto end;
   }
 
 end:
   if (ret < 0)
-  {
     av_log(NULL, AV_LOG_ERROR, "Error occurred: %s\n", av_err2str(ret));
-    FreeInputFormatContext(fmt_ctx);
-    fmt_ctx = nullptr;
-  }
 
   outErrCode = ret;
 
@@ -301,6 +585,42 @@ end:
 }
 
 
+AVFormatContext* CreateInputFormatContext(const uint8_t *buf, int64_t size, int &outErrCode, IOReadMode mode, ProbeMode probe)
+{
+  int errCode = 0;
+
+  // fill opaque structure used by the AVIOContext read callback
+  VERBOSE_LOGGING av_log(NULL, AV_LOG_DEBUG, "FILE_INFO: size=%lld, base=%p\n", (long long)size, buf);
+
+  AVIOContext *avio_ctx = CreateIOReadContext(buf, size, errCode, mode);
+  if (!avio_ctx) {
+    outErrCode = errCode;
+    return nullptr;
+  }
+
+  return OpenInputFormatContext(avio_ctx, probe, outErrCode);
+}
+
+
+AVFormatContext* CreateInputFormatContext(std::shared_ptr<InputSource> source, int &outErrCode, ProbeMode probe)
+{
+  int errCode = 0;
+
+  // A header probe only touches the ftyp/moov atoms (at either end of the file),
+  // so read just the bytes asked for instead of whole read-ahead windows; reads
+  // past the headers only happen if the probe falls back to the full one.
+  AVIOContext *avio_ctx = probe == ProbeMode::HeaderOnly
+                        ? CreateIOReadContext(source, errCode, 0x8000, 0)
+                        : CreateIOReadContext(source, errCode);
+  if (!avio_ctx) {
+    outErrCode = errCode;
+    return nullptr;
+  }
+
+  return OpenInputFormatContext(avio_ctx, probe, outErrCode);
+}
+
+
 void FreeInputFormatContext(AVFormatContext *ic)
 {
   FreeIOReadContext(ic->pb);
@@ -324,6 +644,23 @@ AVStream* GetFirstStreamForType(AVFormatContext *cxt, AVMediaType type)
   return stream;
 }
 
+// clockwise rotation in degrees, from the display matrix or else the "rotate" tag
+static int GetStreamRotation(AVStream *st)
+{
+  const uint8_t *displaymatrix = av_stream_get_side_data(st, AV_PKT_DATA_DISPLAYMATRIX, NULL);
+  if (displaymatrix)
+  {
+    // same convention as the ffmpeg tool's get_rotation()
+    double theta = -av_display_rotation_get((const int32_t*)displaymatrix);
+    theta -= 360 * floor(theta / 360 + 0.9 / 360);
+    return (int)lrint(theta);
+  }
+
+  AVDictionaryEntry *entry = av_dict_get(st->metadata, "rotate", NULL, 0);
+  return entry ? std::atoi(entry->value) : 0;
+}
+
+
 bool GetVideoMetaData(AVFormatContext *cxt, VideoMetaData &meta)
 {
   bool valid = false;
@@ -331,26 +668,51 @@ bool GetVideoMetaData(AVFormatContext *cxt, VideoMetaData &meta)
 
   if (st)
   {
-    int rotation = 0;
+    meta.avgFrameRate  = av_q2d(st->avg_frame_rate);
+    meta.realFrameRate = av_q2d(st->r_frame_rate);
+    meta.numFrames     = st->nb_frames;
+    meta.duration      = (double)cxt->duration / AV_TIME_BASE;
 
-    AVDictionaryEntry *entry = nullptr;
-    while ( ( entry = av_dict_get(st->metadata, "", entry, AV_DICT_IGNORE_SUFFIX)) )
+    // the format-level duration is only filled in by avformat_find_stream_info()
+    if (cxt->duration == AV_NOPTS_VALUE || cxt->duration <= 0)
     {
-      if (!strcmp(entry->key, "rotate")) {
-        rotation = std::atoi(entry->value);
+      meta.duration = 0;
+      for (unsigned i = 0; i < cxt->nb_streams; ++i)
+      {
+        AVStream *s = cxt->streams[i];
+        if (s->duration != AV_NOPTS_VALUE && s->duration > 0)
+          meta.duration = FFMAX(meta.duration, s->duration * av_q2d(s->time_base));
       }
     }
-    // the rotation matrix can also be obtained from:
-    // st->side_data[i].type == AV_PKT_DATA_DISPLAYMATRIX, av_display_rotation_get((int32_t *)sd.data)
 
-    meta.avgFrameRate  = av_q2d(st->avg_frame_rate);
-    meta.realFrameRate = av_q2d(st->r_frame_rate);
-    meta.numFrames     = st->nb_frames;
-    meta.duration      = (double)cxt->duration / AV_TIME_BASE;
-    meta.rotation      = rotation;
-    meta.vidWidth      = st->codecpar->width;
-    meta.vidHeight     = st->codecpar->height;
-    meta.vidCodec      = avcodec_get_name(st->codecpar->codec_id);
+    const char *pixfmt = av_get_pix_fmt_name((AVPixelFormat)st->codecpar->format);
+
+    meta.rotation       = GetStreamRotation(st);
+    meta.vidWidth       = st->codecpar->width;
+    meta.vidHeight      = st->codecpar->height;
+    meta.vidCodec       = avcodec_get_name(st->codecpar->codec_id);
+    meta.vidPixelFormat = pixfmt ? pixfmt : "";
+    meta.vidBitRate     = st->codecpar->bit_rate;
+
+    AVStream *audio = GetFirstStreamForType(cxt, AVMEDIA_TYPE_AUDIO);
+    meta.hasAudio = audio != nullptr;
+    if (audio)
+    {
+      meta.audioCodec      = avcodec_get_name(audio->codecpar->codec_id);
+      meta.audioSampleRate = audio->codecpar->sample_rate;
+      meta.audioChannels   = audio->codecpar->channels;
+      meta.audioBitRate    = audio->codecpar->bit_rate;
+    }
+
+    // also only computed by avformat_find_stream_info(); the streams' rates are the next best thing
+    meta.bitRate = cxt->bit_rate;
+    if (meta.bitRate <= 0)
+    {
+      meta.bitRate = 0;
+      for (unsigned i = 0; i < cxt->nb_streams; ++i)
+        meta.bitRate += FFMAX(cxt->streams[i]->codecpar->bit_rate, 0);
+    }
+
     valid = true;
   }
 
@@ -358,15 +720,35 @@ bool GetVideoMetaData(AVFormatContext *cxt, VideoMetaData &meta)
 }
 
 
+bool ScanVideoPackets(AVFormatContext *cxt, VideoMetaData &meta, PacketIndex *index)
+{
+  PacketIndex localIndex;
+  if (!index)
+    index = &localIndex;
+
+  if (index->Empty() && !BuildPacketIndex(cxt, *index))
+    return false;
+
+  meta.numFrames      = (int)index->Count();
+  meta.keyframeTimes  = index->KeyframeTimes();
+  meta.packetsScanned = true;
+  return true;
+}
+
+
 
 
-AVIOContext* CreateIOReadContext(const uint8_t *buf, int size, int &outErrCode)
+AVIOContext* CreateIOReadContext(const uint8_t *buf, int64_t size, int &outErrCode, IOReadMode mode)
 {
   AVIOContext *iocxt = NULL;
-  uint8_t *buffer = NULL, *avio_ctx_buffer = NULL;
-  size_t buffer_size, avio_ctx_buffer_size = 0x1000;
+  uint8_t *avio_ctx_buffer = NULL;
+  size_t avio_ctx_buffer_size = 0x1000;
   int ret = 0;
-  auto *bd = new ReadContext(buf, size); // TODO: needs to be deleted
+
+  // In direct mode the AVIO buffer only serves the small header reads (avio_rb32() and
+  // friends), so give it room for a whole moov atom; packet payloads bypass it entirely.
+  if (mode == IOReadMode::Direct)
+    avio_ctx_buffer_size = (size_t)FFMAX(0x1000, FFMIN(size, (int64_t)0x40000));
 
   avio_ctx_buffer = (unsigned char*)av_malloc(avio_ctx_buffer_size);
   if (!avio_ctx_buffer) {
@@ -374,25 +756,79 @@ AVIOContext* CreateIOReadContext(const uint8_t *buf, int size, int &outErrCode)
     outErrCode = ret;
     return nullptr;
   }
+
+  auto *bd = new ReadContext(buf, size); // deleted by FreeIOReadContext()
   iocxt = avio_alloc_context(avio_ctx_buffer, avio_ctx_buffer_size,
                                0, bd, &ReadPacket, nullptr, &Seek);
   if (!iocxt) {
+    delete bd;
+    av_freep(&avio_ctx_buffer);
     ret = AVERROR(ENOMEM);
     outErrCode = ret;
     return nullptr;
   }
 
+  bd->io = iocxt;
+
+  // avio_read() hands reads straight to ReadPacket() with the caller's destination
+  // (usually the AVPacket payload), so every byte is copied exactly once.
+  if (mode == IOReadMode::Direct)
+    iocxt->direct = 1;
+
   return iocxt;
 };
 
 
+AVIOContext* CreateIOReadContext(std::shared_ptr<InputSource> source, int &outErrCode,
+                                 size_t bufferSize, size_t readAheadSize)
+{
+  AVIOContext *iocxt = NULL;
+  uint8_t *avio_ctx_buffer = NULL;
+  size_t avio_ctx_buffer_size = FFMAX(0x1000, bufferSize);
+
+  if (!source) {
+    outErrCode = AVERROR(EINVAL);
+    return nullptr;
+  }
+
+  avio_ctx_buffer = (unsigned char*)av_malloc(avio_ctx_buffer_size);
+  if (!avio_ctx_buffer) {
+    outErrCode = AVERROR(ENOMEM);
+    return nullptr;
+  }
+
+  auto *bd = new SourceReadContext(source, readAheadSize); // deleted by FreeIOReadContext()
+  iocxt = avio_alloc_context(avio_ctx_buffer, avio_ctx_buffer_size,
+                               0, bd, &ReadPacket, nullptr, &Seek);
+  if (!iocxt) {
+    delete bd;
+    av_freep(&avio_ctx_buffer);
+    outErrCode = AVERROR(ENOMEM);
+    return nullptr;
+  }
+
+  bd->io = iocxt;
+  iocxt->direct = 1;
+
+  return iocxt;
+}
+
+
+IOReadStats GetIOReadStats(AVIOContext *io)
+{
+  if (io && io->opaque)
+    return reinterpret_cast<InputContext*>(io->opaque)->stats;
+  return IOReadStats();
+}
+
+
 
 
 void FreeIOReadContext(AVIOContext *io)
 {
   if (io) {
     if (io->opaque)
-      delete reinterpret_cast<ReadContext*>(io->opaque);
+      delete reinterpret_cast<InputContext*>(io->opaque);
     if (io->buffer)
       av_freep(&io->buffer);
     av_freep(&io);
@@ -401,7 +837,7 @@ void FreeIOReadContext(AVIOContext *io)
 
 
 
-AVIOContext* CreateIOWriteContext(std::vector<uint8_t> &bytes, int &outErrCode)
+AVIOContext* CreateIOWriteContext(OutputSink &bytes, int &outErrCode)
 {
   AVIOContext *iocxt = nullptr;
   uint8_t *buffer = nullptr, *avio_ctx_buffer = nullptr;
@@ -519,31 +955,6 @@ void FreeIOWriteContext(AVIOContext *io)
 #include <cstdio>
 #include <string>
 
-// set to 0 to use stdio for file I/O
-#define USE_AVIO_WRITE 1
-#define USE_AVIO_READ  1
-
-static bool loadFileBytes(const std::string &filename, std::vector<uint8_t> &bytes)
-{
-  bool success = false;
-
-  FILE *f = fopen(filename.c_str(), "rb");
-  if (f)
-  {
-    fseek(f, 0, SEEK_END);
-    auto size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    bytes.resize(size);
-    auto total = fread(bytes.data(), 1, bytes.size(), f);
-    success = true;
-    fclose(f);
-  }
-
-  return success;
-}
-
-
-
 
 #include <string>
 #include <cstdio>
@@ -571,8 +982,21 @@ struct TranscodeContext
   AVFilterContext *buffersink_ctx = nullptr;
   AVFilterContext *buffersrc_ctx = nullptr;
   AVFilterGraph *filter_graph = nullptr;
+  std::unique_ptr<FrameRotator> rotator; // used instead of filter_graph when set
+  std::shared_ptr<FramePool> framePool;  // decoder output, rotated frames and frame structs
 
   int video_stream_index = -1; // video stream index in input file
+  PacketIndex *packetIndex = nullptr; // records the video packets as they are read
+  int threads = 1; // per codec
+  int segments = 1; // GOP-aligned ranges transcoded in parallel (see transcode_segmented())
+  int segmentThreads = 1; // per codec in each segment
+  bool pipelined = true; // decode, rotate and encode on separate threads (see transcode_pipelined())
+  EncodeOptions encode;
+  RotationMode rotationMode = RotationMode::Bake; // what a transmux does with the rotation
+  bool rotationInMatrix = false; // set once the rotation has been written to the output's display matrix
+
+  // when set, encoded packets are collected here instead of being muxed
+  std::vector<AVPacket*> *encodedPackets = nullptr;
 
   // mapping from input file to output file streams
   // streams that don't exist in the output file are
@@ -598,11 +1022,11 @@ struct TranscodeContext
         break;
 
       case 180:
-        filter_descr = "transpose=clock,transpose=clock";
+        filter_descr = "hflip,vflip";
         break;
 
-      case 270: // untested
-        filter_descr = "transpose=clock,transpose=clock,transpose=clock";
+      case 270:
+        filter_descr = "transpose=cclock";
         break;
 
       default:
@@ -611,21 +1035,76 @@ struct TranscodeContext
         this->rotation = 0;
     }
   }
+
+  // true when transcode_segmented() does the work, with its own codecs
+  bool segmented() const
+  {
+    return !transmuxOnly && segments > 1;
+  }
+
+  // the encoded picture size: the decoded one rotated, then scaled down to
+  // encode.maxDimension
+  void outputSize(int &width, int &height) const
+  {
+    width  = (rotation == 90 || rotation == 270) ? dec_ctx->height : dec_ctx->width;
+    height = (rotation == 90 || rotation == 270) ? dec_ctx->width : dec_ctx->height;
+    ScaleToFit(width, height, encode.maxDimension);
+  }
 };
 
 
-static int setup_input_file(TranscodeContext &ctx, AVFormatContext *ic)
+// creates and opens ctx.dec_ctx for ctx.video_stream_index
+static int open_video_decoder(TranscodeContext &ctx)
 {
   int ret = -1;
-  AVCodec *dec = nullptr;
+  AVStream *st = ctx.ifmt_ctx->streams[ctx.video_stream_index];
+
+  AVCodec *dec = avcodec_find_decoder(st->codecpar->codec_id);
+  if (!dec) {
+    av_log(NULL, AV_LOG_ERROR, "Cannot find a decoder for the video stream\n");
+    return AVERROR_DECODER_NOT_FOUND;
+  }
+
+  // create decoding context
+  ctx.dec_ctx = avcodec_alloc_context3(dec);
+  if (!ctx.dec_ctx)
+    return AVERROR(ENOMEM);
+
+  avcodec_parameters_to_context(ctx.dec_ctx, st->codecpar);
+  ctx.dec_ctx->framerate = av_guess_frame_rate(ctx.ifmt_ctx, st, NULL);
+
+  // the segments open decoders of their own; this one only describes the input
+  if (ctx.segmented())
+    return 0;
+
+  // frame threading decodes several frames at once (H.264/HEVC), slice
+  // threading splits up each frame; FFmpeg uses whichever the codec supports.
+  // Transmuxing never decodes, so don't start threads for it.
+  ctx.dec_ctx->thread_count = ctx.transmuxOnly ? 1 : ctx.threads;
+  ctx.dec_ctx->thread_type  = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+  if (ctx.framePool)
+    ctx.framePool->AttachDecoder(ctx.dec_ctx);
+
+  // init the video decoder
+  if ((ret = avcodec_open2(ctx.dec_ctx, dec, NULL)) < 0) {
+    av_log(NULL, AV_LOG_ERROR, "Cannot open video decoder\n");
+    return ret;
+  }
+
+  return 0;
+}
+
 
-  int errcode = 0;
+static int setup_input_file(TranscodeContext &ctx, AVFormatContext *ic)
+{
+  int ret = -1;
 
   // Cleanup
   ctx.ifmt_ctx = ic;
 
   // select the video stream
-  ret = av_find_best_stream(ctx.ifmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &dec, 0);
+  ret = av_find_best_stream(ctx.ifmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
   if (ret < 0) {
     av_log(NULL, AV_LOG_ERROR, "Cannot find a video stream in the input file\n");
     return ret;
@@ -633,17 +1112,104 @@ static int setup_input_file(TranscodeContext &ctx, AVFormatContext *ic)
 
   ctx.video_stream_index = ret;
 
-  // create decoding context
-  ctx.dec_ctx = avcodec_alloc_context3(dec);
-  if (!ctx.dec_ctx)
+  return open_video_decoder(ctx);
+}
+
+
+// creates and opens ctx.enc_ctx for the output of ctx.dec_ctx after rotation;
+// ctx.ofmt_ctx decides whether the encoder writes global headers
+static int open_video_encoder(TranscodeContext &ctx)
+{
+  int ret = -1;
+
+  AVCodec *encoder = avcodec_find_encoder_by_name(ctx.videoEncoderName.c_str());
+  if (!encoder)
+  {
+    av_log(NULL, AV_LOG_FATAL, "Necessary encoder not found\n");
+    return AVERROR_INVALIDDATA;
+  }
+
+  ctx.enc_ctx = avcodec_alloc_context3(encoder);
+  if (!ctx.enc_ctx)
+  {
+    av_log(NULL, AV_LOG_FATAL, "Failed to allocate the encoder context\n");
     return AVERROR(ENOMEM);
+  }
 
-  avcodec_parameters_to_context(ctx.dec_ctx, ctx.ifmt_ctx->streams[ctx.video_stream_index]->codecpar);
-  ctx.dec_ctx->framerate = av_guess_frame_rate(ctx.ifmt_ctx, ctx.ifmt_ctx->streams[ctx.video_stream_index], NULL);
+  if (ctx.dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+  {
+    ctx.outputSize(ctx.enc_ctx->width, ctx.enc_ctx->height);
 
-  // init the video decoder
-  if ((ret = avcodec_open2(ctx.dec_ctx, dec, NULL)) < 0) {
-    av_log(NULL, AV_LOG_ERROR, "Cannot open video decoder\n");
+    ctx.enc_ctx->sample_aspect_ratio = ctx.dec_ctx->sample_aspect_ratio;
+    // the decoder's format if the encoder takes it, so nothing has to convert
+    ctx.enc_ctx->pix_fmt = ctx.dec_ctx->pix_fmt;
+    if (encoder->pix_fmts)
+    {
+      const AVPixelFormat *fmt = encoder->pix_fmts;
+      while (*fmt != AV_PIX_FMT_NONE && *fmt != ctx.dec_ctx->pix_fmt)
+        ++fmt;
+      if (*fmt == AV_PIX_FMT_NONE)
+        ctx.enc_ctx->pix_fmt = encoder->pix_fmts[0];
+    }
+
+    // video time_base can be set to whatever is handy and supported by encoder
+    ctx.enc_ctx->time_base = av_inv_q(ctx.dec_ctx->framerate); // invert rational
+  }
+
+  if (ctx.ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+    ctx.enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+  // openh264 encodes the slices of a frame in parallel, so it needs one per thread.
+  // A segmented transcode's encoder only provides the output stream's parameters,
+  // so it gets the segments' settings.
+  const int threads = ctx.segmented() ? ctx.segmentThreads : ctx.threads;
+  ctx.enc_ctx->thread_count = threads;
+  ctx.enc_ctx->thread_type  = FF_THREAD_SLICE;
+  if (threads > 1)
+    ctx.enc_ctx->slices = threads;
+
+  const EncodeOptions &encode = ctx.encode;
+  ctx.enc_ctx->bit_rate = encode.bitRate;
+  if (encode.gopSize > 0)
+    ctx.enc_ctx->gop_size = encode.gopSize;
+  if (encode.quality > 0)
+    ctx.enc_ctx->qmax = FFMIN(encode.quality, 51);
+
+  // the rest are libopenh264's private options
+  AVDictionary *opts = nullptr;
+  switch (encode.rateControl)
+  {
+    case RateControl::Bitrate: av_dict_set(&opts, "rc_mode", "bitrate", 0); break;
+    case RateControl::Quality: av_dict_set(&opts, "rc_mode", "quality", 0); break;
+    case RateControl::Buffer:  av_dict_set(&opts, "rc_mode", "buffer", 0);  break;
+    case RateControl::Off:     av_dict_set(&opts, "rc_mode", "off", 0);     break;
+  }
+  switch (encode.complexity)
+  {
+    case EncodeComplexity::Low:
+      av_dict_set(&opts, "coder", "cavlc", 0);
+      av_dict_set(&opts, "loopfilter", "0", 0);
+      av_dict_set(&opts, "allow_skip_frames", "1", 0);
+      break;
+    case EncodeComplexity::Medium:
+      break;
+    case EncodeComplexity::High:
+      av_dict_set(&opts, "coder", "cabac", 0);
+      av_dict_set(&opts, "profile", "high", 0);
+      break;
+  }
+
+  ret = avcodec_open2(ctx.enc_ctx, encoder, &opts);
+
+  // whatever is left wasn't recognized
+  AVDictionaryEntry *e = nullptr;
+  while ((e = av_dict_get(opts, "", e, AV_DICT_IGNORE_SUFFIX)))
+    av_log(NULL, AV_LOG_WARNING, "%s ignored option %s=%s\n", encoder->name, e->key, e->value);
+  av_dict_free(&opts);
+
+  if (ret < 0)
+  {
+    av_log(NULL, AV_LOG_ERROR, "Cannot open video encoder\n");
     return ret;
   }
 
@@ -654,7 +1220,32 @@ static int setup_input_file(TranscodeContext &ctx, AVFormatContext *ic)
 
 
 
-static int open_output_file(TranscodeContext &ctx, std::vector<uint8_t> &outBytes, const char *filename)
+// In RotationMode::Matrix, gives the copied video stream a display matrix
+// holding ctx.rotation, which the MP4/MOV muxer writes into the track header
+static int set_display_rotation(TranscodeContext &ctx, int stream_index, AVStream *out_stream)
+{
+  if (!ctx.transmuxOnly || ctx.rotationMode != RotationMode::Matrix ||
+      stream_index != ctx.video_stream_index || ctx.rotation == 0)
+    return 0;
+
+  const char *muxer = ctx.ofmt_ctx->oformat->name;
+  if (!strstr(muxer, "mp4") && !strstr(muxer, "mov")) {
+    av_log(NULL, AV_LOG_WARNING, "%s has no display matrix; the rotation is stripped\n", muxer);
+    return 0;
+  }
+
+  uint8_t *matrix = av_stream_new_side_data(out_stream, AV_PKT_DATA_DISPLAYMATRIX, 9 * sizeof(int32_t));
+  if (!matrix)
+    return AVERROR(ENOMEM);
+
+  // the matrix angle is counterclockwise
+  av_display_rotation_set((int32_t*)matrix, -ctx.rotation);
+  ctx.rotationInMatrix = true;
+  return 0;
+}
+
+
+static int open_output_file(TranscodeContext &ctx, OutputSink &outBytes, const char *filename)
 {
   int ret = -1;
 
@@ -700,61 +1291,8 @@ static int open_output_file(TranscodeContext &ctx, std::vector<uint8_t> &outByte
 
     if (!ctx.transmuxOnly && in_stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
     {
-      AVCodec *encoder = avcodec_find_encoder_by_name(ctx.videoEncoderName.c_str());
-      if (!encoder)
-      {
-        av_log(NULL, AV_LOG_FATAL, "Necessary encoder not found\n");
-        return AVERROR_INVALIDDATA;
-      }
-
-      ctx.enc_ctx = avcodec_alloc_context3(encoder);
-      if (!ctx.enc_ctx)
-      {
-        av_log(NULL, AV_LOG_FATAL, "Failed to allocate the encoder context\n");
-        return AVERROR(ENOMEM);
-      }
-
-      // In this example, we transcode to same properties (picture size,
-      // sample rate etc.). These properties can be changed for output
-      // streams easily using filters
-      if (ctx.dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
-      {
-        if (ctx.rotation == 90 || ctx.rotation == 270)
-        {
-          ctx.enc_ctx->height = ctx.dec_ctx->width;
-          ctx.enc_ctx->width = ctx.dec_ctx->height;
-        }
-        else
-        {
-          ctx.enc_ctx->height = ctx.dec_ctx->height;
-          ctx.enc_ctx->width = ctx.dec_ctx->width;
-        }
-
-        ctx.enc_ctx->sample_aspect_ratio = ctx.dec_ctx->sample_aspect_ratio;
-        // take first format from list of supported formats
-        if (encoder->pix_fmts)
-          ctx.enc_ctx->pix_fmt = encoder->pix_fmts[0];
-        else
-          ctx.enc_ctx->pix_fmt = ctx.dec_ctx->pix_fmt;
-
-//        ctx.enc_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
-
-        // video time_base can be set to whatever is handy and supported by encoder
-        ctx.enc_ctx->time_base = av_inv_q(ctx.dec_ctx->framerate); // invert rational
-      }
-
-      if (ctx.ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
-        ctx.enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-
-      // Third parameter can be used to pass settings to encoder
-      AVDictionary *opts = nullptr; // TODO: does this need to be cleaned up?
-      av_dict_set(&opts, "b", "2.5M", 0); // bit rate
-      ret = avcodec_open2(ctx.enc_ctx, encoder, &opts);
-      if (ret < 0)
-      {
-        av_log(NULL, AV_LOG_ERROR, "Cannot open video encoder for stream #%u\n", i);
+      if ((ret = open_video_encoder(ctx)) < 0)
         return ret;
-      }
 
       ret = avcodec_parameters_from_context(out_stream->codecpar, ctx.enc_ctx);
       if (ret < 0)
@@ -764,6 +1302,10 @@ static int open_output_file(TranscodeContext &ctx, std::vector<uint8_t> &outByte
       }
 
       out_stream->time_base = ctx.enc_ctx->time_base;
+
+      // transcode_segment() checks its encoders against these parameters
+      if (ctx.segmented())
+        avcodec_free_context(&ctx.enc_ctx);
     }
     else // ELSE if AVMEDIA_TYPE_AUDIO
     {
@@ -775,6 +1317,9 @@ static int open_output_file(TranscodeContext &ctx, std::vector<uint8_t> &outByte
         return ret;
       }
       out_stream->time_base = in_stream->time_base;
+
+      if ((ret = set_display_rotation(ctx, i, out_stream)) < 0)
+        return ret;
     }
     // ELSE
       // DON'T CREATE THE STREAM
@@ -878,6 +1423,71 @@ end:
 }
 
 
+// The rotation kernel rotates and downscales every decoder format the encoder
+// can take in one step; anything else (and a frame that needs
+// neither) goes through the filter graph.
+static int init_rotation(TranscodeContext &ctx)
+{
+  int width = 0, height = 0;
+  ctx.outputSize(width, height);
+  const bool scaled = FFMAX(width, height) < FFMAX(ctx.dec_ctx->width, ctx.dec_ctx->height);
+
+  if ((scaled || ctx.rotation != 0) && FrameRotator::Supports(ctx.dec_ctx->pix_fmt, ctx.rotation)) {
+    ctx.rotator.reset(new FrameRotator(ctx.rotation, ctx.framePool, scaled ? ctx.encode.maxDimension : 0));
+    return 0;
+  }
+
+  // the scale filter needs libswscale, which the WASM build leaves out
+  std::string descr = ctx.filter_descr;
+  if (scaled)
+    descr = (ctx.rotation ? descr + "," : "") + "scale=" + std::to_string(width) + ":" + std::to_string(height);
+  return init_filters(ctx, descr.c_str());
+}
+
+
+// rotates frame into a new frame in *out and releases frame's buffers,
+// like pushing it through the filter graph would
+static int rotate_frame(TranscodeContext &ctx, AVFrame *frame, AVFrame **out)
+{
+  *out = ctx.framePool->AcquireFrame();
+  if (!*out) {
+    av_frame_unref(frame);
+    return AVERROR(ENOMEM);
+  }
+
+  int ret = ctx.rotator->Rotate(frame, *out);
+  av_frame_unref(frame);
+  if (ret < 0) {
+    av_log(NULL, AV_LOG_ERROR, "Error while rotating a frame\n");
+    av_frame_free(out);
+    return ret;
+  }
+
+  (*out)->pict_type = AV_PICTURE_TYPE_NONE;
+  return 0;
+}
+
+
+static void log_frame_pool_stats(const TranscodeContext &ctx)
+{
+  if (!ctx.framePool)
+    return;
+
+  const FramePool::Stats stats = ctx.framePool->GetStats();
+  av_log(NULL, AV_LOG_INFO, "Frame pool: %lld buffer allocations for %lld buffers, %lld frame allocations for %lld frames\n",
+         (long long)stats.bufferAllocs, (long long)stats.bufferGets,
+         (long long)stats.frameAllocs, (long long)stats.frameGets);
+}
+
+
+static void log_rotation_stats(const TranscodeContext &ctx)
+{
+  if (ctx.rotator && ctx.rotator->Frames() > 0)
+    av_log(NULL, AV_LOG_INFO, "Rotation kernel: %lld frames, %.3f ms/frame\n",
+           (long long)ctx.rotator->Frames(), 1000.0 * ctx.rotator->Seconds() / ctx.rotator->Frames());
+}
+
+
 ///////////////////////////////////////////////////////////////////////////
 // Encode and write frame to the output file
 static int encode_write_frame(TranscodeContext &ctx, AVFrame *frame, unsigned int stream_index, int *got_frame)
@@ -893,7 +1503,7 @@ static int encode_write_frame(TranscodeContext &ctx, AVFrame *frame, unsigned in
 
   // send the frame to the encoder
   int ret = avcodec_send_frame(ctx.enc_ctx, frame);
-  av_frame_free(&frame);
+  ctx.framePool->ReleaseFrame(frame);
   if (ret < 0) {
     av_log(NULL, AV_LOG_ERROR, "avcodec_send_frame returned %d\n", ret);
     return ret;
@@ -923,6 +1533,18 @@ static int encode_write_frame(TranscodeContext &ctx, AVFrame *frame, unsigned in
     enc_pkt.stream_index = ctx.stream_map[stream_index];
     enc_pkt.pos = -1;
 
+    if (ctx.encodedPackets)
+    {
+      AVPacket *kept = av_packet_alloc();
+      if (!kept) {
+        av_packet_unref(&enc_pkt);
+        return AVERROR(ENOMEM);
+      }
+      av_packet_move_ref(kept, &enc_pkt);
+      ctx.encodedPackets->push_back(kept);
+      continue;
+    }
+
     ret = av_interleaved_write_frame(ctx.ofmt_ctx, &enc_pkt);
     if (ret < 0) {
       av_log(NULL, AV_LOG_ERROR, "av_interleaved_write_frame returned %d\n", ret);
@@ -939,6 +1561,16 @@ static int encode_write_frame(TranscodeContext &ctx, AVFrame *frame, unsigned in
 // apply filter to frame, encode and write to output file
 static int filter_encode_write_frame(TranscodeContext &ctx, AVFrame *frame, unsigned int stream_index)
 {
+  if (ctx.rotator)
+  {
+    if (!frame)
+      return 0; // nothing is buffered
+
+    AVFrame *rotated = nullptr;
+    int ret = rotate_frame(ctx, frame, &rotated);
+    return ret < 0 ? ret : encode_write_frame(ctx, rotated, stream_index, NULL);
+  }
+
   // push the decoded frame into the filtergraph
   int ret = av_buffersrc_add_frame_flags(ctx.buffersrc_ctx, frame, 0);
   if (ret < 0)
@@ -950,7 +1582,7 @@ static int filter_encode_write_frame(TranscodeContext &ctx, AVFrame *frame, unsi
   // pull filtered frames from the filtergraph
   while (1)
   {
-    auto *filt_frame = av_frame_alloc(); // filtered frame
+    auto *filt_frame = ctx.framePool->AcquireFrame(); // filtered frame
     if (!filt_frame)
     {
       ret = AVERROR(ENOMEM);
@@ -965,7 +1597,7 @@ static int filter_encode_write_frame(TranscodeContext &ctx, AVFrame *frame, unsi
       // rewrite retcode to 0 to show it as normal procedure completion
       if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
         ret = 0;
-      av_frame_free(&filt_frame);
+      ctx.framePool->ReleaseFrame(filt_frame);
       break;
     }
 
@@ -980,6 +1612,40 @@ static int filter_encode_write_frame(TranscodeContext &ctx, AVFrame *frame, unsi
 }
 
 
+// Decodes packet (NULL drains the decoder) and sends every frame it yields
+// through the filter graph or rotator to the encoder.  This is the one path
+// decoded frames take in the sequential transcode.
+static int decode_filter_encode(TranscodeContext &ctx, const AVPacket *packet, AVFrame *frame)
+{
+  int ret = avcodec_send_packet(ctx.dec_ctx, packet);
+  if (ret < 0)
+  {
+    av_log(NULL, AV_LOG_ERROR, "Error while sending a packet to the decoder\n");
+    return ret;
+  }
+
+  while (1)
+  {
+    ret = avcodec_receive_frame(ctx.dec_ctx, frame);
+    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+      return 0;
+    if (ret < 0) {
+      av_log(NULL, AV_LOG_ERROR, "Error while receiving a frame from the decoder\n");
+      return ret;
+    }
+    frame->pts = frame->best_effort_timestamp;
+
+    // takes the frame's references
+    ret = filter_encode_write_frame(ctx, frame, ctx.video_stream_index);
+    if (ret < 0) {
+      av_log(NULL, AV_LOG_ERROR, "filter_encode_write_frame returned %d\n", ret);
+      av_frame_unref(frame);
+      return ret;
+    }
+  }
+}
+
+
 // flush any pending frames to the output file
 static int flush_encoder(TranscodeContext &ctx, unsigned int stream_index)
 {
@@ -1002,104 +1668,710 @@ static int flush_encoder(TranscodeContext &ctx, unsigned int stream_index)
   return ret;
 }
 
-static bool Transcode(TranscodeContext &ctx,
-                      AVFormatContext *ic,
-                      const std::string &filename, // filename extension used to determine output container type
-                      std::vector<uint8_t> &outBytes,
-                      int &outErrCode)
+#if VST_HAVE_THREADS
+namespace
 {
-  int ret = -1;
+  // one unit of work flowing down the pipeline: a frame for the video stream,
+  // or a packet of another stream that is remuxed as is
+  struct PipelineItem
+  {
+    AVFrame *frame = nullptr;
+    AVPacket *packet = nullptr;
+  };
 
-  VideoMetaData meta;
+  using PipelineQueue = SPSCQueue<PipelineItem>;
 
-  AVPacket packet;
-  AVFrame *frame = av_frame_alloc();
-  AVFrame *filt_frame = av_frame_alloc();
-  if (!frame || !filt_frame)
+  // frames in flight per queue; a 4K 4:2:0 frame is ~12MB, so keep this small
+  const size_t kPipelineDepth = 4;
+
+  void FreePipelineItem(PipelineItem &item)
   {
-    if (frame) av_frame_free(&frame);
-    if (filt_frame) av_frame_free(&filt_frame);
-    outErrCode = 1; //
-    return false;
+    av_frame_free(&item.frame);
+    av_packet_free(&item.packet);
   }
 
-  if ((ret = setup_input_file(ctx, ic)) < 0)
-    goto end;
+  double SecondsSince(std::chrono::steady_clock::time_point start)
+  {
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+  }
 
-  (void)GetVideoMetaData(ctx.ifmt_ctx, meta);
-  ctx.setRotation(meta.rotation);
+  // Which stage limits throughput: a stage that is rarely blocked is the
+  // bottleneck, and the queue in front of it stays full.
+  void LogPipelineStats(const PipelineQueue &decoded, const PipelineQueue &filtered, double seconds)
+  {
+    const auto &d = decoded.GetStats();
+    const auto &f = filtered.GetStats();
+    const auto busy = [seconds](double blocked) { return seconds > 0 ? 100.0 * (1.0 - blocked / seconds) : 0.0; };
+
+    av_log(NULL, AV_LOG_INFO, "Pipeline: %.3f sec, %lld frames\n", seconds, (long long)d.pushes);
+    av_log(NULL, AV_LOG_INFO, "  decode: busy %5.1f%%\n", busy(d.fullSeconds));
+    av_log(NULL, AV_LOG_INFO, "  filter: busy %5.1f%%\n", busy(d.emptySeconds + f.fullSeconds));
+    av_log(NULL, AV_LOG_INFO, "  encode: busy %5.1f%%\n", busy(f.emptySeconds));
+    av_log(NULL, AV_LOG_INFO, "  decoded queue:  avg %.2f of %zu\n", d.AverageOccupancy(), decoded.Capacity());
+    av_log(NULL, AV_LOG_INFO, "  filtered queue: avg %.2f of %zu\n", f.AverageOccupancy(), filtered.Capacity());
+  }
+}
 
-  if ((ret = open_output_file(ctx, outBytes, filename.c_str())) < 0)
-    goto end;
 
-  av_log(NULL, AV_LOG_INFO, "===== INPUT FILE =====\n");
-  av_dump_format(ctx.ifmt_ctx, 0, "infile", 0);
+// Decode -> filter -> encode, each stage on its own thread, connected by bounded
+// queues so that decoding frame N+1 overlaps filtering and encoding frame N.
+// Packets of remuxed streams travel down the same queues to keep their order
+// relative to the video.  Runs everything up to (not including) the trailer.
+static int transcode_pipelined(TranscodeContext &ctx)
+{
+  PipelineQueue decoded(kPipelineDepth);
+  PipelineQueue filtered(kPipelineDepth);
+  std::atomic<int> error { 0 };
+
+  const auto fail = [&](int ret) {
+    int expected = 0;
+    error.compare_exchange_strong(expected, ret);
+    decoded.Close();
+    filtered.Close();
+  };
 
-  av_log(NULL, AV_LOG_INFO, "===== OUTPUT FILE =====\n");
-  av_dump_format(ctx.ofmt_ctx, 1, filename.c_str(), 1);
+  auto start = std::chrono::steady_clock::now();
 
-  if ((ret = init_filters(ctx, ctx.filter_descr.c_str())) < 0)
-    goto end;
+  // filter stage
+  std::thread filterThread([&]() {
+    PipelineItem item;
+    int ret = 0;
 
-  // read all packets
-  while (1)
-  {
-    if ((ret = av_read_frame(ctx.ifmt_ctx, &packet)) < 0) {
-      if (ret != AVERROR_EOF)
-        av_log(NULL, AV_LOG_ERROR, "av_read_frame returned: %d (%d)\n", ret, AVERROR_EOF);
-      break;
+    // pull whatever the graph has ready
+    const auto drain = [&]() -> int {
+      while (1)
+      {
+        AVFrame *filt_frame = ctx.framePool->AcquireFrame();
+        if (!filt_frame)
+          return AVERROR(ENOMEM);
+
+        int r = av_buffersink_get_frame(ctx.buffersink_ctx, filt_frame);
+        if (r < 0) {
+          ctx.framePool->ReleaseFrame(filt_frame);
+          return (r == AVERROR(EAGAIN) || r == AVERROR_EOF) ? 0 : r;
+        }
+
+        filt_frame->pts = filt_frame->best_effort_timestamp;
+        filt_frame->pict_type = AV_PICTURE_TYPE_NONE;
+
+        PipelineItem out;
+        out.frame = filt_frame;
+        if (!filtered.Push(out)) {
+          FreePipelineItem(out);
+          return AVERROR_EXIT;
+        }
+      }
+    };
+
+    while (ret >= 0 && decoded.Pop(item))
+    {
+      if (item.frame && ctx.rotator)
+      {
+        PipelineItem out;
+        ret = rotate_frame(ctx, item.frame, &out.frame);
+        ctx.framePool->ReleaseFrame(item.frame);
+        if (ret >= 0 && !filtered.Push(out)) {
+          FreePipelineItem(out);
+          ret = AVERROR_EXIT;
+        }
+      }
+      else if (item.frame)
+      {
+        ret = av_buffersrc_add_frame_flags(ctx.buffersrc_ctx, item.frame, 0);
+        ctx.framePool->ReleaseFrame(item.frame);
+        if (ret < 0)
+          av_log(NULL, AV_LOG_ERROR, "Error while feeding the filtergraph\n");
+        else
+          ret = drain();
+      }
+      else if (!filtered.Push(item))
+      {
+        FreePipelineItem(item);
+        ret = AVERROR_EXIT;
+      }
     }
 
-    if (!ctx.transmuxOnly && packet.stream_index == ctx.video_stream_index)
+    // flush the graph
+    if (ret >= 0 && !error.load() && !ctx.rotator) {
+      ret = av_buffersrc_add_frame_flags(ctx.buffersrc_ctx, NULL, 0);
+      if (ret >= 0)
+        ret = drain();
+    }
+
+    if (ret < 0)
+      fail(ret);
+    filtered.Close();
+  });
+
+  // encode + mux stage
+  std::thread encodeThread([&]() {
+    PipelineItem item;
+    int ret = 0;
+
+    while (ret >= 0 && filtered.Pop(item))
     {
-      ret = avcodec_send_packet(ctx.dec_ctx, &packet);
-      if (ret < 0)
+      if (item.frame)
       {
-        av_log(NULL, AV_LOG_ERROR, "Error while sending a packet to the decoder\n");
-        break;
+        ret = encode_write_frame(ctx, item.frame, ctx.video_stream_index, NULL); // frees the frame
+        item.frame = nullptr;
+      }
+      else
+      {
+        AVPacket *packet = item.packet;
+        av_packet_rescale_ts(packet,
+                             ctx.ifmt_ctx->streams[packet->stream_index]->time_base,
+                             ctx.ofmt_ctx->streams[ctx.stream_map[packet->stream_index]]->time_base);
+        packet->stream_index = ctx.stream_map[packet->stream_index];
+        ret = av_interleaved_write_frame(ctx.ofmt_ctx, packet);
+        av_packet_free(&item.packet);
       }
+    }
+
+    if (ret >= 0 && !error.load())
+      ret = flush_encoder(ctx, ctx.video_stream_index);
+
+    if (ret < 0)
+      fail(ret);
+  });
 
-      while (ret >= 0)
+  // demux + decode stage, on this thread
+  {
+    AVPacket packet;
+    AVFrame *frame = nullptr;
+    int ret = 0;
+
+    const auto sendDecoded = [&]() -> int {
+      while (1)
       {
-        ret = avcodec_receive_frame(ctx.dec_ctx, frame);
-        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-          break;
-        } else if (ret < 0) {
+        if (!frame && !(frame = ctx.framePool->AcquireFrame()))
+          return AVERROR(ENOMEM);
+
+        int r = avcodec_receive_frame(ctx.dec_ctx, frame);
+        if (r == AVERROR(EAGAIN) || r == AVERROR_EOF)
+          return 0;
+        if (r < 0) {
           av_log(NULL, AV_LOG_ERROR, "Error while receiving a frame from the decoder\n");
-          goto end;
+          return r;
         }
+
         frame->pts = frame->best_effort_timestamp;
 
-        // push the decoded frame into the filtergraph
-        if (av_buffersrc_add_frame_flags(ctx.buffersrc_ctx, frame, AV_BUFFERSRC_FLAG_KEEP_REF) < 0)
-        {
-          av_log(NULL, AV_LOG_ERROR, "Error while feeding the filtergraph\n");
-          break;
+        PipelineItem item;
+        item.frame = frame;
+        frame = nullptr;
+        if (!decoded.Push(item)) {
+          FreePipelineItem(item);
+          return AVERROR_EXIT;
         }
+      }
+    };
 
-        // pull filtered frames from the filtergraph
-        while (1)
-        {
-          ret = av_buffersink_get_frame(ctx.buffersink_ctx, filt_frame);
-          if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-            break;
-          if (ret < 0)
-            goto end;
+    while (ret >= 0 && (ret = av_read_frame(ctx.ifmt_ctx, &packet)) >= 0)
+    {
+      if (ctx.packetIndex && packet.stream_index == ctx.video_stream_index)
+        ctx.packetIndex->Add(packet);
 
-          frame->pts = frame->best_effort_timestamp;
-          ret = filter_encode_write_frame(ctx, frame, packet.stream_index);
-          if (ret < 0) {
-            av_log(NULL, AV_LOG_ERROR, "filter_encode_write_frame returned %d\n", ret);
-            break;
+      if (packet.stream_index == ctx.video_stream_index)
+      {
+        ret = avcodec_send_packet(ctx.dec_ctx, &packet);
+        if (ret < 0)
+          av_log(NULL, AV_LOG_ERROR, "Error while sending a packet to the decoder\n");
+        else
+          ret = sendDecoded();
+      }
+      else if (ctx.stream_map[packet.stream_index] >= 0)
+      {
+        PipelineItem item;
+        if (!(item.packet = av_packet_alloc())) {
+          ret = AVERROR(ENOMEM);
+        }
+        else {
+          av_packet_move_ref(item.packet, &packet);
+          if (!decoded.Push(item)) {
+            FreePipelineItem(item);
+            ret = AVERROR_EXIT;
           }
-
-          av_frame_unref(filt_frame);
         }
+      }
+
+      av_packet_unref(&packet);
+    }
+
+    if (ret == AVERROR_EOF)
+    {
+      // flush the decoder
+      ret = avcodec_send_packet(ctx.dec_ctx, NULL);
+      if (ret >= 0)
+        ret = sendDecoded();
+    }
+    else if (ret < 0 && ret != AVERROR_EXIT)
+      av_log(NULL, AV_LOG_ERROR, "av_read_frame returned: %d (%d)\n", ret, AVERROR_EOF);
+
+    ctx.framePool->ReleaseFrame(frame);
+
+    if (ret < 0)
+      fail(ret);
+    decoded.Close();
+  }
+
+  filterThread.join();
+  encodeThread.join();
+
+  // release anything an aborted stage left behind
+  PipelineItem item;
+  while (decoded.TryPopRemaining(item))
+    FreePipelineItem(item);
+  while (filtered.TryPopRemaining(item))
+    FreePipelineItem(item);
+
+  LogPipelineStats(decoded, filtered, SecondsSince(start));
+
+  return error.load();
+}
+
+namespace
+{
+  // one GOP-aligned range of the video stream and what it was encoded to
+  struct Segment
+  {
+    size_t number = 0;
+    int64_t first = 0;                 // range of video packets, in decode order
+    int64_t end = -1;                  // (-1 until the next segment starts)
+    int64_t startPts = AV_NOPTS_VALUE; // frames with startPts <= pts < endPts belong
+    int64_t endPts = AV_NOPTS_VALUE;   // to this segment (AV_NOPTS_VALUE: unbounded)
+
+    // The range plus the GOP after it.  In an open GOP the frames that follow a
+    // keyframe in decode order but come before it in display order reference
+    // the previous GOP, so they belong to the segment before the split.
+    std::vector<AVPacket*> packets;
+    bool complete = false;             // all packets are in and the worker started
+    std::thread worker;
+
+    std::vector<AVPacket*> encoded;    // already in the output stream's time base
+    double seconds = 0;
+    int error = 0;
+  };
+
+  // Video packets per segment at most: few enough that the segments in flight
+  // hold a small part of a long video, enough that the extra GOP each one
+  // decodes and the keyframe each one starts with don't cost much.
+  const int64_t kMaxSegmentPackets = 900;
+
+  void FreePackets(std::vector<AVPacket*> &packets)
+  {
+    for (AVPacket *&packet : packets)
+      av_packet_free(&packet);
+    packets.clear();
+  }
+
+  int64_t PacketTime(const AVPacket *packet)
+  {
+    return packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+  }
+}
+
+
+// Decodes, rotates and encodes one segment with its own codecs and filter graph.
+// Runs on a worker thread; only reads ctx.
+static void transcode_segment(const TranscodeContext &ctx, Segment &seg)
+{
+  auto start = std::chrono::steady_clock::now();
+
+  TranscodeContext sctx;
+  sctx.ifmt_ctx = ctx.ifmt_ctx;
+  sctx.ofmt_ctx = ctx.ofmt_ctx; // for the stream time bases and global header flag
+  sctx.video_stream_index = ctx.video_stream_index;
+  sctx.stream_map = ctx.stream_map;
+  sctx.videoEncoderName = ctx.videoEncoderName;
+  sctx.threads = ctx.segmentThreads;
+  sctx.encodedPackets = &seg.encoded;
+  sctx.framePool = ctx.framePool;
+  sctx.encode = ctx.encode;
+  sctx.setRotation(ctx.rotation);
+
+  AVFrame *frame = av_frame_alloc();
+  int ret = frame ? 0 : AVERROR(ENOMEM);
+  if (ret >= 0)
+    ret = open_video_decoder(sctx);
+  if (ret >= 0)
+    ret = open_video_encoder(sctx);
+
+  // The output stream's avcC holds the parameter sets of the encoder that
+  // open_output_file() opened, so they are all a player has to decode this
+  // segment's packets with.
+  if (ret >= 0)
+  {
+    const AVCodecParameters *par = ctx.ofmt_ctx->streams[ctx.stream_map[ctx.video_stream_index]]->codecpar;
+    if (sctx.enc_ctx->extradata_size != par->extradata_size ||
+        (par->extradata_size > 0 && memcmp(sctx.enc_ctx->extradata, par->extradata, par->extradata_size) != 0)) {
+      av_log(NULL, AV_LOG_ERROR, "Segment %zu: the encoder's parameter sets differ from the output stream's\n", seg.number);
+      ret = AVERROR_INVALIDDATA;
+    }
+  }
+
+  if (ret >= 0)
+    ret = init_rotation(sctx);
+
+  // every packet, then a NULL packet to flush the decoder
+  for (size_t i = 0; ret >= 0 && i <= seg.packets.size(); ++i)
+  {
+    ret = avcodec_send_packet(sctx.dec_ctx, i < seg.packets.size() ? seg.packets[i] : NULL);
+    if (ret < 0) {
+      av_log(NULL, AV_LOG_ERROR, "Error while sending a packet to the decoder\n");
+      break;
+    }
 
+    while (ret >= 0)
+    {
+      ret = avcodec_receive_frame(sctx.dec_ctx, frame);
+      if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+        ret = 0;
+        break;
+      }
+      if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Error while receiving a frame from the decoder\n");
+        break;
+      }
+
+      frame->pts = frame->best_effort_timestamp;
+
+      // frames before startPts are the previous segment's (and can't be decoded
+      // here in an open GOP), those from endPts on the next segment's
+      if (frame->pts != AV_NOPTS_VALUE &&
+          ((seg.startPts != AV_NOPTS_VALUE && frame->pts < seg.startPts) ||
+           (seg.endPts != AV_NOPTS_VALUE && frame->pts >= seg.endPts))) {
         av_frame_unref(frame);
+        continue;
       }
 
-      av_packet_unref(&packet);
+      ret = filter_encode_write_frame(sctx, frame, sctx.video_stream_index);
+    }
+  }
+
+  // flush the filter and the encoder
+  if (ret >= 0)
+    ret = filter_encode_write_frame(sctx, NULL, sctx.video_stream_index);
+  if (ret >= 0) {
+    ret = flush_encoder(sctx, sctx.video_stream_index);
+    if (ret == AVERROR_EOF)
+      ret = 0;
+  }
+
+  log_rotation_stats(sctx);
+
+  av_frame_free(&frame);
+  avfilter_graph_free(&sctx.filter_graph);
+  avcodec_free_context(&sctx.dec_ctx);
+  avcodec_free_context(&sctx.enc_ctx);
+
+  // the packets aren't needed for muxing
+  FreePackets(seg.packets);
+
+  seg.error = ret;
+  seg.seconds = SecondsSince(start);
+}
+
+
+// Reads the input once, cutting the video at keyframes into segments of about
+// the same size, and transcodes each segment on its own thread as soon as its
+// packets are in.  At most ctx.segments of them are in flight: before the next
+// one is started the oldest is waited for, muxed (with the remuxed streams
+// interleaved by time) and freed.
+// Runs everything up to (not including) the trailer.
+static int transcode_segmented(TranscodeContext &ctx)
+{
+  auto start = std::chrono::steady_clock::now();
+
+  const AVStream *in_video = ctx.ifmt_ctx->streams[ctx.video_stream_index];
+  const int out_video_index = ctx.stream_map[ctx.video_stream_index];
+  const AVRational out_time_base = ctx.ofmt_ctx->streams[out_video_index]->time_base;
+  const size_t inFlight = (size_t)ctx.segments;
+
+  // the split points only need the packet count, which MP4/MOV headers have
+  int64_t total = in_video->nb_frames;
+  if (total <= 0) {
+    PacketIndex index;
+    total = BuildPacketIndex(ctx.ifmt_ctx, index) ? (int64_t)index.Count() : 0;
+  }
+
+  // a multiple of the segments that run at once, so the last ones finish together
+  int64_t count = FFMAX((int64_t)inFlight, (total + kMaxSegmentPackets - 1) / kMaxSegmentPackets);
+  count = (count + inFlight - 1) / inFlight * inFlight;
+  const int64_t segmentPackets = total > 0 ? FFMAX((int64_t)1, total / count) : kMaxSegmentPackets;
+
+  std::deque<Segment> segments;  // not muxed yet, oldest first
+  std::deque<AVPacket*> other;   // remuxed packets not written yet, in file order
+  int64_t videoPackets = 0;
+  int64_t last_dts = AV_NOPTS_VALUE;
+  size_t muxed = 0;
+
+  const auto write_other = [&]() -> int {
+    AVPacket *p = other.front();
+    other.pop_front();
+    av_packet_rescale_ts(p,
+                         ctx.ifmt_ctx->streams[p->stream_index]->time_base,
+                         ctx.ofmt_ctx->streams[ctx.stream_map[p->stream_index]]->time_base);
+    p->stream_index = ctx.stream_map[p->stream_index];
+    int r = av_interleaved_write_frame(ctx.ofmt_ctx, p);
+    av_packet_free(&p);
+    return r;
+  };
+
+  const auto start_segment = [&](Segment &seg) {
+    seg.complete = true;
+    seg.worker = std::thread([&ctx, &seg]() { transcode_segment(ctx, seg); });
+  };
+
+  // waits for the oldest segment and writes it out
+  const auto mux_oldest = [&]() -> int {
+    Segment &seg = segments.front();
+    seg.worker.join();
+
+    av_log(NULL, AV_LOG_INFO, "  segment %zu: %lld packets, %.3f sec\n",
+           seg.number, (long long)(seg.end - seg.first), seg.seconds);
+
+    int r = seg.error;
+    for (AVPacket *p : seg.encoded)
+    {
+      if (r < 0)
+        break;
+
+      // The segments split the frames into disjoint pts ranges at the keyframes,
+      // and the encoder doesn't reorder frames (openh264 has no B-frames), so
+      // every dts here comes after the segment before's.  If one doesn't, the
+      // cut is wrong, and patching the timestamps up would only hide that.
+      if (p->dts != AV_NOPTS_VALUE)
+      {
+        if (last_dts != AV_NOPTS_VALUE && p->dts <= last_dts) {
+          av_log(NULL, AV_LOG_ERROR, "Segment %zu overlaps the one before it (dts %lld after %lld)\n",
+                 seg.number, (long long)p->dts, (long long)last_dts);
+          r = AVERROR_INVALIDDATA;
+          break;
+        }
+        last_dts = p->dts;
+
+        // the remuxed packets that come before this one
+        while (r >= 0 && !other.empty())
+        {
+          AVPacket *o = other.front();
+          if (av_compare_ts(PacketTime(o), ctx.ifmt_ctx->streams[o->stream_index]->time_base, p->dts, out_time_base) > 0)
+            break;
+          r = write_other();
+        }
+      }
+
+      if (r >= 0)
+        r = av_interleaved_write_frame(ctx.ofmt_ctx, p);
+    }
+
+    FreePackets(seg.encoded);
+    segments.pop_front();
+    ++muxed;
+    return r;
+  };
+
+  AVPacket packet;
+  int ret = 0;
+  while (ret >= 0 && (ret = av_read_frame(ctx.ifmt_ctx, &packet)) >= 0)
+  {
+    if (packet.stream_index == ctx.video_stream_index)
+    {
+      if (ctx.packetIndex)
+        ctx.packetIndex->Add(packet);
+
+      const bool key = (packet.flags & AV_PKT_FLAG_KEY) && PacketTime(&packet) != AV_NOPTS_VALUE;
+
+      // the segment before the current one takes packets up to the first keyframe after its range
+      for (Segment &seg : segments)
+      {
+        if (key && !seg.complete && seg.end >= 0)
+          start_segment(seg);
+      }
+
+      if (segments.empty() || (key && videoPackets - segments.back().first >= segmentPackets))
+      {
+        if (!segments.empty()) {
+          segments.back().end    = videoPackets;
+          segments.back().endPts = PacketTime(&packet);
+        }
+
+        // only the last one is still taking packets; the rest are running
+        while (ret >= 0 && segments.size() > inFlight)
+          ret = mux_oldest();
+
+        segments.emplace_back();
+        Segment &seg = segments.back();
+        seg.number   = muxed + segments.size() - 1;
+        seg.first    = videoPackets;
+        seg.startPts = seg.number ? PacketTime(&packet) : AV_NOPTS_VALUE;
+      }
+
+      for (Segment &seg : segments)
+      {
+        if (ret >= 0 && !seg.complete)
+        {
+          AVPacket *kept = av_packet_clone(&packet);
+          if (!kept)
+            ret = AVERROR(ENOMEM);
+          else
+            seg.packets.push_back(kept);
+        }
+      }
+
+      ++videoPackets;
+    }
+    else if (ctx.stream_map[packet.stream_index] >= 0)
+    {
+      AVPacket *kept = av_packet_alloc();
+      if (!kept)
+        ret = AVERROR(ENOMEM);
+      else {
+        av_packet_move_ref(kept, &packet);
+        other.push_back(kept);
+      }
+    }
+
+    av_packet_unref(&packet);
+  }
+
+  if (ret != AVERROR_EOF)
+  {
+    av_log(NULL, AV_LOG_ERROR, "av_read_frame returned: %d (%d)\n", ret, AVERROR_EOF);
+    goto end;
+  }
+  ret = 0;
+
+  if (!segments.empty())
+    segments.back().end = videoPackets;
+  for (Segment &seg : segments)
+  {
+    if (!seg.complete)
+      start_segment(seg);
+  }
+
+  while (ret >= 0 && !segments.empty())
+    ret = mux_oldest();
+  while (ret >= 0 && !other.empty())
+    ret = write_other();
+
+  if (ret >= 0)
+    av_log(NULL, AV_LOG_INFO, "Segmented transcode: %.3f sec, %zu segments (%zu at a time), %d codec threads each\n",
+           SecondsSince(start), muxed, inFlight, ctx.segmentThreads);
+
+end:
+  for (Segment &seg : segments)
+  {
+    if (seg.worker.joinable())
+      seg.worker.join();
+    FreePackets(seg.packets);
+    FreePackets(seg.encoded);
+  }
+  for (AVPacket *&p : other)
+    av_packet_free(&p);
+
+  return ret;
+}
+#endif
+
+
+// returns: the thread count each codec gets for TranscodeOptions::threads
+static int CodecThreadCount(int threads)
+{
+#if VST_HAVE_THREADS
+#ifdef __EMSCRIPTEN__
+  // everything a transcode starts has to fit in PTHREAD_POOL_SIZE (src/CMakeLists.txt)
+  const int maxThreads = 8;
+#else
+  const int maxThreads = 16; // what FFmpeg itself caps automatic thread counts at
+#endif
+  if (threads <= 0)
+    threads = (int)std::thread::hardware_concurrency();
+  return FFMAX(1, FFMIN(threads, maxThreads));
+#else
+  return 1;
+#endif
+}
+
+
+static bool Transcode(TranscodeContext &ctx,
+                      AVFormatContext *ic,
+                      const std::string &filename, // filename extension used to determine output container type
+                      OutputSink &outBytes,
+                      int &outErrCode,
+                      TranscodeReport *outReport = nullptr)
+{
+  int ret = -1;
+
+  VideoMetaData meta;
+
+  AVPacket packet;
+  AVFrame *frame = av_frame_alloc();
+  if (!frame)
+  {
+    outErrCode = 1; //
+    return false;
+  }
+
+  ctx.framePool = std::make_shared<FramePool>();
+
+  if ((ret = setup_input_file(ctx, ic)) < 0)
+    goto end;
+
+  if (ctx.packetIndex) {
+    AVStream *st = ic->streams[ctx.video_stream_index];
+    ctx.packetIndex->Clear();
+    ctx.packetIndex->streamIndex = ctx.video_stream_index;
+    ctx.packetIndex->timeBase    = st->time_base;
+  }
+
+  (void)GetVideoMetaData(ctx.ifmt_ctx, meta);
+  ctx.setRotation(meta.rotation);
+
+  av_log(NULL, AV_LOG_INFO, "Codec threads: %d, segments: %d\n", ctx.threads, ctx.segments);
+
+  if ((ret = open_output_file(ctx, outBytes, filename.c_str())) < 0)
+    goto end;
+
+  av_log(NULL, AV_LOG_INFO, "===== INPUT FILE =====\n");
+  av_dump_format(ctx.ifmt_ctx, 0, "infile", 0);
+
+  av_log(NULL, AV_LOG_INFO, "===== OUTPUT FILE =====\n");
+  av_dump_format(ctx.ofmt_ctx, 1, filename.c_str(), 1);
+
+  // the segments rotate with filters of their own
+  if (!ctx.segmented() && (ret = init_rotation(ctx)) < 0)
+    goto end;
+
+#if VST_HAVE_THREADS
+  if (ctx.segmented() || (!ctx.transmuxOnly && ctx.pipelined))
+  {
+    ret = ctx.segmented() ? transcode_segmented(ctx) : transcode_pipelined(ctx);
+    if (ret < 0)
+      goto end;
+    goto write_trailer;
+  }
+#endif
+
+  // read all packets
+  while (1)
+  {
+    if ((ret = av_read_frame(ctx.ifmt_ctx, &packet)) < 0) {
+      if (ret != AVERROR_EOF)
+        av_log(NULL, AV_LOG_ERROR, "av_read_frame returned: %d (%d)\n", ret, AVERROR_EOF);
+      break;
+    }
+
+    if (ctx.packetIndex && packet.stream_index == ctx.video_stream_index)
+      ctx.packetIndex->Add(packet);
+
+    if (!ctx.transmuxOnly && packet.stream_index == ctx.video_stream_index)
+    {
+      ret = decode_filter_encode(ctx, &packet, frame);
+      if (ret < 0) {
+        av_packet_unref(&packet);
+        goto end;
+      }
     }
     else if (ctx.stream_map[packet.stream_index] >= 0)
     {
@@ -1124,8 +2396,13 @@ static bool Transcode(TranscodeContext &ctx,
     {
       if (i == ctx.video_stream_index)
       {
+        // flush decoder
+        ret = decode_filter_encode(ctx, NULL, frame);
+        if (ret < 0)
+          goto end;
+
         // flush filter
-        if (!ctx.filter_graph)
+        if (!ctx.filter_graph && !ctx.rotator)
           continue;
         ret = filter_encode_write_frame(ctx, NULL, i);
         if (ret < 0) {
@@ -1143,6 +2420,9 @@ static bool Transcode(TranscodeContext &ctx,
     }
   }
 
+#if VST_HAVE_THREADS
+write_trailer:
+#endif
   ret = av_write_trailer(ctx.ofmt_ctx);
   if (ret < 0) {
     av_log(NULL, AV_LOG_ERROR, "av_write_trailer failed\n");
@@ -1150,13 +2430,22 @@ static bool Transcode(TranscodeContext &ctx,
 
 end:
   outErrCode = ret;
+  log_rotation_stats(ctx);
+  log_frame_pool_stats(ctx);
   avfilter_graph_free(&ctx.filter_graph);
   FreeIOWriteContext(ctx.ofmt_ctx->pb);
   avformat_free_context(ctx.ofmt_ctx);
   avcodec_free_context(&ctx.dec_ctx);
+  avcodec_free_context(&ctx.enc_ctx);
 
   av_frame_free(&frame);
-  av_frame_free(&filt_frame);
+
+  if (outReport) {
+    outReport->reencoded = !ctx.transmuxOnly;
+    outReport->rotation = ctx.transmuxOnly ? ctx.rotation : 0;
+    outReport->rotationInFile = ctx.rotationInMatrix;
+  }
+
   if (ret < 0 && ret != AVERROR_EOF)
   {
     av_log(NULL, AV_LOG_ERROR, "Error occurred: %s\n", av_err2str(ret));
@@ -1171,13 +2460,163 @@ end:
 
 
 
+bool EncodeOptions::FromPreset(const std::string &name, EncodeOptions &options)
+{
+  EncodeOptions preset;
+  if (name == "fast")
+  {
+    // cheap to encode on a low-end device; sized for the analysis UI
+    preset.bitRate = 1500000;
+    preset.complexity = EncodeComplexity::Low;
+    preset.gopSize = 120;
+    preset.maxDimension = 1280;
+  }
+  else if (name == "archival")
+  {
+    preset.rateControl = RateControl::Quality;
+    preset.bitRate = 20000000;
+    preset.quality = 24;
+    preset.complexity = EncodeComplexity::High;
+  }
+  else if (name != "balanced")
+    return false;
+
+  options = preset;
+  return true;
+}
+
+
+
+// Decides whether baking in the rotation needs the video re-encoded, or
+// whether copying the packets gives the player the same thing.
+// returns: true to re-encode; reason says why either way
+// Audio is always copied, whatever happens to the video: nothing here encodes it.
+// returns: false, with reason set, if the output container doesn't take one of
+// ic's audio streams, which would only fail once the muxer gets it
+static bool audio_copy_supported(AVFormatContext *ic, const std::string &filename, std::string &reason)
+{
+  AVOutputFormat *ofmt = av_guess_format(NULL, filename.c_str(), NULL);
+  if (!ofmt)
+    return true; // open_output_file() reports that
+
+  for (unsigned i = 0; i < ic->nb_streams; ++i)
+  {
+    // < 0 means the muxer can't tell, so it gets to try
+    const AVCodecParameters *par = ic->streams[i]->codecpar;
+    if (par->codec_type == AVMEDIA_TYPE_AUDIO &&
+        avformat_query_codec(ofmt, par->codec_id, FF_COMPLIANCE_NORMAL) == 0) {
+      reason = std::string("output container doesn't take ") + avcodec_get_name(par->codec_id) + " audio";
+      return false;
+    }
+  }
+  return true;
+}
+
+
+static bool needs_reencode(AVFormatContext *ic, const std::string &filename,
+                           const TranscodeOptions &options, std::string &reason)
+{
+  if (options.alwaysReencode) {
+    reason = "re-encode requested";
+    return true;
+  }
+
+  const int stream = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+  if (stream < 0) {
+    reason = "no video stream";
+    return true; // and fail there
+  }
+
+  AVStream *st = ic->streams[stream];
+  const int rotation = GetStreamRotation(st);
+  if (rotation != 0) {
+    reason = "rotated " + std::to_string(rotation) + " degrees";
+    return true;
+  }
+
+  const EncodeOptions defaults;
+  const EncodeOptions &encode = options.encode;
+  if (encode.rateControl != defaults.rateControl || encode.bitRate != defaults.bitRate ||
+      encode.quality != defaults.quality || encode.complexity != defaults.complexity ||
+      encode.gopSize != defaults.gopSize || encode.maxDimension != defaults.maxDimension) {
+    reason = "encode options given";
+    return true;
+  }
+
+  // what the encoder would produce, and all browsers play
+  const AVCodecParameters *par = st->codecpar;
+  if (par->codec_id != AV_CODEC_ID_H264) {
+    reason = std::string(avcodec_get_name(par->codec_id)) + " video";
+    return true;
+  }
+  if (par->format != AV_PIX_FMT_YUV420P && par->format != AV_PIX_FMT_YUVJ420P) {
+    const char *name = av_get_pix_fmt_name((AVPixelFormat)par->format);
+    reason = std::string(name ? name : "unknown") + " pixels";
+    return true;
+  }
+
+  AVOutputFormat *ofmt = av_guess_format(NULL, filename.c_str(), NULL);
+  if (!ofmt || avformat_query_codec(ofmt, par->codec_id, FF_COMPLIANCE_NORMAL) != 1) {
+    reason = "output container doesn't take h264";
+    return true;
+  }
+
+  reason = "not rotated; h264 copied";
+  return false;
+}
+
+
 bool TranscodeRotation(AVFormatContext *ic,
                        const std::string &filename, // filename extension used to determine output container type
-                       std::vector<uint8_t> &outBytes,
-                       int &outErrCode)
+                       OutputSink &outBytes,
+                       int &outErrCode,
+                       const TranscodeOptions &options,
+                       PacketIndex *outIndex,
+                       TranscodeReport *outReport)
 {
   TranscodeContext ctx;
-  return Transcode(ctx, ic, filename, outBytes, outErrCode);
+  ctx.packetIndex = outIndex;
+  ctx.threads = CodecThreadCount(options.threads);
+  ctx.pipelined = options.pipelined;
+  ctx.encode = options.encode;
+  ctx.rotationMode = options.rotationMode;
+
+  std::string reason;
+  if (!audio_copy_supported(ic, filename, reason)) {
+    av_log(NULL, AV_LOG_ERROR, "Cannot transcode: %s\n", reason.c_str());
+    if (outReport)
+      outReport->reason = reason;
+    outErrCode = AVERROR(EINVAL);
+    return false;
+  }
+
+  reason = options.rotationMode == RotationMode::Matrix ? "rotation mode matrix" : "rotation mode strip";
+  const bool reencode = options.rotationMode == RotationMode::Bake &&
+                        needs_reencode(ic, filename, options, reason);
+  av_log(NULL, AV_LOG_INFO, "%s video: %s\n", reencode ? "Re-encoding" : "Copying", reason.c_str());
+  if (outReport)
+    outReport->reason = reason;
+
+  // Matrix and Strip, and a video that only needs remuxing, just rewrite the
+  // container like TransmuxStripMeta()
+  if (!reencode)
+  {
+    ctx.transmuxOnly = true;
+    return Transcode(ctx, ic, filename, outBytes, outErrCode, outReport);
+  }
+
+#if VST_HAVE_THREADS
+  if (options.segments > 1)
+  {
+    // no decoder is opened up front and the encoder only describes the output
+    // stream; the segments' codecs do the work
+    ctx.segments = CodecThreadCount(options.segments);
+    ctx.segmentThreads = FFMAX(1, ctx.threads / ctx.segments);
+    ctx.threads = 1;
+  }
+#endif
+
+  return Transcode(ctx, ic, filename, outBytes, outErrCode, outReport);
 }
 
 
@@ -1185,10 +2624,172 @@ bool TranscodeRotation(AVFormatContext *ic,
 // transmux the given file and strip out metadata
 bool TransmuxStripMeta(AVFormatContext *ic,
                        const std::string &filename, // filename extension used to determine output container type
-                       std::vector<uint8_t> &outBytes,
-                       int &outErrCode)
+                       OutputSink &outBytes,
+                       int &outErrCode,
+                       const TranscodeOptions &options,
+                       PacketIndex *outIndex)
 {
+  std::string reason;
+  if (!audio_copy_supported(ic, filename, reason)) {
+    av_log(NULL, AV_LOG_ERROR, "Cannot transmux: %s\n", reason.c_str());
+    outErrCode = AVERROR(EINVAL);
+    return false;
+  }
+
   TranscodeContext ctx;
   ctx.transmuxOnly = true;
+  ctx.packetIndex = outIndex;
+  ctx.threads = CodecThreadCount(options.threads);
   return Transcode(ctx, ic, filename, outBytes, outErrCode);
 }
+
+
+
+// returns: true if format's first plane is 8-bit luma, one byte per pixel
+static bool HasLumaPlane(int format)
+{
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat)format);
+  if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM)))
+    return false;
+  return desc->comp[0].plane == 0 && desc->comp[0].step == 1 && desc->comp[0].depth == 8;
+}
+
+
+bool DecodeVideoLuma(AVFormatContext *ic,
+                     const DecodeOptions &options,
+                     const std::function<bool(const LumaFrame&)> &onFrame,
+                     int &outErrCode)
+{
+  TranscodeContext ctx;
+  ctx.threads = CodecThreadCount(options.threads);
+
+  int ret = -1;
+  AVPacket packet;
+  AVStream *st = nullptr;
+  int64_t startPts = 0;
+  int rotation = 0;
+  std::vector<uint8_t> rotated; // the rotated plane of a rotated video
+  bool done = false;
+
+  AVFrame *frame = av_frame_alloc();
+  if (!frame)
+  {
+    outErrCode = AVERROR(ENOMEM);
+    return false;
+  }
+
+  if ((ret = setup_input_file(ctx, ic)) < 0)
+    goto end;
+
+  st = ic->streams[ctx.video_stream_index];
+  startPts = st->start_time != AV_NOPTS_VALUE ? st->start_time : 0;
+
+  rotation = GetStreamRotation(st);
+  if (rotation != 90 && rotation != 180 && rotation != 270)
+    rotation = 0;
+
+  // land on the keyframe before startTime; the frames up to it are decoded but skipped
+  if (options.startTime > 0)
+  {
+    const bool indexed = options.index && !options.index->Empty() &&
+                         options.index->streamIndex == ctx.video_stream_index;
+    if (indexed)
+      ApplyPacketIndex(ic, *options.index);
+
+    int64_t ts = startPts + (int64_t)(options.startTime / av_q2d(st->time_base));
+    int64_t seeked = indexed ? SeekToGOP(ic, *options.index, ts * av_q2d(st->time_base))
+                             : av_seek_frame(ic, ctx.video_stream_index, ts, AVSEEK_FLAG_BACKWARD);
+    if (seeked < 0)
+      av_log(NULL, AV_LOG_WARNING, "Cannot seek to %.3f sec, decoding from the start\n", options.startTime);
+    else
+      avcodec_flush_buffers(ctx.dec_ctx);
+  }
+
+  while (!done)
+  {
+    // at the end, a NULL packet drains the decoder
+    ret = av_read_frame(ic, &packet);
+    const bool eof = ret == AVERROR_EOF;
+    if (ret < 0 && !eof) {
+      av_log(NULL, AV_LOG_ERROR, "av_read_frame returned: %d (%d)\n", ret, AVERROR_EOF);
+      goto end;
+    }
+
+    if (!eof && packet.stream_index != ctx.video_stream_index) {
+      av_packet_unref(&packet);
+      continue;
+    }
+
+    ret = avcodec_send_packet(ctx.dec_ctx, eof ? NULL : &packet);
+    if (!eof)
+      av_packet_unref(&packet);
+    if (ret < 0) {
+      av_log(NULL, AV_LOG_ERROR, "Error while sending a packet to the decoder\n");
+      goto end;
+    }
+
+    while (!done && (ret = avcodec_receive_frame(ctx.dec_ctx, frame)) >= 0)
+    {
+      LumaFrame luma;
+      luma.time = (frame->best_effort_timestamp - startPts) * av_q2d(st->time_base);
+
+      if (luma.time < options.startTime) {
+        av_frame_unref(frame);
+        continue;
+      }
+      if (options.endTime > 0 && luma.time > options.endTime) {
+        av_frame_unref(frame);
+        done = true;
+        break;
+      }
+
+      if (!HasLumaPlane(frame->format)) {
+        av_log(NULL, AV_LOG_ERROR, "No luma plane in pixel format %s\n",
+               av_get_pix_fmt_name((AVPixelFormat)frame->format));
+        av_frame_unref(frame);
+        ret = AVERROR(ENOSYS);
+        goto end;
+      }
+
+      luma.data   = frame->data[0];
+      luma.stride = frame->linesize[0];
+      luma.width  = frame->width;
+      luma.height = frame->height;
+
+      if (rotation != 0)
+      {
+        if (rotation != 180)
+          std::swap(luma.width, luma.height);
+        rotated.resize((size_t)luma.width * luma.height);
+        RotatePlane(frame->data[0], frame->linesize[0], frame->width, frame->height,
+                    rotated.data(), luma.width, rotation);
+        luma.data   = rotated.data();
+        luma.stride = luma.width;
+      }
+
+      done = !onFrame(luma);
+      av_frame_unref(frame);
+    }
+
+    if (ret == AVERROR_EOF || (eof && ret == AVERROR(EAGAIN)))
+      done = true;
+    else if (ret < 0 && ret != AVERROR(EAGAIN)) {
+      av_log(NULL, AV_LOG_ERROR, "Error while receiving a frame from the decoder\n");
+      goto end;
+    }
+    ret = 0;
+  }
+
+end:
+  outErrCode = ret;
+  avcodec_free_context(&ctx.dec_ctx);
+  av_frame_free(&frame);
+
+  if (ret < 0)
+  {
+    av_log(NULL, AV_LOG_ERROR, "Error occurred: %s\n", av_err2str(ret));
+    return false;
+  }
+
+  return true;
+}
@@ -5,46 +5,227 @@ extern "C" {
 #include <libavformat/avformat.h>
 }
 
+#include <functional>
 #include <vector>
 #include <string>
+#include <memory>
+
+#include "inputsource.h"
+#include "outputsink.h"
+
+struct PacketIndex;
+
+// native builds and WASM builds with pthreads can spread work over threads
+#if !defined(__EMSCRIPTEN__) || defined(__EMSCRIPTEN_PTHREADS__)
+#define VST_HAVE_THREADS 1
+#else
+#define VST_HAVE_THREADS 0
+#endif
 
 struct VideoMetaData
 {
   double avgFrameRate = 0;
   double realFrameRate = 0; // may be 0
-  int numFrames = 0; // may be 0
+  int numFrames = 0; // may be 0 unless packetsScanned
   double duration = 0;
-  int rotation = 0; // rotation angle in degrees
+  int rotation = 0; // clockwise rotation angle in degrees (display matrix, or the "rotate" tag)
   int vidWidth = 0;
   int vidHeight = 0;
   std::string vidCodec;
+  std::string vidPixelFormat;
+  int64_t vidBitRate = 0; // bits/sec, may be 0
+  int64_t bitRate = 0; // whole file, bits/sec, may be 0
+
+  bool hasAudio = false;
+  std::string audioCodec;
+  int audioSampleRate = 0;
+  int audioChannels = 0;
+  int64_t audioBitRate = 0; // may be 0
+
+  // filled in by ScanVideoPackets()
+  bool packetsScanned = false;
+  std::vector<double> keyframeTimes; // decode timestamps (seconds) of every keyframe
+};
+
+// How the demuxer pulls bytes out of the caller's buffer
+enum class IOReadMode
+{
+  Buffered, // every read goes through a small AVIO buffer (two copies for small reads)
+  Direct,   // reads go straight from the caller's buffer into FFmpeg's packets (one copy)
+};
+
+// How much work CreateInputFormatContext() does to fill in stream parameters
+enum class ProbeMode
+{
+  Full,       // always run avformat_find_stream_info(), which decodes frames
+  HeaderOnly, // trust the container headers; fall back to Full if the video
+              // dimensions, either frame rate (average, real) or the pixel
+              // format (H.264/HEVC parameter sets only) are missing
+};
+
+// openh264's rate control modes
+enum class RateControl
+{
+  Bitrate, // hold bitRate on average
+  Quality, // hold the quality, whatever that costs in size
+  Buffer,  // hold bitRate within a small buffer, for streaming
+  Off,     // no rate control
+};
+
+// how much work the encoder puts into each frame
+enum class EncodeComplexity
+{
+  Low,    // CAVLC, no deblocking, frames may be skipped to hold the bit rate
+  Medium, // the encoder's defaults
+  High,   // CABAC, High profile
+};
+
+struct EncodeOptions
+{
+  RateControl rateControl = RateControl::Bitrate;
+  int64_t bitRate = 2500000; // bits/sec; the ceiling in Quality mode
+  int quality = 0; // largest quantizer allowed, 1 (best) to 51; 0 leaves it to the encoder
+  EncodeComplexity complexity = EncodeComplexity::Medium;
+  int gopSize = 0; // frames between keyframes; 0 leaves it to the encoder
+  int maxDimension = 0; // downscale so neither side of the output is larger; 0 keeps the size
+
+  // "fast" (low-end devices), "balanced" (the defaults) or "archival"
+  // returns: false for an unknown name, in which case options are left alone
+  static bool FromPreset(const std::string &name, EncodeOptions &options);
+};
+
+// how TranscodeRotation() deals with a video's rotation
+enum class RotationMode
+{
+  Bake,   // decode, rotate the pictures and re-encode; plays the same everywhere
+  Matrix, // copy the packets and write the rotation into the MP4/MOV track header
+          // matrix only, for players that honor it; other containers get Strip
+  Strip,  // copy the packets and drop the rotation; the caller rotates (e.g. with CSS)
+};
+
+struct TranscodeOptions
+{
+  // codec threads for the decoder and for the encoder; 0 picks one per core.
+  // Builds without thread support always use 1.
+  int threads = 0;
+
+  // > 1: split the video at keyframes and transcode this many ranges at a
+  // time in parallel, each with a share of `threads`.  Long videos are cut
+  // into more ranges than that, so only the ranges in flight are in memory.
+  int segments = 0;
+
+  // false: decode, rotate and encode on the calling thread instead of in a
+  // pipeline, as builds without thread support always do
+  bool pipelined = true;
+
+  // ignored by TransmuxStripMeta(), which doesn't encode
+  EncodeOptions encode;
+
+  // ignored by TransmuxStripMeta(), which always strips the rotation
+  RotationMode rotationMode = RotationMode::Bake;
+
+  // RotationMode::Bake copies the video packets when re-encoding would change
+  // nothing the player cares about: no rotation, 8-bit 4:2:0 H.264 that the
+  // output container takes, and the default encode options.  true always re-encodes.
+  bool alwaysReencode = false;
+};
+
+// what a transcode did with the video
+struct TranscodeReport
+{
+  bool reencoded = false;      // false: the video packets were copied as is
+  int rotation = 0;            // clockwise degrees the output still has to be rotated by when shown
+  bool rotationInFile = false; // the rotation is in the output's track header; otherwise
+                               // nothing in the file says so and the caller has to apply it
+  std::string reason;          // why the video was (or didn't need to be) re-encoded, or
+                               // why nothing was written (an audio codec the container doesn't take)
+};
+
+struct DecodeOptions
+{
+  double startTime = 0; // seconds from the start of the video
+  double endTime = 0;   // seconds; 0 decodes to the end
+  int threads = 0;      // decoder threads, as TranscodeOptions::threads
+
+  // the file's packet index (LoadPacketIndexAsync()), if there is one: seeks to
+  // startTime with SeekToGOP() instead of having the demuxer search for it
+  const PacketIndex *index = nullptr;
+};
+
+// one decoded picture's luma, turned the way the video is shown
+struct LumaFrame
+{
+  const uint8_t *data = nullptr; // valid only during the callback
+  int stride = 0;
+  int width = 0;
+  int height = 0;
+  double time = 0; // seconds from the start of the video
+};
+
+struct IOReadStats
+{
+  int64_t readCalls = 0;
+  int64_t seekCalls = 0;
+  int64_t bytesCopied = 0;   // bytes copied out of the caller's buffer
+  int64_t bytesBuffered = 0; // subset of bytesCopied that was staged in the AVIO buffer and copied again
+  int64_t sourceReads = 0;   // fetches from an InputSource
+  int64_t sourceBytes = 0;
 };
 
 // safe to call more than once
 void InitFFmpegUtils();
 
 // result must be freed with: FreeInputFormatContext()
+// buf must exist through the returned object's lifetime
 // may return: NULL
-AVFormatContext* CreateInputFormatContext(const uint8_t *buf, int size, int &outErrCode);
+AVFormatContext* CreateInputFormatContext(const uint8_t *buf, int64_t size, int &outErrCode,
+                                          IOReadMode mode = IOReadMode::Direct,
+                                          ProbeMode probe = ProbeMode::Full);
+
+// same as above, but bytes are pulled from source on demand through a small
+// read-ahead buffer, so the whole file never has to be in memory
+AVFormatContext* CreateInputFormatContext(std::shared_ptr<InputSource> source, int &outErrCode,
+                                          ProbeMode probe = ProbeMode::Full);
 void FreeInputFormatContext(AVFormatContext *ic);
 
 bool GetVideoMetaData(AVFormatContext *cxt, VideoMetaData &meta);
 
+// Sets an exact meta.numFrames and meta.keyframeTimes from a PacketIndex (see
+// BuildPacketIndex()).  An existing index is used as is; an empty one is built.
+bool ScanVideoPackets(AVFormatContext *cxt, VideoMetaData &meta, PacketIndex *index = nullptr);
+
 // If the given video contains rotation metadata, this function will bake that rotation into the
 // resulting video and remove the rotation metadata.  Safari and Firefox have issues with video
 // that contain rotation metadata, so this functionality is here to work around that.
+// options.rotationMode can instead copy the packets at transmux speed (see RotationMode).
+// Audio is always copied; an audio codec the output container doesn't take fails the transcode.
 bool TranscodeRotation(AVFormatContext *ic,
                        const std::string &filename, // filename extension used to determine output container type
-                       std::vector<uint8_t> &outBytes,
-                       int &outErrCode);
+                       OutputSink &outBytes,
+                       int &outErrCode,
+                       const TranscodeOptions &options = TranscodeOptions(),
+                       PacketIndex *outIndex = nullptr, // if given, filled with the input's video packets
+                       TranscodeReport *outReport = nullptr);
 
 // transmux the given file and strip out metadata
 bool TransmuxStripMeta(AVFormatContext *ic,
                        const std::string &filename, // filename extension used to determine output container type
-                       std::vector<uint8_t> &outBytes,
-                       int &outErrCode);
+                       OutputSink &outBytes,
+                       int &outErrCode,
+                       const TranscodeOptions &options = TranscodeOptions(), // nothing is decoded, so threads has no effect
+                       PacketIndex *outIndex = nullptr); // if given, filled with the input's video packets
 
 
+// Decodes the video frames between options.startTime and options.endTime and
+// hands onFrame the luma plane of each, in order.  The plane is the decoder's
+// own Y plane, not converted; only a rotated video's is copied, to rotate it.
+// onFrame returns false to stop early, which isn't a failure.
+// Fails for pixel formats without an 8-bit luma plane (e.g. RGB).
+bool DecodeVideoLuma(AVFormatContext *ic,
+                     const DecodeOptions &options,
+                     const std::function<bool(const LumaFrame&)> &onFrame,
+                     int &outErrCode);
+
 
 //////////////////////
 // Internal Helpers //
@@ -53,11 +234,20 @@ bool TransmuxStripMeta(AVFormatContext *ic,
 // the returned stream is owned by the AVFormatContext
 AVStream* GetFirstStreamForType(AVFormatContext *cxt, AVMediaType type);
 
-// buf must exist through this object's lifetime
-AVIOContext* CreateIOReadContext(const uint8_t *buf, int size, int &outErrCode);
+// buf must exist through this object's lifetime; same default mode as CreateInputFormatContext()
+AVIOContext* CreateIOReadContext(const uint8_t *buf, int64_t size, int &outErrCode,
+                                 IOReadMode mode = IOReadMode::Direct);
+// bufferSize is the AVIO buffer used for small header reads; reads smaller than
+// readAheadSize pull a whole readAheadSize window from the source (0 disables it)
+AVIOContext* CreateIOReadContext(std::shared_ptr<InputSource> source, int &outErrCode,
+                                 size_t bufferSize = 0x10000,
+                                 size_t readAheadSize = 0x100000);
 void FreeIOReadContext(AVIOContext *io);
 
-AVIOContext* CreateIOWriteContext(std::vector<uint8_t> &outBytes, int &outErrCode);
+// counters for a context created by CreateIOReadContext()
+IOReadStats GetIOReadStats(AVIOContext *io);
+
+AVIOContext* CreateIOWriteContext(OutputSink &outBytes, int &outErrCode);
 void FreeIOWriteContext(AVIOContext *io);
 
 
@@ -0,0 +1,159 @@
+#include "framepool.h"
+
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+}
+
+namespace
+{
+  // frames in flight are bounded by the pipeline queues; more spares than this
+  // would only be left over from a burst
+  const size_t kMaxSpareFrames = 32;
+}
+
+
+FramePool::~FramePool()
+{
+  for (auto &p : pools)
+    av_buffer_pool_uninit(&p.second);
+  for (AVFrame *&frame : spareFrames)
+    av_frame_free(&frame);
+}
+
+
+AVFrame* FramePool::AcquireFrame()
+{
+  ++frameGets;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!spareFrames.empty()) {
+      AVFrame *frame = spareFrames.back();
+      spareFrames.pop_back();
+      return frame;
+    }
+  }
+
+  ++frameAllocs;
+  return av_frame_alloc();
+}
+
+
+void FramePool::ReleaseFrame(AVFrame *&frame)
+{
+  if (!frame)
+    return;
+
+  av_frame_unref(frame);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (spareFrames.size() < kMaxSpareFrames) {
+      spareFrames.push_back(frame);
+      frame = nullptr;
+      return;
+    }
+  }
+  av_frame_free(&frame);
+}
+
+
+AVBufferRef* FramePool::AllocBuffer(void *opaque, int size)
+{
+  ++static_cast<FramePool*>(opaque)->bufferAllocs;
+  return av_buffer_alloc(size);
+}
+
+
+AVBufferPool* FramePool::PoolFor(int size)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto &p : pools)
+  {
+    if (p.first == size)
+      return p.second;
+  }
+
+  AVBufferPool *pool = av_buffer_pool_init2(size, this, AllocBuffer, NULL);
+  if (pool)
+    pools.emplace_back(size, pool);
+  return pool;
+}
+
+
+int FramePool::GetBuffers(AVFrame *frame, int width, int height, AVPixelFormat format, int align)
+{
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+  if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL)))
+    return AVERROR(EINVAL);
+
+  int linesizes[4];
+  int ret = av_image_fill_linesizes(linesizes, format, width);
+  if (ret < 0)
+    return ret;
+
+  const int planes = av_pix_fmt_count_planes(format);
+  for (int i = 0; i < planes; ++i)
+  {
+    const bool chroma = i == 1 || i == 2;
+    const int h = chroma ? AV_CEIL_RSHIFT(height, desc->log2_chroma_h) : height;
+    const int linesize = FFALIGN(linesizes[i], align);
+
+    // like FFmpeg's own pools: room for SIMD code reading a little past the end
+    AVBufferPool *pool = PoolFor(linesize * h + 16 + align - 1);
+    frame->buf[i] = pool ? av_buffer_pool_get(pool) : nullptr;
+    if (!frame->buf[i]) {
+      for (int j = 0; j < i; ++j)
+        av_buffer_unref(&frame->buf[j]);
+      return AVERROR(ENOMEM);
+    }
+    ++bufferGets;
+
+    frame->data[i] = (uint8_t*)FFALIGN((uintptr_t)frame->buf[i]->data, (uintptr_t)align);
+    frame->linesize[i] = linesize;
+  }
+
+  frame->extended_data = frame->data;
+  return 0;
+}
+
+
+int FramePool::GetDecoderBuffer(AVCodecContext *s, AVFrame *frame, int flags)
+{
+  FramePool *pool = static_cast<FramePool*>(s->opaque);
+
+  // decoders that can't use caller buffers, and hardware frames, keep FFmpeg's
+  if (!(s->codec->capabilities & AV_CODEC_CAP_DR1) || s->hw_frames_ctx)
+    return avcodec_default_get_buffer2(s, frame, flags);
+
+  // the decoder writes past the visible picture up to its block size
+  int width = frame->width;
+  int height = frame->height;
+  int linesizeAlign[AV_NUM_DATA_POINTERS];
+  avcodec_align_dimensions2(s, &width, &height, linesizeAlign);
+
+  int align = 64;
+  for (int i = 0; i < 4; ++i)
+    align = FFMAX(align, linesizeAlign[i]);
+
+  int ret = pool->GetBuffers(frame, width, height, (AVPixelFormat)frame->format, align);
+  return ret == AVERROR(EINVAL) ? avcodec_default_get_buffer2(s, frame, flags) : ret;
+}
+
+
+void FramePool::AttachDecoder(AVCodecContext *dec_ctx)
+{
+  dec_ctx->opaque = this;
+  dec_ctx->get_buffer2 = GetDecoderBuffer;
+  dec_ctx->thread_safe_callbacks = 1; // the pools lock for themselves
+}
+
+
+FramePool::Stats FramePool::GetStats() const
+{
+  Stats stats;
+  stats.bufferAllocs = bufferAllocs.load();
+  stats.bufferGets   = bufferGets.load();
+  stats.frameAllocs  = frameAllocs.load();
+  stats.frameGets    = frameGets.load();
+  return stats;
+}
@@ -0,0 +1,72 @@
+#ifndef __VST_FRAME_POOL_H__
+#define __VST_FRAME_POOL_H__
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
+}
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Picture buffers and AVFrame structs for one transcode, recycled instead of
+// allocated for every frame.  Buffers come from one AVBufferPool per buffer
+// size, so the decoder, the rotation kernel and the encoder all draw on the
+// same few allocations however long the video is.  Safe to use from several
+// threads; buffers may outlive the pool.
+class FramePool
+{
+public:
+  struct Stats
+  {
+    int64_t bufferAllocs = 0; // picture buffers the pools had to allocate
+    int64_t bufferGets = 0;   // picture buffers handed out
+    int64_t frameAllocs = 0;  // AVFrame structs allocated
+    int64_t frameGets = 0;    // AVFrame structs handed out
+  };
+
+  FramePool() {}
+  ~FramePool();
+
+  FramePool(const FramePool&) = delete;
+  FramePool& operator=(const FramePool&) = delete;
+
+  // returns: an empty frame (null if out of memory); give it back with
+  // ReleaseFrame(), or av_frame_free() it
+  AVFrame* AcquireFrame();
+  // unrefs frame and keeps the struct for the next AcquireFrame(); sets frame to null
+  void ReleaseFrame(AVFrame *&frame);
+
+  // Gives frame pooled planes for a width x height picture of the given format,
+  // with every row aligned to `align` bytes.  frame's own width, height and
+  // format are left alone, so a decoder can ask for padded dimensions.
+  // returns: 0, or an AVERROR
+  int GetBuffers(AVFrame *frame, int width, int height, AVPixelFormat format, int align = 64);
+
+  // Makes dec_ctx decode into this pool.  Call before avcodec_open2(); the pool
+  // must outlive the decoder.
+  void AttachDecoder(AVCodecContext *dec_ctx);
+
+  Stats GetStats() const;
+
+private:
+  static int GetDecoderBuffer(AVCodecContext *s, AVFrame *frame, int flags);
+  static AVBufferRef* AllocBuffer(void *opaque, int size);
+
+  AVBufferPool* PoolFor(int size);
+
+  std::mutex mutex;
+  std::vector<std::pair<int, AVBufferPool*>> pools; // by buffer size
+  std::vector<AVFrame*> spareFrames;
+
+  std::atomic<int64_t> bufferAllocs { 0 };
+  std::atomic<int64_t> bufferGets { 0 };
+  std::atomic<int64_t> frameAllocs { 0 };
+  std::atomic<int64_t> frameGets { 0 };
+};
+
+#endif
@@ -0,0 +1,459 @@
+#include "framerotator.h"
+
+extern "C" {
+#include <libavutil/avutil.h>
+#include <libavutil/pixdesc.h>
+}
+
+#include <chrono>
+#include <cstddef>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#define VST_ROTATE_SIMD 1
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define VST_ROTATE_SIMD 1
+#else
+#define VST_ROTATE_SIMD 0
+#endif
+
+#if defined(__AVX2__) && !defined(__wasm_simd128__)
+#include <immintrin.h>
+#endif
+
+namespace
+{
+  // tile edge in pixels: a tile's source rows and destination rows both stay in L1
+  const int kTileSize = 64;
+
+  // row alignment of the rotated planes
+  const int kLineAlign = 64;
+
+#if VST_ROTATE_SIMD
+#if defined(__wasm_simd128__)
+  typedef v128_t Vec;
+
+  inline Vec Load8(const uint8_t *p)
+  {
+    int64_t v;
+    memcpy(&v, p, 8);
+    return wasm_i64x2_make(v, 0);
+  }
+
+  inline void Store8(uint8_t *p, Vec v)
+  {
+    int64_t lo = wasm_i64x2_extract_lane(v, 0);
+    memcpy(p, &lo, 8);
+  }
+
+  inline Vec High8(Vec v) { return wasm_i8x16_shuffle(v, v, 8, 9, 10, 11, 12, 13, 14, 15, 8, 9, 10, 11, 12, 13, 14, 15); }
+  inline Vec Load16(const uint8_t *p) { return wasm_v128_load(p); }
+  inline void Store16(uint8_t *p, Vec v) { wasm_v128_store(p, v); }
+
+  // interleave the low halves of a and b in 8/16/32-bit units (or the high halves)
+  inline Vec Zip8(Vec a, Vec b)    { return wasm_i8x16_shuffle(a, b, 0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23); }
+  inline Vec Zip16Lo(Vec a, Vec b) { return wasm_i8x16_shuffle(a, b, 0, 1, 16, 17, 2, 3, 18, 19, 4, 5, 20, 21, 6, 7, 22, 23); }
+  inline Vec Zip16Hi(Vec a, Vec b) { return wasm_i8x16_shuffle(a, b, 8, 9, 24, 25, 10, 11, 26, 27, 12, 13, 28, 29, 14, 15, 30, 31); }
+  inline Vec Zip32Lo(Vec a, Vec b) { return wasm_i8x16_shuffle(a, b, 0, 1, 2, 3, 16, 17, 18, 19, 4, 5, 6, 7, 20, 21, 22, 23); }
+  inline Vec Zip32Hi(Vec a, Vec b) { return wasm_i8x16_shuffle(a, b, 8, 9, 10, 11, 24, 25, 26, 27, 12, 13, 14, 15, 28, 29, 30, 31); }
+
+  inline Vec Reverse16(Vec v) { return wasm_i8x16_shuffle(v, v, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0); }
+
+  // sums of the horizontal pixel pairs of a and b, as 8 words
+  inline Vec PairSums(Vec a, Vec b)
+  {
+    const Vec lowBytes = wasm_i16x8_splat(0x00FF);
+    return wasm_i16x8_add(wasm_i16x8_add(wasm_v128_and(a, lowBytes), wasm_u16x8_shr(a, 8)),
+                          wasm_i16x8_add(wasm_v128_and(b, lowBytes), wasm_u16x8_shr(b, 8)));
+  }
+
+  // (sum + 2) / 4 for two vectors of 8 sums, packed into 16 pixels
+  inline Vec Average4(Vec lo, Vec hi)
+  {
+    const Vec two = wasm_i16x8_splat(2);
+    return wasm_u8x16_narrow_i16x8(wasm_u16x8_shr(wasm_i16x8_add(lo, two), 2),
+                                   wasm_u16x8_shr(wasm_i16x8_add(hi, two), 2));
+  }
+#else
+  typedef __m128i Vec;
+
+  inline Vec Load8(const uint8_t *p) { return _mm_loadl_epi64((const __m128i*)p); }
+  inline void Store8(uint8_t *p, Vec v) { _mm_storel_epi64((__m128i*)p, v); }
+  inline Vec High8(Vec v) { return _mm_unpackhi_epi64(v, v); }
+  inline Vec Load16(const uint8_t *p) { return _mm_loadu_si128((const __m128i*)p); }
+  inline void Store16(uint8_t *p, Vec v) { _mm_storeu_si128((__m128i*)p, v); }
+
+  // interleave the low halves of a and b in 8/16/32-bit units (or the high halves)
+  inline Vec Zip8(Vec a, Vec b)    { return _mm_unpacklo_epi8(a, b); }
+  inline Vec Zip16Lo(Vec a, Vec b) { return _mm_unpacklo_epi16(a, b); }
+  inline Vec Zip16Hi(Vec a, Vec b) { return _mm_unpackhi_epi16(a, b); }
+  inline Vec Zip32Lo(Vec a, Vec b) { return _mm_unpacklo_epi32(a, b); }
+  inline Vec Zip32Hi(Vec a, Vec b) { return _mm_unpackhi_epi32(a, b); }
+
+  // SSE2 has no byte shuffle: reverse the dwords, then the words in each dword,
+  // then the bytes in each word
+  inline Vec Reverse16(Vec v)
+  {
+    v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+  }
+
+  // sums of the horizontal pixel pairs of a and b, as 8 words
+  inline Vec PairSums(Vec a, Vec b)
+  {
+    const Vec lowBytes = _mm_set1_epi16(0x00FF);
+    return _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a, lowBytes), _mm_srli_epi16(a, 8)),
+                         _mm_add_epi16(_mm_and_si128(b, lowBytes), _mm_srli_epi16(b, 8)));
+  }
+
+  // (sum + 2) / 4 for two vectors of 8 sums, packed into 16 pixels
+  inline Vec Average4(Vec lo, Vec hi)
+  {
+    const Vec two = _mm_set1_epi16(2);
+    return _mm_packus_epi16(_mm_srli_epi16(_mm_add_epi16(lo, two), 2),
+                            _mm_srli_epi16(_mm_add_epi16(hi, two), 2));
+  }
+#endif
+
+  // dst[j][i] = src[i][j] for an 8x8 block
+  inline void Transpose8x8(const uint8_t *const src[8], uint8_t *const dst[8])
+  {
+    Vec a0 = Zip8(Load8(src[0]), Load8(src[1]));
+    Vec a1 = Zip8(Load8(src[2]), Load8(src[3]));
+    Vec a2 = Zip8(Load8(src[4]), Load8(src[5]));
+    Vec a3 = Zip8(Load8(src[6]), Load8(src[7]));
+
+    // columns 0-3 and 4-7 of rows 0-3, then of rows 4-7
+    Vec b0 = Zip16Lo(a0, a1);
+    Vec b1 = Zip16Hi(a0, a1);
+    Vec b2 = Zip16Lo(a2, a3);
+    Vec b3 = Zip16Hi(a2, a3);
+
+    // two whole columns per register
+    Vec c0 = Zip32Lo(b0, b2);
+    Vec c1 = Zip32Hi(b0, b2);
+    Vec c2 = Zip32Lo(b1, b3);
+    Vec c3 = Zip32Hi(b1, b3);
+
+    Store8(dst[0], c0); Store8(dst[1], High8(c0));
+    Store8(dst[2], c1); Store8(dst[3], High8(c1));
+    Store8(dst[4], c2); Store8(dst[5], High8(c2));
+    Store8(dst[6], c3); Store8(dst[7], High8(c3));
+  }
+#endif
+
+  // one source pixel at a time, for the edges the 8x8 blocks don't cover
+  void RotateRect(const uint8_t *src, int srcStride, int width, int height,
+                  uint8_t *dst, int dstStride, int rotation,
+                  int x0, int y0, int x1, int y1)
+  {
+    for (int y = y0; y < y1; ++y)
+    {
+      const uint8_t *row = src + (ptrdiff_t)y * srcStride;
+      if (rotation == 90) {
+        for (int x = x0; x < x1; ++x)
+          dst[(ptrdiff_t)x * dstStride + (height - 1 - y)] = row[x];
+      }
+      else {
+        for (int x = x0; x < x1; ++x)
+          dst[(ptrdiff_t)(width - 1 - x) * dstStride + y] = row[x];
+      }
+    }
+  }
+
+  // rotation is 90 or 270
+  void TransposePlane(const uint8_t *src, int srcStride, int width, int height,
+                      uint8_t *dst, int dstStride, int rotation)
+  {
+    const int blockWidth = width & ~7;
+    const int blockHeight = height & ~7;
+
+#if VST_ROTATE_SIMD
+    const uint8_t *rows[8];
+    uint8_t *cols[8];
+
+    for (int ty = 0; ty < blockHeight; ty += kTileSize)
+    {
+      for (int tx = 0; tx < blockWidth; tx += kTileSize)
+      {
+        const int yEnd = FFMIN(ty + kTileSize, blockHeight);
+        const int xEnd = FFMIN(tx + kTileSize, blockWidth);
+
+        for (int by = ty; by < yEnd; by += 8)
+        {
+          for (int bx = tx; bx < xEnd; bx += 8)
+          {
+            // 90: the block's rows bottom up become the destination's rows left to right;
+            // 270: rows top down, but the destination rows run from the bottom
+            for (int i = 0; i < 8; ++i)
+            {
+              if (rotation == 90) {
+                rows[i] = src + (ptrdiff_t)(by + 7 - i) * srcStride + bx;
+                cols[i] = dst + (ptrdiff_t)(bx + i) * dstStride + (height - 8 - by);
+              }
+              else {
+                rows[i] = src + (ptrdiff_t)(by + i) * srcStride + bx;
+                cols[i] = dst + (ptrdiff_t)(width - 1 - bx - i) * dstStride + by;
+              }
+            }
+            Transpose8x8(rows, cols);
+          }
+        }
+      }
+    }
+#else
+    // same tiling, one pixel at a time
+    for (int ty = 0; ty < blockHeight; ty += kTileSize)
+    {
+      for (int tx = 0; tx < blockWidth; tx += kTileSize)
+        RotateRect(src, srcStride, width, height, dst, dstStride, rotation,
+                   tx, ty, FFMIN(tx + kTileSize, blockWidth), FFMIN(ty + kTileSize, blockHeight));
+    }
+#endif
+
+    // right and bottom edges
+    RotateRect(src, srcStride, width, height, dst, dstStride, rotation, blockWidth, 0, width, height);
+    RotateRect(src, srcStride, width, height, dst, dstStride, rotation, 0, blockHeight, blockWidth, height);
+  }
+
+  void ReverseRow(const uint8_t *src, uint8_t *dst, int width)
+  {
+    int x = 0;
+
+#if defined(__AVX2__) && !defined(__wasm_simd128__)
+    // pshufb reverses each 128-bit lane, then the lanes are swapped
+    const __m256i reverse = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+                                             15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    for (; x + 32 <= width; x += 32)
+    {
+      __m256i v = _mm256_loadu_si256((const __m256i*)(src + width - 32 - x));
+      v = _mm256_shuffle_epi8(v, reverse);
+      _mm256_storeu_si256((__m256i*)(dst + x), _mm256_permute2x128_si256(v, v, 1));
+    }
+#endif
+
+#if VST_ROTATE_SIMD
+    for (; x + 16 <= width; x += 16)
+      Store16(dst + x, Reverse16(Load16(src + width - 16 - x)));
+#endif
+
+    for (; x < width; ++x)
+      dst[x] = src[width - 1 - x];
+  }
+
+  // each destination pixel is the rounded average of a 2x2 source block
+  void HalvePlane(const uint8_t *src, int srcStride,
+                  uint8_t *dst, int dstStride, int dstWidth, int dstHeight)
+  {
+    for (int y = 0; y < dstHeight; ++y)
+    {
+      const uint8_t *r0 = src + (ptrdiff_t)(2 * y) * srcStride;
+      const uint8_t *r1 = r0 + srcStride;
+      uint8_t *out = dst + (ptrdiff_t)y * dstStride;
+      int x = 0;
+
+#if VST_ROTATE_SIMD
+      for (; x + 16 <= dstWidth; x += 16)
+      {
+        const uint8_t *p0 = r0 + 2 * x;
+        const uint8_t *p1 = r1 + 2 * x;
+        Store16(out + x, Average4(PairSums(Load16(p0), Load16(p1)),
+                                  PairSums(Load16(p0 + 16), Load16(p1 + 16))));
+      }
+#endif
+
+      for (; x < dstWidth; ++x)
+        out[x] = (uint8_t)((r0[2 * x] + r0[2 * x + 1] + r1[2 * x] + r1[2 * x + 1] + 2) >> 2);
+    }
+  }
+
+  // any ratio: the source block of each destination pixel runs from its left
+  // (top) edge to the next one's, rounded down to whole pixels
+  void BoxScalePlane(const uint8_t *src, int srcStride, int width, int height,
+                     uint8_t *dst, int dstStride, int dstWidth, int dstHeight)
+  {
+    std::vector<int> xEdges(dstWidth + 1);
+    for (int x = 0; x <= dstWidth; ++x)
+      xEdges[x] = (int)((int64_t)x * width / dstWidth);
+
+    std::vector<uint32_t> columnSums(width);
+    for (int y = 0; y < dstHeight; ++y)
+    {
+      const int y0 = (int)((int64_t)y * height / dstHeight);
+      const int y1 = (int)((int64_t)(y + 1) * height / dstHeight);
+
+      // add up the block's rows; a plain loop the compiler vectorizes
+      std::fill(columnSums.begin(), columnSums.end(), 0);
+      for (int sy = y0; sy < y1; ++sy)
+      {
+        const uint8_t *row = src + (ptrdiff_t)sy * srcStride;
+        for (int x = 0; x < width; ++x)
+          columnSums[x] += row[x];
+      }
+
+      uint8_t *out = dst + (ptrdiff_t)y * dstStride;
+      for (int x = 0; x < dstWidth; ++x)
+      {
+        uint32_t sum = 0;
+        for (int sx = xEdges[x]; sx < xEdges[x + 1]; ++sx)
+          sum += columnSums[sx];
+        const uint32_t area = (uint32_t)(xEdges[x + 1] - xEdges[x]) * (y1 - y0);
+        out[x] = (uint8_t)((sum + area / 2) / area);
+      }
+    }
+  }
+
+  double SecondsSince(std::chrono::steady_clock::time_point start)
+  {
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+  }
+}
+
+
+void RotatePlane(const uint8_t *src, int srcStride, int width, int height,
+                 uint8_t *dst, int dstStride, int rotation)
+{
+  if (rotation == 180)
+  {
+    for (int y = 0; y < height; ++y)
+      ReverseRow(src + (ptrdiff_t)(height - 1 - y) * srcStride, dst + (ptrdiff_t)y * dstStride, width);
+  }
+  else if (rotation == 90 || rotation == 270)
+    TransposePlane(src, srcStride, width, height, dst, dstStride, rotation);
+  else
+  {
+    for (int y = 0; y < height; ++y)
+      memcpy(dst + (ptrdiff_t)y * dstStride, src + (ptrdiff_t)y * srcStride, width);
+  }
+}
+
+
+void ScalePlane(const uint8_t *src, int srcStride, int width, int height,
+                uint8_t *dst, int dstStride, int dstWidth, int dstHeight)
+{
+  if (dstWidth == width / 2 && dstHeight == height / 2)
+    HalvePlane(src, srcStride, dst, dstStride, dstWidth, dstHeight);
+  else
+    BoxScalePlane(src, srcStride, width, height, dst, dstStride, dstWidth, dstHeight);
+}
+
+
+void ScaleToFit(int &width, int &height, int maxDimension)
+{
+  const int longest = FFMAX(width, height);
+  if (maxDimension <= 0 || longest <= maxDimension)
+    return;
+
+  // even sides for 4:2:0 chroma
+  width  = FFMAX(2, (int)((int64_t)width * maxDimension / longest) & ~1);
+  height = FFMAX(2, (int)((int64_t)height * maxDimension / longest) & ~1);
+}
+
+
+bool FrameRotator::Supports(AVPixelFormat format, int rotation)
+{
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+  if (!desc || (rotation != 0 && rotation != 90 && rotation != 180 && rotation != 270))
+    return false;
+
+  if ((desc->flags & (AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL)) ||
+      (desc->nb_components > 1 && !(desc->flags & AV_PIX_FMT_FLAG_PLANAR)))
+    return false;
+
+  for (int i = 0; i < desc->nb_components; ++i)
+  {
+    if (desc->comp[i].depth != 8 || desc->comp[i].step != 1)
+      return false;
+  }
+
+  // 4:2:2 chroma would have to become 4:4:0
+  return rotation == 0 || rotation == 180 || desc->log2_chroma_w == desc->log2_chroma_h;
+}
+
+
+FrameRotator::FrameRotator(int rotation, std::shared_ptr<FramePool> pool, int maxDimension)
+  : rotation(rotation),
+    maxDimension(maxDimension),
+    pool(pool ? pool : std::make_shared<FramePool>())
+{
+}
+
+
+int FrameRotator::AllocBuffers(const AVFrame *in, AVFrame *out)
+{
+  const bool transpose = rotation == 90 || rotation == 270;
+
+  int width = in->width, height = in->height;
+  ScaleToFit(width, height, maxDimension);
+
+  out->format = in->format;
+  out->width  = transpose ? height : width;
+  out->height = transpose ? width : height;
+
+  return pool->GetBuffers(out, out->width, out->height, (AVPixelFormat)out->format, kLineAlign);
+}
+
+
+int FrameRotator::Rotate(const AVFrame *in, AVFrame *out)
+{
+  if (!Supports((AVPixelFormat)in->format, rotation))
+    return AVERROR(EINVAL);
+
+  auto start = std::chrono::steady_clock::now();
+
+  int ret = AllocBuffers(in, out);
+  if (ret >= 0)
+    ret = av_frame_copy_props(out, in);
+  if (ret < 0) {
+    av_frame_unref(out);
+    return ret;
+  }
+
+  // scaled size before rotating
+  int width = in->width, height = in->height;
+  ScaleToFit(width, height, maxDimension);
+  const bool scale = width != in->width || height != in->height;
+
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat)in->format);
+  const int planes = av_pix_fmt_count_planes((AVPixelFormat)in->format);
+  for (int i = 0; i < planes; ++i)
+  {
+    const bool chroma = i == 1 || i == 2;
+    const int w = chroma ? AV_CEIL_RSHIFT(in->width, desc->log2_chroma_w) : in->width;
+    const int h = chroma ? AV_CEIL_RSHIFT(in->height, desc->log2_chroma_h) : in->height;
+
+    if (!scale) {
+      RotatePlane(in->data[i], in->linesize[i], w, h, out->data[i], out->linesize[i], rotation);
+      continue;
+    }
+
+    const int sw = chroma ? AV_CEIL_RSHIFT(width, desc->log2_chroma_w) : width;
+    const int sh = chroma ? AV_CEIL_RSHIFT(height, desc->log2_chroma_h) : height;
+    if (rotation == 0) {
+      ScalePlane(in->data[i], in->linesize[i], w, h, out->data[i], out->linesize[i], sw, sh);
+      continue;
+    }
+
+    // rotating the scaled plane touches a fraction of the pixels
+    const int stride = FFALIGN(sw, kLineAlign);
+    if (scaled.size() < (size_t)stride * sh)
+      scaled.resize((size_t)stride * sh);
+    ScalePlane(in->data[i], in->linesize[i], w, h, scaled.data(), stride, sw, sh);
+    RotatePlane(scaled.data(), stride, sw, sh, out->data[i], out->linesize[i], rotation);
+  }
+
+  // same as the transpose filter
+  if ((rotation == 90 || rotation == 270) && in->sample_aspect_ratio.num)
+    out->sample_aspect_ratio = av_inv_q(in->sample_aspect_ratio);
+
+  ++frames;
+  seconds += SecondsSince(start);
+  return 0;
+}
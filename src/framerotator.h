@@ -0,0 +1,76 @@
+#ifndef __VST_FRAME_ROTATOR_H__
+#define __VST_FRAME_ROTATOR_H__
+
+extern "C" {
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+}
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "framepool.h"
+
+// Rotates one 8-bit plane clockwise by 90, 180 or 270 degrees (0 copies it).  For 90/270
+// dst is height x width.  Works through the plane in cache-sized tiles of
+// 8x8 SIMD transposes (SSE2, or WASM SIMD128 when built with -msimd128);
+// 180 reverses whole rows (32 bytes at a time with AVX2).
+void RotatePlane(const uint8_t *src, int srcStride, int width, int height,
+                 uint8_t *dst, int dstStride, int rotation);
+
+// Shrinks one 8-bit plane to dstWidth x dstHeight (no larger than the source)
+// by averaging the block of source pixels under each destination pixel.
+// Halving, as from 4K to 1080p, averages 2x2 blocks with SIMD.
+void ScalePlane(const uint8_t *src, int srcStride, int width, int height,
+                uint8_t *dst, int dstStride, int dstWidth, int dstHeight);
+
+// Scales width x height down, keeping the aspect ratio and even sides, so that
+// neither side is larger than maxDimension.  0 (or a larger maxDimension)
+// leaves the size alone.
+void ScaleToFit(int &width, int &height, int maxDimension);
+
+
+// Rotates decoded frames into pooled buffers, one frame at a time, and can
+// scale them down on the way.  This is what the transcode uses instead of a
+// libavfilter transpose chain, which copies the frame once per 90 degrees (and
+// instead of the scale filter, which the WASM build doesn't have).
+class FrameRotator
+{
+public:
+  // returns: true for 8-bit planar formats whose chroma planes stay valid
+  // after rotating by `rotation` (0, 90, 180 or 270)
+  static bool Supports(AVPixelFormat format, int rotation);
+
+  // frames are rotated into buffers from pool, or from a pool of its own;
+  // maxDimension > 0 also scales them down (see ScaleToFit()) before rotating
+  explicit FrameRotator(int rotation, std::shared_ptr<FramePool> pool = nullptr, int maxDimension = 0);
+
+  FrameRotator(const FrameRotator&) = delete;
+  FrameRotator& operator=(const FrameRotator&) = delete;
+
+  // out must be empty; it gets in's properties and the rotated picture
+  // returns: 0, or an AVERROR
+  int Rotate(const AVFrame *in, AVFrame *out);
+
+  int Rotation() const { return rotation; }
+  int MaxDimension() const { return maxDimension; }
+
+  // for comparing against the filter graph
+  int64_t Frames() const { return frames; }
+  double Seconds() const { return seconds; }
+
+private:
+  int AllocBuffers(const AVFrame *in, AVFrame *out);
+
+  const int rotation;
+  const int maxDimension;
+  std::shared_ptr<FramePool> pool;
+  std::vector<uint8_t> scaled; // one scaled plane on its way to being rotated
+
+  int64_t frames = 0;
+  double seconds = 0;
+};
+
+#endif
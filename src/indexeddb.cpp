@@ -1,31 +1,173 @@
 #include "indexeddb.h"
 
+#include <algorithm>
+
 #ifdef __EMSCRIPTEN__
 #include <emscripten.h>
 
+namespace
+{
+  // A record opened by IDBOpenAsync(); the bytes live on the javascript side
+  // in Module.idbFiles[handle] and are copied into the heap on request.
+  class JSFileSource : public InputSource
+  {
+  public:
+    JSFileSource(int handle, int64_t size) : handle(handle), size(size) {}
+
+    ~JSFileSource()
+    {
+      EM_ASM({ delete Module['idbFiles'][$0]; }, handle);
+    }
+
+    int64_t Size() const override { return size; }
+
+    int ReadAt(int64_t offset, uint8_t *buf, int n) override
+    {
+      return EM_ASM_INT({
+        const file = Module['idbFiles'][$0];
+        if (!file)
+          return -1;
+
+        const offset = $1;
+        const end = Math.min(offset + $3, file.size);
+        if (offset >= end)
+          return 0;
+
+        try {
+          let bytes;
+          if (file.blob)
+            bytes = new Uint8Array(new FileReaderSync().readAsArrayBuffer(file.blob.slice(offset, end)));
+          else
+            bytes = file.bytes.subarray(offset, end);
+          HEAPU8.set(bytes, $2);
+          return bytes.length;
+        }
+        catch (e) {
+          console.error(e);
+          return -1;
+        }
+      }, handle, (double)offset, buf, n);
+    }
+
+  private:
+    const int handle;
+    const int64_t size;
+  };
+
+  struct IDBOpenContext
+  {
+    IDBOpenFunc onSuccess;
+    IDBErrorFunc onError;
+  };
+
+  struct IDBOpenBatchContext
+  {
+    IDBOpenEachFunc onFile;
+    IDBStoreFunc onDone;
+  };
+
+  // Defines Module.idbAddFile(record), which wraps a record read from the store
+  // for JSFileSource and returns its handle (0 for values that aren't file data)
+  void InstallJSFileHelpers()
+  {
+    static bool installed = false;
+    if (installed)
+      return;
+
+    EM_ASM({
+      Module['idbFiles'] = Module['idbFiles'] || {};
+      Module['idbAddFile'] = (value) => {
+        const file = {};
+        if (value instanceof Blob) {
+          file.blob = value;
+          file.size = value.size;
+        }
+        else if (value instanceof ArrayBuffer) {
+          file.bytes = new Uint8Array(value);
+          file.size = value.byteLength;
+        }
+        else if (value && ArrayBuffer.isView(value)) {
+          file.bytes = new Uint8Array(value.buffer, value.byteOffset, value.byteLength);
+          file.size = value.byteLength;
+        }
+        else {
+          return 0;
+        }
+
+        const handle = Module['idbNextFile'] = (Module['idbNextFile'] || 0) + 1;
+        Module['idbFiles'][handle] = file;
+        return handle;
+      };
+    });
+
+    installed = true;
+  }
+}
+
+// called from the javascript side of IDBOpenAsync()
+extern "C" EMSCRIPTEN_KEEPALIVE void IDBOpenComplete(void *userdata, int handle, double size)
+{
+  auto *cxt = (IDBOpenContext*)userdata;
+  if (handle > 0)
+    cxt->onSuccess(std::make_shared<JSFileSource>(handle, (int64_t)size));
+  else
+    cxt->onError();
+  delete cxt;
+}
+
+// called from the javascript side of IDBOpenBatchAsync(), once per file
+extern "C" EMSCRIPTEN_KEEPALIVE void IDBOpenBatchFile(void *userdata, int index, int handle, double size)
+{
+  auto *cxt = (IDBOpenBatchContext*)userdata;
+  std::shared_ptr<InputSource> file;
+  if (handle > 0)
+    file = std::make_shared<JSFileSource>(handle, (int64_t)size);
+  cxt->onFile((size_t)index, file);
+}
+
+extern "C" EMSCRIPTEN_KEEPALIVE void IDBOpenBatchComplete(void *userdata)
+{
+  auto *cxt = (IDBOpenBatchContext*)userdata;
+  cxt->onDone();
+  delete cxt;
+}
+
 #else
 
+#include "mappedfile.h"
+
 #include <cstdio>
 #include <vector>
 namespace
 {
-  bool LoadFileBytes(const std::string &filename, std::vector<uint8_t> &bytes)
+  // writes straight to a file on disk as the data arrives
+  class FileSink : public OutputSink
   {
-    bool success = false;
+  public:
+    FileSink(FILE *f) : f(f) {}
+    ~FileSink() { fclose(f); }
 
-    FILE *f = fopen(filename.c_str(), "rb");
-    if (f)
+    int64_t Size() const override { return size; }
+
+    int WriteAt(int64_t offset, const uint8_t *buf, int n) override
     {
-      fseek(f, 0, SEEK_END);
-      auto size = ftell(f);
-      fseek(f, 0, SEEK_SET);
-      bytes.resize(size);
-      auto total = fread(bytes.data(), 1, bytes.size(), f);
-      success = total == bytes.size();
-      fclose(f);
+      if (offset != pos && fseeko(f, offset, SEEK_SET) != 0)
+        return -1;
+
+      size_t total = fwrite(buf, 1, n, f);
+      if (total != (size_t)n)
+        return -1;
+
+      pos = offset + n;
+      size = std::max(size, pos);
+      return n;
     }
-    return success;
-  }
+
+  private:
+    FILE * const f;
+    int64_t pos = 0;
+    int64_t size = 0;
+  };
 }
 #endif
 
@@ -60,9 +202,9 @@ void IDBLoadAsync(const std::string &db,
   emscripten_idb_async_load (db.c_str(), filename.c_str(), (void*)cxt, onSuccessCB, onErrorCB);
 #else
   {
-    std::vector<uint8_t> bytes;
-    if (LoadFileBytes(filename, bytes))
-      onSuccessCB(cxt, (void*)bytes.data(), bytes.size());
+    auto file = MappedFile::Open(filename);
+    if (file)
+      onSuccessCB(cxt, (void*)file->Data(), file->Size());
     else
       onErrorCB(cxt);
   }
@@ -70,12 +212,165 @@ void IDBLoadAsync(const std::string &db,
 }
 
 
-void IDBStoreAsync(const std::string &db,
-                   const std::string &filename,
-                   const uint8_t *buf,
-                   size_t size,
-                   IDBStoreFunc onSuccess,
-                   IDBErrorFunc onError)
+void IDBOpenAsync(const std::string &db,
+                  const std::string &filename,
+                  IDBOpenFunc onSuccess,
+                  IDBErrorFunc onError)
+{
+#ifdef __EMSCRIPTEN__
+  InstallJSFileHelpers();
+  auto *cxt = new IDBOpenContext { onSuccess, onError };
+
+  // same database layout as emscripten_idb_async_load() (version 22, 'FILE_DATA')
+  EM_ASM({
+    const dbName = UTF8ToString($0);
+    const filename = UTF8ToString($1);
+    const userdata = $2;
+
+    const done = (handle, size) => Module['_IDBOpenComplete'](userdata, handle, size);
+
+    const req = indexedDB.open(dbName, 22);
+    req.onupgradeneeded = (e) => {
+      const d = e.target.result;
+      if (!d.objectStoreNames.contains('FILE_DATA'))
+        d.createObjectStore('FILE_DATA');
+    };
+    req.onerror = () => done(0, 0);
+    req.onsuccess = () => {
+      const d = req.result;
+      try {
+        const get = d.transaction(['FILE_DATA'], 'readonly').objectStore('FILE_DATA').get(filename);
+        get.onerror = () => { d.close(); done(0, 0); };
+        get.onsuccess = () => {
+          d.close();
+
+          const handle = Module['idbAddFile'](get.result);
+          done(handle, handle ? Module['idbFiles'][handle].size : 0);
+        };
+      }
+      catch (e) {
+        d.close();
+        done(0, 0);
+      }
+    };
+  }, db.c_str(), filename.c_str(), cxt);
+#else
+  auto file = MappedFile::Open(filename);
+  if (file)
+    onSuccess(file);
+  else
+    onError();
+#endif
+}
+
+
+void IDBOpenBatchAsync(const std::string &db,
+                       const std::vector<std::string> &filenames,
+                       IDBOpenEachFunc onFile,
+                       IDBStoreFunc onDone)
+{
+#ifdef __EMSCRIPTEN__
+  InstallJSFileHelpers();
+  auto *cxt = new IDBOpenBatchContext { onFile, onDone };
+
+  std::vector<const char*> names;
+  for (const auto &name : filenames)
+    names.push_back(name.c_str());
+
+  // All the gets share one readonly transaction.  Only a few are issued at a time:
+  // each result that isn't a Blob is a whole file in javascript memory until its
+  // source is released, so fetching the entire list up front could pin it all.
+  EM_ASM({
+    const dbName = UTF8ToString($0);
+    const count = $2;
+    const userdata = $3;
+    const maxInFlight = 4;
+
+    const filenames = [];
+    for (let i = 0; i < count; ++i)
+      filenames.push(UTF8ToString(HEAPU32[($1 >> 2) + i]));
+
+    const fileDone = (index, handle) =>
+      Module['_IDBOpenBatchFile'](userdata, index, handle, handle ? Module['idbFiles'][handle].size : 0);
+    const allDone = () => Module['_IDBOpenBatchComplete'](userdata);
+
+    // report anything not yet delivered as failed
+    let next = 0;
+    let delivered = 0;
+    const failRest = () => {
+      while (delivered < count)
+        fileDone(delivered++, 0);
+      allDone();
+    };
+
+    if (count == 0) {
+      allDone();
+      return;
+    }
+
+    const req = indexedDB.open(dbName, 22);
+    req.onupgradeneeded = (e) => {
+      const d = e.target.result;
+      if (!d.objectStoreNames.contains('FILE_DATA'))
+        d.createObjectStore('FILE_DATA');
+    };
+    req.onerror = failRest;
+    req.onsuccess = () => {
+      const d = req.result;
+      try {
+        const trans = d.transaction(['FILE_DATA'], 'readonly');
+        const store = trans.objectStore('FILE_DATA');
+        const results = [];
+
+        // results arrive in request order, but deliver them strictly in order anyway
+        const deliver = () => {
+          while (delivered < count && results[delivered] !== undefined) {
+            const handle = results[delivered];
+            results[delivered] = null;
+            fileDone(delivered++, handle);
+          }
+          if (delivered == count) {
+            d.close();
+            allDone();
+          }
+        };
+
+        const issue = () => {
+          if (next >= count)
+            return;
+          const index = next++;
+          const get = store.get(filenames[index]);
+          get.onsuccess = () => {
+            results[index] = Module['idbAddFile'](get.result);
+            issue();
+            deliver();
+          };
+          get.onerror = (e) => {
+            e.preventDefault(); // keep the transaction alive for the other files
+            results[index] = 0;
+            issue();
+            deliver();
+          };
+        };
+
+        for (let i = 0; i < maxInFlight; ++i)
+          issue();
+      }
+      catch (e) {
+        d.close();
+        failRest();
+      }
+    };
+  }, db.c_str(), names.data(), (int)names.size(), cxt);
+#else
+  for (size_t i = 0; i < filenames.size(); ++i)
+    onFile(i, MappedFile::Open(filenames[i]));
+  onDone();
+#endif
+}
+
+
+namespace
 {
   struct IDBStoreContext
   {
@@ -83,34 +378,140 @@ void IDBStoreAsync(const std::string &db,
     IDBErrorFunc onError;
   };
 
-  static auto onSuccessCB = [](void *userdata)
+  void StoreSuccessCB(void *userdata)
   {
     auto *cxt = (IDBStoreContext*)userdata;
     cxt->onSuccess();
     delete cxt;
-  };
+  }
 
-  static auto onErrorCB = [](void *userdata)
+  void StoreErrorCB(void *userdata)
   {
     auto *cxt = (IDBStoreContext*)userdata;
     cxt->onError();
     delete cxt;
-  };
+  }
+}
 
+
+#ifdef __EMSCRIPTEN__
+// called from the javascript side of the scatter-gather store
+extern "C" EMSCRIPTEN_KEEPALIVE void IDBStoreSlicesComplete(void *userdata, int success)
+{
+  if (success)
+    StoreSuccessCB(userdata);
+  else
+    StoreErrorCB(userdata);
+}
+#endif
+
+
+void IDBStoreAsync(const std::string &db,
+                   const std::string &filename,
+                   const uint8_t *buf,
+                   size_t size,
+                   IDBStoreFunc onSuccess,
+                   IDBErrorFunc onError)
+{
   auto *cxt = new IDBStoreContext { onSuccess, onError };
 #ifdef __EMSCRIPTEN__
-  emscripten_idb_async_store(db.c_str(), filename.c_str(), (void*)buf, (int)size, (void*)cxt, onSuccessCB, onErrorCB);
+  emscripten_idb_async_store(db.c_str(), filename.c_str(), (void*)buf, (int)size, (void*)cxt, StoreSuccessCB, StoreErrorCB);
 #else
   {
     FILE *f = fopen(filename.c_str(), "wb");
     if (f) {
       fwrite(buf, 1, size, f);
       fclose(f);
-      onSuccessCB(cxt);
+      StoreSuccessCB(cxt);
     }
     else
-      onErrorCB(cxt);
+      StoreErrorCB(cxt);
   }
 #endif
 }
 
+
+void IDBStoreAsync(const std::string &db,
+                   const std::string &filename,
+                   const std::vector<IDBSlice> &slices,
+                   IDBStoreFunc onSuccess,
+                   IDBErrorFunc onError)
+{
+  auto *cxt = new IDBStoreContext { onSuccess, onError };
+#ifdef __EMSCRIPTEN__
+  // The slices are gathered straight into the javascript array that gets stored, using
+  // the same database layout as emscripten_idb_async_store() (version 22, 'FILE_DATA')
+  // so the result can be read back with emscripten_idb_async_load().
+  EM_ASM({
+    const dbName = UTF8ToString($0);
+    const filename = UTF8ToString($1);
+    const slices = $2 >> 2;
+    const count = $3;
+    const userdata = $4;
+
+    let total = 0;
+    for (let i = 0; i < count; ++i)
+      total += HEAPU32[slices + 2*i + 1];
+
+    const bytes = new Uint8Array(total);
+    let offset = 0;
+    for (let i = 0; i < count; ++i) {
+      const ptr = HEAPU32[slices + 2*i];
+      const size = HEAPU32[slices + 2*i + 1];
+      bytes.set(HEAPU8.subarray(ptr, ptr + size), offset);
+      offset += size;
+    }
+
+    const done = (ok) => Module['_IDBStoreSlicesComplete'](userdata, ok);
+
+    const req = indexedDB.open(dbName, 22);
+    req.onupgradeneeded = (e) => {
+      const d = e.target.result;
+      if (!d.objectStoreNames.contains('FILE_DATA'))
+        d.createObjectStore('FILE_DATA');
+    };
+    req.onerror = () => done(0);
+    req.onsuccess = () => {
+      const d = req.result;
+      try {
+        const trans = d.transaction(['FILE_DATA'], 'readwrite');
+        trans.objectStore('FILE_DATA').put(bytes, filename);
+        trans.oncomplete = () => { d.close(); done(1); };
+        trans.onabort = () => { d.close(); done(0); };
+      }
+      catch (e) {
+        d.close();
+        done(0);
+      }
+    };
+  }, db.c_str(), filename.c_str(), slices.data(), (int)slices.size(), cxt);
+#else
+  {
+    FILE *f = fopen(filename.c_str(), "wb");
+    if (f) {
+      bool ok = true;
+      for (const auto &slice : slices)
+        ok = ok && fwrite(slice.buf, 1, slice.size, f) == slice.size;
+      fclose(f);
+      if (ok)
+        StoreSuccessCB(cxt);
+      else
+        StoreErrorCB(cxt);
+    }
+    else
+      StoreErrorCB(cxt);
+  }
+#endif
+}
+
+
+#ifndef __EMSCRIPTEN__
+std::shared_ptr<OutputSink> IDBCreateSink(const std::string &db,
+                                          const std::string &filename)
+{
+  FILE *f = fopen(filename.c_str(), "wb");
+  if (!f)
+    return nullptr;
+  return std::make_shared<FileSink>(f);
+}
+#endif
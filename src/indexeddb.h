@@ -3,16 +3,40 @@
 
 #include <string>
 #include <functional>
+#include <memory>
+#include <vector>
+
+#include "inputsource.h"
+#include "outputsink.h"
 
 using IDBLoadFunc  = std::function<void(const uint8_t *buf, size_t size)>; // buf is only valid during callback
 using IDBStoreFunc = std::function<void()>;
 using IDBErrorFunc = std::function<void()>;
+using IDBOpenFunc  = std::function<void(std::shared_ptr<InputSource> file)>;
 
 void IDBLoadAsync (const std::string &db,
                    const std::string &filename,
                    IDBLoadFunc onSuccess,
                    IDBErrorFunc onError);
 
+// Opens a stored file for on-demand reading without loading it into the WASM heap.
+// The record stays in javascript memory (or in the browser's blob store when it
+// was saved as a Blob) and only the ranges asked for are copied in.
+void IDBOpenAsync (const std::string &db,
+                   const std::string &filename,
+                   IDBOpenFunc onSuccess,
+                   IDBErrorFunc onError);
+
+using IDBOpenEachFunc = std::function<void(size_t index, std::shared_ptr<InputSource> file)>; // file is null on error
+
+// Opens many files with one database connection and transaction, keeping a few
+// reads in flight so the next records are being fetched while one is processed.
+// onFile is called once per filename (in order), then onDone.
+void IDBOpenBatchAsync(const std::string &db,
+                       const std::vector<std::string> &filenames,
+                       IDBOpenEachFunc onFile,
+                       IDBStoreFunc onDone);
+
 void IDBStoreAsync(const std::string &db,
                    const std::string &filename,
                    const uint8_t *buf,
@@ -20,4 +44,27 @@ void IDBStoreAsync(const std::string &db,
                    IDBStoreFunc onSuccess,
                    IDBErrorFunc onError);
 
+// one piece of a scatter-gather store
+struct IDBSlice
+{
+  const uint8_t *buf;
+  size_t size;
+};
+
+// stores the concatenation of slices without first joining them in the WASM heap
+// slices must stay valid until one of the callbacks fires
+void IDBStoreAsync(const std::string &db,
+                   const std::string &filename,
+                   const std::vector<IDBSlice> &slices,
+                   IDBStoreFunc onSuccess,
+                   IDBErrorFunc onError);
+
+#ifndef __EMSCRIPTEN__
+// Native builds only: creates (truncates) filename and returns a sink that writes
+// to it as data arrives, so output never has to be buffered before storing it.
+// returns: nullptr on error
+std::shared_ptr<OutputSink> IDBCreateSink(const std::string &db,
+                                          const std::string &filename);
+#endif
+
 #endif
@@ -0,0 +1,20 @@
+#ifndef __VST_INPUT_SOURCE_H__
+#define __VST_INPUT_SOURCE_H__
+
+#include <cstdint>
+
+// Random access byte source for inputs that are not held in one contiguous
+// buffer in memory.  Reads are synchronous and only pull the bytes asked for.
+class InputSource
+{
+public:
+  virtual ~InputSource() {}
+
+  virtual int64_t Size() const = 0;
+
+  // copy up to size bytes starting at offset into buf
+  // returns: the number of bytes copied (0 at end of file), or < 0 on error
+  virtual int ReadAt(int64_t offset, uint8_t *buf, int size) = 0;
+};
+
+#endif
@@ -3,16 +3,115 @@
 #ifdef __EMSCRIPTEN__
 #include <emscripten.h>
 #include <emscripten/bind.h>
+#include <emscripten/val.h>
+
+// takes the filenames as a javascript array
+static void readMetaDataBatchJS(int reqId, std::string db, emscripten::val filenames)
+{
+  readMetaDataBatch(reqId, db, emscripten::vecFromJSArray<std::string>(filenames));
+}
+
+// options is a javascript object; missing fields keep their defaults
+// options.encode: { preset, rateControl, bitRate, quality, complexity, gopSize, maxDimension };
+// the preset is applied first and the other fields override it
+static EncodeOptions EncodeOptionsFromJS(emscripten::val options)
+{
+  EncodeOptions result;
+  if (options.isUndefined() || options.isNull())
+    return result;
+
+  if (options.hasOwnProperty("preset") &&
+      !EncodeOptions::FromPreset(options["preset"].as<std::string>(), result))
+    printf("Unknown encode preset: %s\n", options["preset"].as<std::string>().c_str());
+
+  if (options.hasOwnProperty("rateControl"))
+  {
+    const std::string mode = options["rateControl"].as<std::string>();
+    if (mode == "bitrate")      result.rateControl = RateControl::Bitrate;
+    else if (mode == "quality") result.rateControl = RateControl::Quality;
+    else if (mode == "buffer")  result.rateControl = RateControl::Buffer;
+    else if (mode == "off")     result.rateControl = RateControl::Off;
+  }
+  if (options.hasOwnProperty("complexity"))
+  {
+    const std::string complexity = options["complexity"].as<std::string>();
+    if (complexity == "low")         result.complexity = EncodeComplexity::Low;
+    else if (complexity == "medium") result.complexity = EncodeComplexity::Medium;
+    else if (complexity == "high")   result.complexity = EncodeComplexity::High;
+  }
+  if (options.hasOwnProperty("bitRate"))
+    result.bitRate = (int64_t)options["bitRate"].as<double>();
+  if (options.hasOwnProperty("quality"))
+    result.quality = options["quality"].as<int>();
+  if (options.hasOwnProperty("gopSize"))
+    result.gopSize = options["gopSize"].as<int>();
+  if (options.hasOwnProperty("maxDimension"))
+    result.maxDimension = options["maxDimension"].as<int>();
+  return result;
+}
+
+static TranscodeOptions TranscodeOptionsFromJS(emscripten::val options)
+{
+  TranscodeOptions result;
+  if (options.isUndefined() || options.isNull())
+    return result;
+
+  if (options.hasOwnProperty("threads"))
+    result.threads = options["threads"].as<int>();
+  if (options.hasOwnProperty("segments"))
+    result.segments = options["segments"].as<int>();
+  if (options.hasOwnProperty("encode"))
+    result.encode = EncodeOptionsFromJS(options["encode"]);
+  if (options.hasOwnProperty("rotationMode"))
+  {
+    const std::string mode = options["rotationMode"].as<std::string>();
+    if (mode == "bake")        result.rotationMode = RotationMode::Bake;
+    else if (mode == "matrix") result.rotationMode = RotationMode::Matrix;
+    else if (mode == "strip")  result.rotationMode = RotationMode::Strip;
+  }
+  if (options.hasOwnProperty("alwaysReencode"))
+    result.alwaysReencode = options["alwaysReencode"].as<bool>();
+  return result;
+}
+
+static void transcodeRotationJS(int reqId, std::string db, std::string src, std::string dst, emscripten::val options)
+{
+  transcodeRotation(reqId, db, src, dst, TranscodeOptionsFromJS(options));
+}
+
+// takes the tracking context ids as a javascript array
+static void trackObjectsNextFrameJS(int reqId, emscripten::val trackingCtxIds, double timeStamp, int width, int height, int channels, uint32_t pbuf)
+{
+  trackObjectsNextFrame(reqId, emscripten::vecFromJSArray<int>(trackingCtxIds), timeStamp, width, height, channels, pbuf);
+}
+
+static void trackObjectsNextFrameInSlotJS(int reqId, emscripten::val trackingCtxIds, double timeStamp, int slot)
+{
+  trackObjectsNextFrameInSlot(reqId, emscripten::vecFromJSArray<int>(trackingCtxIds), timeStamp, slot);
+}
+
+static void transmuxStripMetaJS(int reqId, std::string db, std::string src, std::string dst, emscripten::val options)
+{
+  transmuxStripMeta(reqId, db, src, dst, TranscodeOptionsFromJS(options));
+}
 
 EMSCRIPTEN_BINDINGS(videoutils) {
   emscripten::function("dumpMetaData",  &dumpMetaData);
   emscripten::function("readMetaData",  &readMetaData);
-  emscripten::function("transcodeRotation", &transcodeRotation);
-  emscripten::function("transmuxStripMeta", &transmuxStripMeta);
+  emscripten::function("readMetaDataBatch", &readMetaDataBatchJS);
+  emscripten::function("transcodeRotation", &transcodeRotationJS);
+  emscripten::function("transmuxStripMeta", &transmuxStripMetaJS);
 
   emscripten::function("createTrackingContext", &createTrackingContext);
   emscripten::function("destroyTrackingContext", &destroyTrackingContext);
   emscripten::function("trackObjectNextFrame2", &trackObjectNextFrame);
+  emscripten::function("trackObjectsNextFrame2", &trackObjectsNextFrameJS);
+  emscripten::function("getTrackingStats", &getTrackingStats);
+  emscripten::function("trackObjectInVideo", &trackObjectInVideo);
+  emscripten::function("allocateFrameSlots", &allocateFrameSlots);
+  emscripten::function("freeFrameSlots", &freeFrameSlots);
+  emscripten::function("trackObjectNextFrameInSlot2", &trackObjectNextFrameInSlot);
+  emscripten::function("trackObjectsNextFrameInSlot2", &trackObjectsNextFrameInSlotJS);
 }
 
 int main()
@@ -20,11 +119,46 @@ int main()
   InitVideoUtils();
 
   EM_ASM(
+    // the buffer is RGBA or a luma plane, going by its size
     Module.trackObjectNextFrame = (reqId,trackingCtxId,timeStamp,width,height,buffer) => {
       const u8 = new Uint8Array(buffer);
       const ptr = Module._malloc(u8.byteLength); // The handler will free this data
       Module.HEAPU8.set(u8, ptr);
-      return Module['trackObjectNextFrame2'](reqId,trackingCtxId,timeStamp,width,height,ptr);
+      const channels = u8.byteLength / (width * height);
+      return Module['trackObjectNextFrame2'](reqId,trackingCtxId,timeStamp,width,height,channels,ptr);
+    };
+
+    Module.trackObjectsNextFrame = (reqId,trackingCtxIds,timeStamp,width,height,buffer) => {
+      const u8 = new Uint8Array(buffer);
+      const ptr = Module._malloc(u8.byteLength); // The handler will free this data
+      Module.HEAPU8.set(u8, ptr);
+      const channels = u8.byteLength / (width * height);
+      return Module['trackObjectsNextFrame2'](reqId,trackingCtxIds,timeStamp,width,height,channels,ptr);
+    };
+
+    // buffer (optional): a frame to copy into the slot first, for when the
+    // client can't write into the heap itself
+    const writeFrameSlot = (reqId,slot,buffer) => {
+      if (!buffer)
+        return true;
+      const slots = Module.frameSlots;
+      const u8 = new Uint8Array(buffer);
+      if (!slots || slot < 0 || slot >= slots.offsets.length || u8.byteLength != slots.width * slots.height * slots.channels) {
+        self.sendError(reqId, "Frame doesn't fit the frame slot");
+        return false;
+      }
+      Module.HEAPU8.set(u8, slots.offsets[slot]);
+      return true;
+    };
+
+    Module.trackObjectNextFrameInSlot = (reqId,trackingCtxId,timeStamp,slot,buffer) => {
+      if (writeFrameSlot(reqId,slot,buffer))
+        Module['trackObjectNextFrameInSlot2'](reqId,trackingCtxId,timeStamp,slot);
+    };
+
+    Module.trackObjectsNextFrameInSlot = (reqId,trackingCtxIds,timeStamp,slot,buffer) => {
+      if (writeFrameSlot(reqId,slot,buffer))
+        Module['trackObjectsNextFrameInSlot2'](reqId,trackingCtxIds,timeStamp,slot);
     };
   );
 
@@ -50,25 +184,6 @@ extern "C" {
 
 
 
-static bool loadFileBytes(const std::string &filename, std::vector<uint8_t> &bytes)
-{
-  bool success = false;
-
-  FILE *f = fopen(filename.c_str(), "rb");
-  if (f)
-  {
-    fseek(f, 0, SEEK_END);
-    auto size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    bytes.resize(size);
-    auto total = fread(bytes.data(), 1, bytes.size(), f);
-    success = true;
-    fclose(f);
-  }
-
-  return success;
-}
-
 ///////////////////////
 // Test/Demo program //
 ///////////////////////
@@ -86,8 +201,9 @@ int main(int argc, char **argv)
   InitFFmpegUtils();
 
   dumpMetaData(0, "", filename);
-  readMetaData(0, "", filename);
-  transcodeRotation(0, "", filename, filename + ".mp4");
+  readMetaData(0, "", filename, true);
+  readMetaDataBatch(0, "", { filename });
+  transcodeRotation(0, "", filename, filename + ".mp4", TranscodeOptions());
 
   return 0;
 }
@@ -0,0 +1,64 @@
+#include "mappedfile.h"
+
+#ifndef __EMSCRIPTEN__
+
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+std::shared_ptr<MappedFile> MappedFile::Open(const std::string &filename)
+{
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    return nullptr;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return nullptr;
+  }
+
+  size_t size = static_cast<size_t>(st.st_size);
+  void *data = nullptr;
+  if (size > 0)
+  {
+    data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return nullptr;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+  }
+
+  // the mapping stays valid after the descriptor is closed
+  close(fd);
+
+  return std::make_shared<MappedFile>(static_cast<const uint8_t*>(data), size);
+}
+
+
+MappedFile::~MappedFile()
+{
+  if (data)
+    munmap(const_cast<uint8_t*>(data), size);
+}
+
+
+int MappedFile::ReadAt(int64_t offset, uint8_t *buf, int n)
+{
+  if (offset < 0)
+    return -1;
+  if (offset >= (int64_t)size)
+    return 0;
+
+  n = (int)std::min<int64_t>(n, size - offset);
+  std::memcpy(buf, data + offset, n);
+  return n;
+}
+
+#endif // __EMSCRIPTEN__
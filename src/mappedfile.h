@@ -0,0 +1,39 @@
+#ifndef __VST_MAPPED_FILE_H__
+#define __VST_MAPPED_FILE_H__
+
+#ifndef __EMSCRIPTEN__
+
+#include "inputsource.h"
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+// Read-only memory map of a whole file (native builds only).  The pages are
+// advised for sequential access, so the kernel reads ahead and drops them
+// behind the demuxer instead of the file ever being copied onto the heap.
+class MappedFile : public InputSource
+{
+public:
+  // returns: nullptr if the file can't be opened or mapped
+  static std::shared_ptr<MappedFile> Open(const std::string &filename);
+
+  MappedFile(const uint8_t *data, size_t size) : data(data), size(size) {}
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const uint8_t* Data() const { return data; }
+
+  int64_t Size() const override { return size; }
+  int ReadAt(int64_t offset, uint8_t *buf, int n) override;
+
+private:
+  const uint8_t * const data;
+  const size_t size;
+};
+
+#endif // __EMSCRIPTEN__
+
+#endif
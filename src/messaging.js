@@ -6,6 +6,13 @@ self.sendResult = (id, result) => {
 };
 
 
+// partial result for a request that is still running; any number of these
+// can be sent before the final sendResult/sendError
+self.sendProgress = (id, progress) => {
+  postMessage({ id, progress });
+};
+
+
 self.sendError = (id, error) => {
   postMessage({ id, error });
 };
@@ -0,0 +1,454 @@
+#include "metadatacache.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+#ifdef __EMSCRIPTEN__
+#include <emscripten.h>
+#endif
+
+namespace
+{
+  // bytes hashed at each end of the file
+  const int kHashedBytes = 0x10000;
+
+  std::unordered_map<std::string, VideoMetaData> entries; // "db\nkey" -> metadata
+  std::set<std::string> loadedDBs;
+  std::unordered_map<std::string, std::vector<std::function<void()>>> pendingLoads; // db -> callers waiting on its load
+
+  std::string EntryName(const std::string &db, const std::string &key)
+  {
+    return db + "\n" + key;
+  }
+
+  // 64-bit FNV-1a
+  uint64_t Hash(uint64_t h, const uint8_t *buf, int size)
+  {
+    for (int i = 0; i < size; ++i)
+    {
+      h ^= buf[i];
+      h *= 0x100000001b3ULL;
+    }
+    return h;
+  }
+
+  // keys look like "<size>:<hash>:<filename>"
+  std::string FilenameFromKey(const std::string &key)
+  {
+    size_t pos = key.find(':');
+    pos = pos == std::string::npos ? pos : key.find(':', pos + 1);
+    return pos == std::string::npos ? std::string() : key.substr(pos + 1);
+  }
+
+  // bump whenever the fields stored below change; older entries then just miss
+  const int kFormatVersion = 3;
+
+  // strings are stored as single tokens
+  const char* Token(const std::string &str)
+  {
+    return str.empty() ? "-" : str.c_str();
+  }
+
+  std::string FromToken(const char *token)
+  {
+    return strcmp(token, "-") ? token : "";
+  }
+
+  // everything but the packet scan results, which are never cached
+  std::string Serialize(const VideoMetaData &meta)
+  {
+    char buf[512];
+    snprintf(buf, sizeof(buf), "%d %.17g %.17g %d %.17g %d %d %d %lld %lld %d %d %d %lld %s %s %s",
+             kFormatVersion,
+             meta.avgFrameRate, meta.realFrameRate, meta.numFrames, meta.duration,
+             meta.rotation, meta.vidWidth, meta.vidHeight,
+             (long long)meta.vidBitRate, (long long)meta.bitRate,
+             meta.hasAudio ? 1 : 0, meta.audioSampleRate, meta.audioChannels, (long long)meta.audioBitRate,
+             Token(meta.vidCodec), Token(meta.vidPixelFormat), Token(meta.audioCodec));
+    return buf;
+  }
+
+  bool Parse(const char *data, VideoMetaData &meta)
+  {
+    int version = 0, hasAudio = 0;
+    long long vidBitRate = 0, bitRate = 0, audioBitRate = 0;
+    char vidCodec[64] = {}, pixelFormat[64] = {}, audioCodec[64] = {};
+
+    int n = sscanf(data, "%d %lf %lf %d %lf %d %d %d %lld %lld %d %d %d %lld %63s %63s %63s",
+                   &version,
+                   &meta.avgFrameRate, &meta.realFrameRate, &meta.numFrames, &meta.duration,
+                   &meta.rotation, &meta.vidWidth, &meta.vidHeight,
+                   &vidBitRate, &bitRate,
+                   &hasAudio, &meta.audioSampleRate, &meta.audioChannels, &audioBitRate,
+                   vidCodec, pixelFormat, audioCodec);
+    if (n != 17 || version != kFormatVersion)
+      return false;
+
+    meta.vidBitRate     = vidBitRate;
+    meta.bitRate        = bitRate;
+    meta.hasAudio       = hasAudio != 0;
+    meta.audioBitRate   = audioBitRate;
+    meta.vidCodec       = FromToken(vidCodec);
+    meta.vidPixelFormat = FromToken(pixelFormat);
+    meta.audioCodec     = FromToken(audioCodec);
+    return true;
+  }
+
+  struct MetaDataLoadContext
+  {
+    std::string db;
+  };
+
+  struct MetaDataRecordContext
+  {
+    MetaDataRecordFunc onDone;
+  };
+
+  // every table of "<db>-metadata": the entries, then MetaDataCacheLoadRecordAsync()'s
+  const char *kTables = "METADATA pktidx";
+
+  bool IsRecordTable(const std::string &table)
+  {
+    return table != "METADATA" && (" " + std::string(kTables) + " ").find(" " + table + " ") != std::string::npos;
+  }
+
+#ifdef __EMSCRIPTEN__
+  // Module['openMetaDataDB'](db, onOpen, onError) opens "<db>-metadata" with all the
+  // tables in place.  Each worker has its own Module, hence the check on every call.
+  void DefineOpenMetaDataDB()
+  {
+    EM_ASM({
+      if (Module['openMetaDataDB'])
+        return;
+
+      const tables = UTF8ToString($0).split(' ');
+      Module['openMetaDataDB'] = (db, onOpen, onError) => {
+        // version 1 only had METADATA
+        const req = indexedDB.open(db + '-metadata', 2);
+        req.onupgradeneeded = (e) => {
+          const d = e.target.result;
+          for (const t of tables) {
+            if (!d.objectStoreNames.contains(t))
+              d.createObjectStore(t);
+          }
+        };
+        req.onsuccess = () => onOpen(req.result);
+        req.onerror = onError;
+      };
+    }, kTables);
+  }
+#endif
+
+#ifndef __EMSCRIPTEN__
+  std::string SidecarName(const std::string &key)
+  {
+    return FilenameFromKey(key) + ".meta";
+  }
+
+  bool ReadSidecar(const std::string &key, VideoMetaData &meta)
+  {
+    FILE *f = fopen(SidecarName(key).c_str(), "r");
+    if (!f)
+      return false;
+
+    char storedKey[4096] = {};
+    char data[512] = {};
+    bool found = fgets(storedKey, sizeof(storedKey), f) &&
+                 key + "\n" == storedKey &&
+                 fgets(data, sizeof(data), f) &&
+                 Parse(data, meta);
+    fclose(f);
+
+    return found;
+  }
+
+  void WriteSidecar(const std::string &key, const VideoMetaData &meta)
+  {
+    FILE *f = fopen(SidecarName(key).c_str(), "w");
+    if (!f)
+      return;
+
+    fprintf(f, "%s\n%s\n", key.c_str(), Serialize(meta).c_str());
+    fclose(f);
+  }
+
+  // "<filename>.<table>", next to the .meta sidecar
+  std::string RecordSidecarName(const std::string &table, const std::string &key)
+  {
+    return FilenameFromKey(key) + "." + table;
+  }
+#endif
+}
+
+
+#ifdef __EMSCRIPTEN__
+// called from the javascript side of MetaDataCacheLoadAsync(), once per stored entry
+extern "C" EMSCRIPTEN_KEEPALIVE void MetaDataCacheLoadEntry(void *userdata, const char *key, const char *data)
+{
+  auto *cxt = (MetaDataLoadContext*)userdata;
+
+  VideoMetaData meta;
+  if (Parse(data, meta))
+    entries[EntryName(cxt->db, key)] = meta;
+}
+
+// called from the javascript side of MetaDataCacheLoadRecordAsync(); buf is malloc'ed, or null
+extern "C" EMSCRIPTEN_KEEPALIVE void MetaDataCacheRecordLoaded(void *userdata, uint8_t *buf, int size)
+{
+  auto *cxt = (MetaDataRecordContext*)userdata;
+  cxt->onDone(buf, buf ? (size_t)size : 0);
+  free(buf);
+  delete cxt;
+}
+
+extern "C" EMSCRIPTEN_KEEPALIVE void MetaDataCacheLoadComplete(void *userdata)
+{
+  auto *cxt = (MetaDataLoadContext*)userdata;
+
+  // only now are the entries in memory; run everyone who asked while loading
+  loadedDBs.insert(cxt->db);
+  auto waiting = std::move(pendingLoads[cxt->db]);
+  pendingLoads.erase(cxt->db);
+  delete cxt;
+
+  for (auto &onDone : waiting)
+    onDone();
+}
+#endif
+
+
+std::string MetaDataCacheKey(const std::string &filename, InputSource &file)
+{
+  const int64_t size = file.Size();
+  std::vector<uint8_t> buf(kHashedBytes);
+
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  int64_t tailStart = FFMAX(size - kHashedBytes, (int64_t)kHashedBytes);
+  for (int64_t offset : { (int64_t)0, tailStart })
+  {
+    int n = offset < size ? file.ReadAt(offset, buf.data(), (int)FFMIN((int64_t)kHashedBytes, size - offset)) : 0;
+    if (n < 0)
+      return std::string();
+    hash = Hash(hash, buf.data(), n);
+  }
+
+  char prefix[64];
+  snprintf(prefix, sizeof(prefix), "%" PRId64 ":%016" PRIx64 ":", size, hash);
+  return prefix + filename;
+}
+
+
+void MetaDataCacheLoadAsync(const std::string &db, std::function<void()> onDone)
+{
+  if (loadedDBs.count(db)) {
+    onDone();
+    return;
+  }
+
+#ifdef __EMSCRIPTEN__
+  // a load already under way calls this back when it finishes
+  auto &waiting = pendingLoads[db];
+  waiting.push_back(onDone);
+  if (waiting.size() > 1)
+    return;
+
+  auto *cxt = new MetaDataLoadContext { db };
+
+  DefineOpenMetaDataDB();
+  EM_ASM({
+    const userdata = $1;
+
+    const done = () => Module['_MetaDataCacheLoadComplete'](userdata);
+
+    // strings are passed in temporary heap copies
+    const withString = (str, fn) => {
+      const len = lengthBytesUTF8(str) + 1;
+      const ptr = _malloc(len);
+      stringToUTF8(str, ptr, len);
+      try { fn(ptr); } finally { _free(ptr); }
+    };
+
+    Module['openMetaDataDB'](UTF8ToString($0), (d) => {
+      try {
+        const getAll = d.transaction(['METADATA'], 'readonly').objectStore('METADATA').getAll();
+        getAll.onerror = () => { d.close(); done(); };
+        getAll.onsuccess = () => {
+          d.close();
+          for (const m of getAll.result) {
+            if (typeof m.key === 'string' && typeof m.data === 'string')
+              withString(m.key, (key) => withString(m.data, (data) => Module['_MetaDataCacheLoadEntry'](userdata, key, data)));
+          }
+          done();
+        };
+      }
+      catch (e) {
+        d.close();
+        done();
+      }
+    }, done);
+  }, db.c_str(), cxt);
+#else
+  // sidecar files are read on demand by MetaDataCacheFind()
+  loadedDBs.insert(db);
+  onDone();
+#endif
+}
+
+
+bool MetaDataCacheFind(const std::string &db, const std::string &key, VideoMetaData &outMeta)
+{
+  if (key.empty())
+    return false;
+
+  auto it = entries.find(EntryName(db, key));
+  if (it != entries.end()) {
+    outMeta = it->second;
+    return true;
+  }
+
+#ifndef __EMSCRIPTEN__
+  VideoMetaData meta;
+  if (ReadSidecar(key, meta)) {
+    entries[EntryName(db, key)] = meta;
+    outMeta = meta;
+    return true;
+  }
+#endif
+
+  return false;
+}
+
+
+void MetaDataCacheStore(const std::string &db, const std::string &key, const VideoMetaData &meta)
+{
+  if (key.empty())
+    return;
+
+  VideoMetaData &entry = entries[EntryName(db, key)];
+  entry = meta;
+  entry.packetsScanned = false;
+  entry.keyframeTimes.clear();
+
+#ifdef __EMSCRIPTEN__
+  DefineOpenMetaDataDB();
+  EM_ASM({
+    const key = UTF8ToString($1);
+    const entry = ({ key: key, data: UTF8ToString($2) });
+
+    // a failed store only costs a re-probe next session
+    Module['openMetaDataDB'](UTF8ToString($0), (d) => {
+      try {
+        const trans = d.transaction(['METADATA'], 'readwrite');
+        trans.objectStore('METADATA').put(entry, key);
+        trans.oncomplete = () => d.close();
+        trans.onabort = () => d.close();
+      }
+      catch (e) {
+        d.close();
+      }
+    }, () => {});
+  }, db.c_str(), key.c_str(), Serialize(meta).c_str());
+#else
+  WriteSidecar(key, meta);
+#endif
+}
+
+
+void MetaDataCacheLoadRecordAsync(const std::string &db, const std::string &table, const std::string &key,
+                                  MetaDataRecordFunc onDone)
+{
+  if (key.empty() || !IsRecordTable(table)) {
+    onDone(nullptr, 0);
+    return;
+  }
+
+#ifdef __EMSCRIPTEN__
+  auto *cxt = new MetaDataRecordContext { onDone };
+
+  DefineOpenMetaDataDB();
+  EM_ASM({
+    const table = UTF8ToString($1);
+    const key = UTF8ToString($2);
+    const userdata = $3;
+
+    const done = (data) => {
+      let ptr = 0;
+      if (data && data.byteLength) {
+        ptr = _malloc(data.byteLength);
+        HEAPU8.set(data, ptr);
+      }
+      Module['_MetaDataCacheRecordLoaded'](userdata, ptr, ptr ? data.byteLength : 0);
+    };
+
+    Module['openMetaDataDB'](UTF8ToString($0), (d) => {
+      try {
+        const get = d.transaction([table], 'readonly').objectStore(table).get(key);
+        get.onerror = () => { d.close(); done(null); };
+        get.onsuccess = () => {
+          d.close();
+          const r = get.result;
+          done(r instanceof Uint8Array ? r : r instanceof ArrayBuffer ? new Uint8Array(r) : null);
+        };
+      }
+      catch (e) {
+        d.close();
+        done(null);
+      }
+    }, () => done(null));
+  }, db.c_str(), table.c_str(), key.c_str(), cxt);
+#else
+  std::vector<uint8_t> bytes;
+  FILE *f = fopen(RecordSidecarName(table, key).c_str(), "rb");
+  if (f) {
+    uint8_t buf[0x10000];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+      bytes.insert(bytes.end(), buf, buf + n);
+    fclose(f);
+  }
+  onDone(bytes.empty() ? nullptr : bytes.data(), bytes.size());
+#endif
+}
+
+
+void MetaDataCacheStoreRecord(const std::string &db, const std::string &table, const std::string &key,
+                              const uint8_t *buf, size_t size)
+{
+  if (key.empty() || !IsRecordTable(table))
+    return;
+
+#ifdef __EMSCRIPTEN__
+  DefineOpenMetaDataDB();
+  EM_ASM({
+    const table = UTF8ToString($1);
+    const key = UTF8ToString($2);
+    // copied now: buf is gone by the time the database is open
+    const data = HEAPU8.slice($3, $3 + $4);
+
+    // a failed store only costs rebuilding the record next session
+    Module['openMetaDataDB'](UTF8ToString($0), (d) => {
+      try {
+        const trans = d.transaction([table], 'readwrite');
+        trans.objectStore(table).put(data, key);
+        trans.oncomplete = () => d.close();
+        trans.onabort = () => d.close();
+      }
+      catch (e) {
+        d.close();
+      }
+    }, () => {});
+  }, db.c_str(), table.c_str(), key.c_str(), buf, (int)size);
+#else
+  FILE *f = fopen(RecordSidecarName(table, key).c_str(), "wb");
+  if (!f)
+    return;
+
+  fwrite(buf, 1, size, f);
+  fclose(f);
+#endif
+}
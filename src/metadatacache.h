@@ -0,0 +1,46 @@
+#ifndef __VST_METADATA_CACHE_H__
+#define __VST_METADATA_CACHE_H__
+
+#include <functional>
+#include <string>
+
+#include "ffmpegutils.h"
+#include "inputsource.h"
+
+// VideoMetaData for files that never change once they've been imported.
+//
+// Entries live in memory and are persisted next to the files: in the browser
+// in their own IndexedDB database ("<db>-metadata"), natively in a
+// "<filename>.meta" sidecar file.  The key covers the filename, the size and a
+// hash of the bytes at both ends of the file (where the MP4/MOV headers are),
+// so a file replaced under the same name misses instead of returning stale data.
+
+// returns: the cache key for file, or an empty string if it couldn't be read
+std::string MetaDataCacheKey(const std::string &filename, InputSource &file);
+
+// Loads the persisted entries for db into memory; only the first call per db
+// does any work, and calls made while it's loading wait for it to finish.
+// onDone is called even if nothing could be loaded.
+void MetaDataCacheLoadAsync(const std::string &db, std::function<void()> onDone);
+
+// returns: true and fills in outMeta on a hit
+bool MetaDataCacheFind(const std::string &db, const std::string &key, VideoMetaData &outMeta);
+
+// adds an entry to memory and (in the background) to the persistent store;
+// packet scan results aren't kept
+void MetaDataCacheStore(const std::string &db, const std::string &key, const VideoMetaData &meta);
+
+
+// Binary records that go with an entry but are too big to keep in memory for
+// every file (the packet index, table "pktidx"): stored under the same key in
+// their own table of "<db>-metadata", natively in "<filename>.<table>".  Bytes
+// are stored as given; the caller picks a byte order.
+using MetaDataRecordFunc = std::function<void(const uint8_t *buf, size_t size)>; // buf is null on a miss
+
+void MetaDataCacheLoadRecordAsync(const std::string &db, const std::string &table, const std::string &key,
+                                  MetaDataRecordFunc onDone);
+// buf is copied before this returns; a failed store is ignored
+void MetaDataCacheStoreRecord(const std::string &db, const std::string &table, const std::string &key,
+                              const uint8_t *buf, size_t size);
+
+#endif
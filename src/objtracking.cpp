@@ -2,8 +2,18 @@
 #include <functional>
 
 #include "objtracking/VSTVideoTracker.hpp"
+#include "trackingregistry.h"
+#include "indexeddb.h"
+#include "metadatacache.h"
+#include "packetindex.h"
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
 
 using vst::TrackerResult;
+using vst::VSTSharedFrame;
 using vst::VSTVideoTracker;
 using OpStatus = vst::TrackerResult::OpStatus;
 
@@ -63,43 +73,222 @@ namespace
     printf("[***] sendTrackObjectResponse (id=%d, %f,%f timeStamp=%f)\n", id, x, y, timeStamp);
 #endif
   }
+
+
+  // status: a TrackerResult::OpStatus, or kInvalidContext
+  const int kInvalidContext = -1;
+
+  const char* TrackingErrorMessage(int status)
+  {
+    switch (status) {
+      case kInvalidContext:                 return "Invalid Tracking Context";
+      case TrackerResult::suspicionFailure: return "Suspicion Engine Failure";
+      case TrackerResult::openCVError:      return "OpenCV Error";
+      case TrackerResult::otherFailure:     return "Other Failure";
+      default:                              return "unknown";
+    }
+  }
+
+
+  // one result per tracking context, in the order they were asked for:
+  // { trackingCtxId, x, y, timeStamp }, or { trackingCtxId, error }
+  void sendTrackObjectsResponse(int id, double timeStamp, const std::vector<int> &ctxIds,
+                                const std::vector<int> &status, const std::vector<double> &xy)
+  {
+#ifdef __EMSCRIPTEN__
+    std::vector<const char*> errors;
+    for (int s : status)
+      errors.push_back(s == TrackerResult::success ? nullptr : TrackingErrorMessage(s));
+
+    EM_ASM({
+      const results = [];
+      for (let i = 0; i < $2; ++i) {
+        const trackingCtxId = HEAP32[($3 >> 2) + i];
+        const error = HEAPU32[($5 >> 2) + i];
+        if (error)
+          results.push({ trackingCtxId: trackingCtxId, error: UTF8ToString(error) });
+        else
+          results.push({ trackingCtxId: trackingCtxId, x: HEAPF64[($4 >> 3) + 2 * i], y: HEAPF64[($4 >> 3) + 2 * i + 1], timeStamp: $1 });
+      }
+      self.sendResult($0, results);
+    }, id, timeStamp, (int)ctxIds.size(), ctxIds.data(), xy.data(), errors.data());
+#else
+    printf("[***] sendTrackObjectsResponse (id=%d, timeStamp=%f)\n", id, timeStamp);
+    for (size_t i = 0; i < ctxIds.size(); ++i)
+    {
+      if (status[i] == TrackerResult::success)
+        printf("\t%d: %f,%f\n", ctxIds[i], xy[2 * i], xy[2 * i + 1]);
+      else
+        printf("\t%d: %s\n", ctxIds[i], TrackingErrorMessage(status[i]));
+    }
+#endif
+  }
+
+
+  // also leaves the slots' offsets in Module.frameSlots for the JS side of the
+  // *InSlot functions to write into
+  void sendFrameSlotsResponse(int id, int width, int height, int channels, const std::vector<uint32_t> &offsets)
+  {
+#ifdef __EMSCRIPTEN__
+    EM_ASM({
+      const offsets = Array.from(HEAPU32.subarray(($3 >> 2), ($3 >> 2) + $4));
+      Module.frameSlots = ({ width: $1, height: $2, channels: $5, offsets: offsets });
+      const shared = typeof SharedArrayBuffer !== 'undefined' && HEAPU8.buffer instanceof SharedArrayBuffer;
+      self.sendResult($0, {
+        width: $1,
+        height: $2,
+        channels: $5,
+        offsets: offsets,
+        memory: shared ? HEAPU8.buffer : null
+      });
+    }, id, width, height, offsets.data(), (int)offsets.size(), channels);
+#else
+    printf("[***] sendFrameSlotsResponse (id=%d, %d slots of %dx%dx%d)\n", id, (int)offsets.size(), width, height, channels);
+#endif
+  }
+
+
+  // positions: timeStamp, x, y per frame; errors: null, or why the frame has no position
+  void sendTrackPositionsProgress(int id, const std::vector<double> &positions, const std::vector<const char*> &errors)
+  {
+#ifdef __EMSCRIPTEN__
+    EM_ASM({
+      const results = [];
+      for (let i = 0; i < $1; ++i) {
+        const timeStamp = HEAPF64[($2 >> 3) + 3 * i];
+        const error = HEAPU32[($3 >> 2) + i];
+        if (error)
+          results.push({ timeStamp: timeStamp, error: UTF8ToString(error) });
+        else
+          results.push({ timeStamp: timeStamp, x: HEAPF64[($2 >> 3) + 3 * i + 1], y: HEAPF64[($2 >> 3) + 3 * i + 2] });
+      }
+      self.sendProgress($0, results);
+    }, id, (int)errors.size(), positions.data(), errors.data());
+#else
+    printf("[***] sendTrackPositionsProgress (id=%d, %d frames)\n", id, (int)errors.size());
+#endif
+  }
+
+
+  void sendTrackInVideoResponse(int id, int frames, int failures, double seconds)
+  {
+#ifdef __EMSCRIPTEN__
+    EM_ASM({
+      self.sendResult($0, {
+        frames: $1,
+        failures: $2,
+        seconds: $3
+      });
+    }, id, frames, failures, seconds);
+#else
+    printf("[***] sendTrackInVideoResponse (id=%d, %d frames, %d failures, %f sec)\n", id, frames, failures, seconds);
+#endif
+  }
+
+
+  void sendTrackingStatsResponse(int id, const TrackingContext::Stats &stats)
+  {
+#ifdef __EMSCRIPTEN__
+    EM_ASM({
+      self.sendResult($0, {
+        frames: $1,
+        failures: $2,
+        msPerFrame: $3
+      });
+    }, id, (double)stats.frames, (double)stats.failures, stats.MsPerFrame());
+#else
+    printf("[***] sendTrackingStatsResponse (id=%d, %lld frames, %lld failures, %f ms/frame)\n",
+           id, (long long)stats.frames, (long long)stats.failures, stats.MsPerFrame());
+#endif
+  }
 }
 
 
 
+static TrackingRegistry& Trackers()
+{
+  static TrackingRegistry registry;
+  return registry;
+}
 
-// only one context is currently supported.
-static int _nextId = 1;
-static VSTVideoTracker *__tracker = nullptr;
+// trackObjectsNextFrame's current frame and background model, one per set of
+// contexts tracked together, i.e. per video being tracked
+static std::map<std::vector<int>, VSTSharedFrame>& SharedFrames()
+{
+  static std::map<std::vector<int>, VSTSharedFrame> frames;
+  return frames;
+}
 
-static int CreateTrackingContext(double x, double y, double radius)
+static VSTSharedFrame& SharedFrameFor(std::vector<int> trackingCtxIds)
+{
+  std::sort(trackingCtxIds.begin(), trackingCtxIds.end());
+  trackingCtxIds.erase(std::unique(trackingCtxIds.begin(), trackingCtxIds.end()), trackingCtxIds.end());
+  return SharedFrames()[trackingCtxIds];
+}
+
+// frame buffers that stay put between frames, so JS can write each frame
+// straight into the heap instead of handing over a new allocation every time
+struct FrameSlots
 {
-  int trackingCtxId = _nextId++;
+  int width = 0;
+  int height = 0;
+  int channels = 4;
+  std::vector<std::unique_ptr<uint8_t[]>> buffers;
+};
 
+static FrameSlots& Slots()
+{
+  static FrameSlots slots;
+  return slots;
+}
+
+// returns: null if there is no such slot
+static uint8_t* SlotBuffer(int slot)
+{
+  auto &slots = Slots();
+  if (slot < 0 || slot >= (int)slots.buffers.size())
+    return nullptr;
+  return slots.buffers[slot].get();
+}
+
+// Frames are RGBA, or a single luma plane (e.g. the Y plane of a decoded YUV
+// frame) which the trackers then work on throughout without converting.
+// returns: false for any other number of channels
+static bool FrameFromBuffer(int width, int height, int channels, uint8_t *buf, cv::Mat &frame)
+{
+  if (channels != 1 && channels != 4)
+    return false;
+  frame = cv::Mat(height, width, channels == 1 ? CV_8UC1 : CV_8UC4, (void*)buf);
+  return true;
+}
+
+// the tracker's starting template: the square around the object
+static cv::Rect TemplateArea(double x, double y, double radius)
+{
   int w = radius * 2;
   int h = radius * 2;
-  auto templateLoc = cv::Rect(x-radius,y-radius,w,h);
-  int subtractionPeriod = 1;
-  __tracker = new VSTVideoTracker(templateLoc, subtractionPeriod);
-
-  return trackingCtxId;
+  return cv::Rect(x-radius,y-radius,w,h);
 }
 
-static VSTVideoTracker* LookupTracker(int trackingCtxId)
+static int CreateTrackingContext(double x, double y, double radius)
 {
-  return __tracker;
+  int subtractionPeriod = 1;
+  return Trackers().Create(TemplateArea(x,y,radius), subtractionPeriod);
 }
 
-static bool DestroyTrackingContext(int trackingCtxId)
+// tracks ctx's object in frame (a cv::Mat or VSTSharedFrame) and counts the cost against it
+template <typename Frame>
+static TrackerResult TrackInContext(TrackingContext &ctx, Frame &frame, double timeStamp)
 {
-  bool found = false;
-  if (__tracker)
-  {
-    delete __tracker;
-    __tracker = nullptr;
-    found = true;
-  }
-  return found;
+  auto start = std::chrono::steady_clock::now();
+  auto result = ctx.tracker->TrackObjectInFrame(frame, timeStamp);
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  ++ctx.stats.frames;
+  if (result.Status() != TrackerResult::success)
+    ++ctx.stats.failures;
+  ctx.stats.seconds += elapsed.count();
+  return result;
 }
 
 void createTrackingContext(int reqId, double x, double y, double radius)
@@ -110,24 +299,47 @@ void createTrackingContext(int reqId, double x, double y, double radius)
 
 void destroyTrackingContext(int reqId, int trackingCtxId)
 {
-  if (DestroyTrackingContext(trackingCtxId))
+  if (Trackers().Destroy(trackingCtxId))
+  {
+    // the background models learned alongside this context go with it
+    auto &frames = SharedFrames();
+    for (auto it = frames.begin(); it != frames.end(); )
+    {
+      if (std::binary_search(it->first.begin(), it->first.end(), trackingCtxId))
+        it = frames.erase(it);
+      else
+        ++it;
+    }
     sendResponse(reqId);
+  }
   else
     sendError(reqId, "Failed to destroy tracking context");
 }
 
-void trackObjectNextFrame(int reqId, int trackingCtxId, double timeStamp, int width, int height, uint32_t pbuf)
+void getTrackingStats(int reqId, int trackingCtxId)
 {
-  auto *tracker = LookupTracker(trackingCtxId);
-  if (!tracker) {
+  auto *ctx = Trackers().Find(trackingCtxId);
+  if (!ctx) {
     sendError(reqId, "Invalid Tracking Context");
     return;
   }
+  sendTrackingStatsResponse(reqId, ctx->stats);
+}
 
-  auto buf = reinterpret_cast<uint8_t*>(pbuf); // WASM32
+static void TrackObjectInBuffer(int reqId, int trackingCtxId, double timeStamp, int width, int height, int channels, uint8_t *buf)
+{
+  auto *ctx = Trackers().Find(trackingCtxId);
+  if (!ctx) {
+    sendError(reqId, "Invalid Tracking Context");
+    return;
+  }
 
-  cv::Mat frame(height, width, CV_8UC4, (void*)buf);
-  auto result = tracker->TrackObjectInFrame(frame, timeStamp);
+  cv::Mat frame;
+  if (!FrameFromBuffer(width, height, channels, buf, frame)) {
+    sendError(reqId, "Invalid Frame Format");
+    return;
+  }
+  auto result = TrackInContext(*ctx, frame, timeStamp);
 
   if (result.Status() == TrackerResult::success)
   {
@@ -145,6 +357,211 @@ void trackObjectNextFrame(int reqId, int trackingCtxId, double timeStamp, int wi
         sendError(reqId, "unknown");
     }
   }
+}
+
+static void TrackObjectsInBuffer(int reqId, const std::vector<int> &trackingCtxIds, double timeStamp, int width, int height, int channels, uint8_t *buf)
+{
+  cv::Mat mat;
+  if (!FrameFromBuffer(width, height, channels, buf, mat)) {
+    sendError(reqId, "Invalid Frame Format");
+    return;
+  }
+
+  // every tracker reads the one frame, and its grayscale and foreground
+  // images are made once for all of them
+  auto &frame = SharedFrameFor(trackingCtxIds);
+  frame.SetFrame(mat);
+
+  std::vector<int> status(trackingCtxIds.size(), kInvalidContext);
+  std::vector<double> xy(2 * trackingCtxIds.size(), 0);
+  for (size_t i = 0; i < trackingCtxIds.size(); ++i)
+  {
+    auto *ctx = Trackers().Find(trackingCtxIds[i]);
+    if (!ctx)
+      continue;
+
+    auto result = TrackInContext(*ctx, frame, timeStamp);
+    status[i] = result.Status();
+    if (result.Status() == TrackerResult::success) {
+      xy[2 * i]     = result.ObjectCenter().x;
+      xy[2 * i + 1] = result.ObjectCenter().y;
+    }
+  }
+
+  frame.Clear();
+  sendTrackObjectsResponse(reqId, timeStamp, trackingCtxIds, status, xy);
+}
 
+void trackObjectNextFrame(int reqId, int trackingCtxId, double timeStamp, int width, int height, int channels, uint32_t pbuf)
+{
+  auto buf = reinterpret_cast<uint8_t*>(pbuf); // WASM32
+  TrackObjectInBuffer(reqId, trackingCtxId, timeStamp, width, height, channels, buf);
   free(buf); // allocated in js code
 }
+
+void trackObjectsNextFrame(int reqId, std::vector<int> trackingCtxIds, double timeStamp, int width, int height, int channels, uint32_t pbuf)
+{
+  auto buf = reinterpret_cast<uint8_t*>(pbuf); // WASM32
+  TrackObjectsInBuffer(reqId, trackingCtxIds, timeStamp, width, height, channels, buf);
+  free(buf); // allocated in js code
+}
+
+void allocateFrameSlots(int reqId, int width, int height, int channels, int count)
+{
+  if (width <= 0 || height <= 0 || count <= 0) {
+    sendError(reqId, "Invalid Frame Slot Size");
+    return;
+  }
+  if (channels != 1 && channels != 4) {
+    sendError(reqId, "Invalid Frame Format");
+    return;
+  }
+
+  auto &slots = Slots();
+  slots = FrameSlots();
+  slots.width = width;
+  slots.height = height;
+  slots.channels = channels;
+
+  std::vector<uint32_t> offsets;
+  for (int i = 0; i < count; ++i)
+  {
+    slots.buffers.emplace_back(new uint8_t[(size_t)width * height * channels]);
+    offsets.push_back(reinterpret_cast<uintptr_t>(slots.buffers.back().get())); // WASM32
+  }
+  sendFrameSlotsResponse(reqId, width, height, channels, offsets);
+}
+
+void freeFrameSlots(int reqId)
+{
+  Slots() = FrameSlots();
+#ifdef __EMSCRIPTEN__
+  EM_ASM({ Module.frameSlots = null; });
+#endif
+  sendResponse(reqId);
+}
+
+void trackObjectNextFrameInSlot(int reqId, int trackingCtxId, double timeStamp, int slot)
+{
+  auto *buf = SlotBuffer(slot);
+  if (!buf) {
+    sendError(reqId, "Invalid Frame Slot");
+    return;
+  }
+  TrackObjectInBuffer(reqId, trackingCtxId, timeStamp, Slots().width, Slots().height, Slots().channels, buf);
+}
+
+void trackObjectsNextFrameInSlot(int reqId, std::vector<int> trackingCtxIds, double timeStamp, int slot)
+{
+  auto *buf = SlotBuffer(slot);
+  if (!buf) {
+    sendError(reqId, "Invalid Frame Slot");
+    return;
+  }
+  TrackObjectsInBuffer(reqId, trackingCtxIds, timeStamp, Slots().width, Slots().height, Slots().channels, buf);
+}
+
+void trackObjectInVideo(int reqId, std::string db, std::string filename, double x, double y, double radius,
+                        double startTime, double endTime)
+{
+  // positions go back in batches of this many frames
+  const size_t kBatchFrames = 30;
+
+  ///
+  auto track = [=](std::shared_ptr<InputSource> file, std::shared_ptr<PacketIndex> index)
+  {
+    int result = 0;
+    AVFormatContext *ic = CreateInputFormatContext(file, result);
+
+    if (0 == result && ic)
+    {
+      auto start = std::chrono::steady_clock::now();
+      VSTVideoTracker tracker(TemplateArea(x,y,radius), 1);
+      int frames = 0;
+      int failures = 0;
+
+      std::vector<double> positions;
+      std::vector<const char*> errors;
+
+      // the decoder's luma plane goes to the tracker as is; no RGBA, no copy
+      auto onFrame = [&](const LumaFrame &luma)
+      {
+        cv::Mat frame(luma.height, luma.width, CV_8UC1, (void*)luma.data, luma.stride);
+        auto result = tracker.TrackObjectInFrame(frame, luma.time);
+
+        ++frames;
+        positions.push_back(luma.time);
+        if (result.Status() == TrackerResult::success)
+        {
+          positions.push_back(result.ObjectCenter().x);
+          positions.push_back(result.ObjectCenter().y);
+          errors.push_back(nullptr);
+        }
+        else
+        {
+          ++failures;
+          positions.push_back(0);
+          positions.push_back(0);
+          errors.push_back(TrackingErrorMessage(result.Status()));
+        }
+
+        if (errors.size() == kBatchFrames)
+        {
+          sendTrackPositionsProgress(reqId, positions, errors);
+          positions.clear();
+          errors.clear();
+        }
+        return true;
+      };
+
+      DecodeOptions options;
+      options.startTime = startTime;
+      options.endTime = endTime;
+      options.index = index.get();
+
+      int errCode = 0;
+      bool success = DecodeVideoLuma(ic, options, onFrame, errCode);
+      if (!errors.empty())
+        sendTrackPositionsProgress(reqId, positions, errors);
+
+      if (success)
+      {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        sendTrackInVideoResponse(reqId, frames, failures, elapsed.count());
+      }
+      else
+      {
+        fprintf(stderr, "Failed to decode video: errCode=%d\n", errCode);
+        sendError(reqId, "Failed to decode video");
+      }
+    }
+    else
+      sendError(reqId, "Failed to read video file");
+
+    if (ic)
+      FreeInputFormatContext(ic);
+  };
+
+  ///
+  auto onSuccess = [=](std::shared_ptr<InputSource> file)
+  {
+    // the index stored by readMetaData or a transcode finds startTime's GOP
+    // without searching the file
+    if (startTime > 0)
+    {
+      LoadPacketIndexAsync(db, MetaDataCacheKey(filename, *file), [=](std::shared_ptr<PacketIndex> index) {
+        track(file, index);
+      });
+    }
+    else
+      track(file, nullptr);
+  };
+
+  ///
+  auto onError = [=]()
+  {
+    sendError(reqId, "Failed to load file");
+  };
+
+  IDBOpenAsync(db, filename, onSuccess, onError);
+}
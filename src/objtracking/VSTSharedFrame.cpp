@@ -0,0 +1,45 @@
+//
+//  VSTSharedFrame.cpp
+//  Video Physics
+//
+//  Copyright © 2020 Vernier Software & Technology. All rights reserved.
+//
+
+#include "VSTSharedFrame.hpp"
+
+using namespace vst;
+using namespace cv;
+
+void VSTSharedFrame::SetFrame(const cv::Mat& frame) {
+    _frame = frame;
+    _hasGray = false;
+    _hasForeground = false;
+}
+
+void VSTSharedFrame::Clear() {
+    SetFrame(Mat());
+}
+
+void VSTSharedFrame::Reset() {
+    Clear();
+    _subtractor = createBackgroundSubtractorMOG2(7, 3, false);
+}
+
+const cv::Mat& VSTSharedFrame::Gray() {
+    if (_frame.channels() == 1)
+        return _frame;
+    if (!_hasGray) {
+        cvtColor(_frame, _gray, COLOR_BGRA2GRAY);
+        _hasGray = true;
+    }
+    return _gray;
+}
+
+const cv::Mat& VSTSharedFrame::Foreground() {
+    if (!_hasForeground) {
+        // Same learning rate the trackers use for their own subtractors.
+        _subtractor->apply(_frame, _foreground, .01);
+        _hasForeground = true;
+    }
+    return _foreground;
+}
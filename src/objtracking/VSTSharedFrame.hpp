@@ -0,0 +1,57 @@
+//
+//  VSTSharedFrame.hpp
+//  Video Physics
+//
+//  Copyright © 2020 Vernier Software & Technology. All rights reserved.
+//
+
+#ifndef VSTSharedFrame_hpp
+#define VSTSharedFrame_hpp
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/video.hpp>
+
+namespace vst {
+
+/// One frame of a video, with the full-frame images every `VSTVideoTracker` following
+/// an object in that video needs. Each image is computed the first time a tracker asks
+/// for it and then shared, so tracking N objects converts and background-subtracts the
+/// frame once instead of N times; the trackers only crop, find edges and search.
+///
+/// To use, call `SetFrame()` with each successive frame and pass this object to
+/// `VSTVideoTracker::TrackObjectInFrame()` for every tracked object.
+class VSTSharedFrame {
+public:
+
+    /// Starts the next frame. `frame` is not copied and must stay valid until the next
+    /// call, or `Clear()`.
+    void        SetFrame(const cv::Mat& frame);
+
+    /// Drops the current frame and the images made from it.
+    void        Clear();
+
+    /// Forgets the background model as well, for a new video.
+    void        Reset();
+
+    const cv::Mat&  Frame() const { return _frame; }
+
+    /// The frame in grayscale; the frame itself if it is already single-channel.
+    const cv::Mat&  Gray();
+
+    /// The foreground mask from the background model, which learns from each frame once
+    /// however many trackers ask.
+    const cv::Mat&  Foreground();
+
+private:
+    cv::Mat     _frame;
+    cv::Mat     _gray;
+    cv::Mat     _foreground;
+    bool        _hasGray = false;
+    bool        _hasForeground = false;
+    cv::Ptr<cv::BackgroundSubtractorMOG2>
+                _subtractor = cv::createBackgroundSubtractorMOG2(7, 3, false);
+};
+
+};
+
+#endif /* VSTSharedFrame_hpp */
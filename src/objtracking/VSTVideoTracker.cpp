@@ -64,6 +64,14 @@ namespace
 }
 
 TrackerResult VSTVideoTracker::TrackObjectInFrame(const cv::Mat& frame, double timeStamp) {
+    return Track(frame, nullptr, timeStamp);
+}
+
+TrackerResult VSTVideoTracker::TrackObjectInFrame(VSTSharedFrame& frame, double timeStamp) {
+    return Track(frame.Frame(), &frame, timeStamp);
+}
+
+TrackerResult VSTVideoTracker::Track(const cv::Mat& frame, VSTSharedFrame* shared, double timeStamp) {
 
     try {
         Mat mask;
@@ -89,12 +97,16 @@ TrackerResult VSTVideoTracker::TrackObjectInFrame(const cv::Mat& frame, double t
             // Calculate initial template and histogram:
             // Note: Mat::operator() in use:
             _lastObjectLocation = _templateArea;
-            _template = frame(_templateArea).clone();
+            _template = (shared ? shared->Gray() : frame)(_templateArea).clone();
             DrawDetectedEdges(_template, Mat());
             CalculateHistogram(_template, _histogram);
 
             // Set foreground baseline:
-            _subtractor->apply(frame, _foreground, .01); // TODO: figure out the constant to use for the initial frame.
+            // A shared frame's background model learns from the frame when it is asked for the mask.
+            if (shared)
+                shared->Foreground();
+            else
+                _subtractor->apply(frame, _foreground, .01); // TODO: figure out the constant to use for the initial frame.
 
             // Prime the suspicion engine by passing in the initial starting template center:
             cv::Point center = CenterOf(_templateArea);
@@ -118,8 +130,9 @@ TrackerResult VSTVideoTracker::TrackObjectInFrame(const cv::Mat& frame, double t
 
         // 2. Crop the frame and only draw it's edges. Note: Mat overrides operator() to take a
         // rectangle which returns a Mat of the subsection. We clone it because we'd like to draw
-        // edges on top of it.
-        searchFrame = frame(searchRect).clone();
+        // edges on top of it. A shared frame has already been converted to grayscale once for
+        // every tracker, so crop that instead.
+        searchFrame = (shared ? shared->Gray() : frame)(searchRect).clone();
 
         // Get the previous objects location in the new search rect
         // This is needed because the search rect has changed.
@@ -128,8 +141,11 @@ TrackerResult VSTVideoTracker::TrackObjectInFrame(const cv::Mat& frame, double t
 
         if (_frameCountInSubtractionPeriod % _subtractionPeriod == 0)
         {
-            _subtractor->apply(frame, _foreground, .01);
-            mask = SubtractBackground(_foreground, searchRect, objLocInFrame);
+            // SubtractBackground() only copies the search area out of the mask, so the
+            // shared one is used as is rather than copied for every tracker.
+            if (!shared)
+                _subtractor->apply(frame, _foreground, .01);
+            mask = SubtractBackground(shared ? shared->Foreground() : _foreground, searchRect, objLocInFrame);
             DrawDetectedEdges(searchFrame, mask);
         }
         else
@@ -264,8 +280,9 @@ cv::Mat VSTVideoTracker::SubtractBackground(const cv::Mat& fore, const cv::Rect&
 }
 
 void VSTVideoTracker::DrawDetectedEdges(cv::Mat& matInOut, const cv::Mat& mask) {
-    // Grayscale and blur
-    cvtColor(matInOut, matInOut, COLOR_BGRA2GRAY);
+    // Grayscale (unless it already is) and blur
+    if (matInOut.channels() != 1)
+        cvtColor(matInOut, matInOut, COLOR_BGRA2GRAY);
     GaussianBlur(matInOut, matInOut, cv::Size(3,3), 0);
 
     // Sobel
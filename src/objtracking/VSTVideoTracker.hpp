@@ -14,6 +14,7 @@
 #include <opencv2/imgproc.hpp>
 #include <opencv2/features2d.hpp>
 
+#include "VSTSharedFrame.hpp"
 #include "VSTSuspicionEngine.hpp"
 
 #include <memory>
@@ -89,20 +90,32 @@ public:
     }
 
     /// Call this method with successive frames from the source video you are tracking.
-    /// @param frame a matrix containing a successive frame of video from the source video
+    /// @param frame a matrix containing a successive frame of video from the source video, either BGRA
+    /// or single-channel grayscale (which skips the conversion). Use the same kind for every frame.
     /// @param timeStamp a value in seconds representing the corresponding time stamp of the passed in frame.
     /// @return TrackerResult object which contains position and (redundant) time of object OR an error code.
     TrackerResult
                 TrackObjectInFrame(const cv::Mat& frame, double timeStamp);
 
+    /// Same as above, but for a frame shared by every tracker following an object in the video.
+    /// The grayscale frame and the foreground mask come from `frame`, so they are computed once
+    /// per frame rather than once per tracker, and this tracker's own background model is unused.
+    /// Don't mix calls with the overload above on the same tracker.
+    TrackerResult
+                TrackObjectInFrame(VSTSharedFrame& frame, double timeStamp);
+
     /// Reset the object tracking state with new starting template area. Call this to re-start object
     /// tracking from new position after encountering a tracking error.
     /// @param template user-selected area indicating the starting position of object to track.
     void        Reset(const cv::Rect& templateArea);
 
+    /// The last foreground mask from this tracker's own background model; empty when tracking
+    /// with a `VSTSharedFrame`, which holds the mask itself.
     cv::Mat&    Foreground() { return _foreground; }
 
 private:
+    TrackerResult
+                Track(const cv::Mat& frame, VSTSharedFrame* shared, double timeStamp);
     static void CalculateHistogram(const cv::Mat& matrix, cv::Mat& historgramOut);
     cv::Mat     SubtractBackground(const cv::Mat& foreground, const cv::Rect& searchRect, const cv::Rect& objLoc);
     void        DrawDetectedEdges(cv::Mat& mat, const cv::Mat& mask);
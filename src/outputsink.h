@@ -0,0 +1,21 @@
+#ifndef __VST_OUTPUT_SINK_H__
+#define __VST_OUTPUT_SINK_H__
+
+#include <cstdint>
+
+// Random access destination for muxer output.  The muxer appends most of the
+// time but seeks back to patch headers, so any written offset may be rewritten.
+class OutputSink
+{
+public:
+  virtual ~OutputSink() {}
+
+  // bytes written so far (one past the highest offset written)
+  virtual int64_t Size() const = 0;
+
+  // write size bytes at offset, growing the sink as needed
+  // returns: the number of bytes written, or < 0 on error
+  virtual int WriteAt(int64_t offset, const uint8_t *buf, int size) = 0;
+};
+
+#endif
@@ -0,0 +1,282 @@
+#include "packetindex.h"
+#include "ffmpegutils.h"
+#include "metadatacache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+
+namespace
+{
+  const char kMagic[8] = { 'V', 'S', 'T', 'P', 'I', 'D', 'X', '1' };
+
+  // the metadata cache table the indexes are kept in
+  const char *kTable = "pktidx";
+
+  // integers are stored little endian whatever the host's byte order
+  template <typename T>
+  void Append(std::vector<uint8_t> &out, const T *data, size_t count)
+  {
+    using U = typename std::make_unsigned<T>::type;
+    for (size_t i = 0; i < count; ++i)
+    {
+      U v = (U)data[i];
+      for (size_t b = 0; b < sizeof(T); ++b)
+        out.push_back((uint8_t)(v >> (8 * b)));
+    }
+  }
+
+  // sequential reader over a serialized index
+  struct Reader
+  {
+    const uint8_t *ptr;
+    const uint8_t *end;
+
+    template <typename T>
+    bool Read(T *data, size_t count)
+    {
+      using U = typename std::make_unsigned<T>::type;
+      if ((size_t)(end - ptr) / sizeof(T) < count)
+        return false;
+      for (size_t i = 0; i < count; ++i)
+      {
+        U v = 0;
+        for (size_t b = 0; b < sizeof(T); ++b)
+          v |= (U)((U)*ptr++ << (8 * b));
+        data[i] = (T)v;
+      }
+      return true;
+    }
+  };
+}
+
+
+void PacketIndex::Clear()
+{
+  pts.clear();
+  dts.clear();
+  pos.clear();
+  size.clear();
+  keyframe.clear();
+}
+
+
+void PacketIndex::Add(const AVPacket &packet)
+{
+  pts.push_back(packet.pts);
+  dts.push_back(packet.dts != AV_NOPTS_VALUE ? packet.dts : packet.pts);
+  pos.push_back(packet.pos);
+  size.push_back(packet.size);
+  keyframe.push_back((packet.flags & AV_PKT_FLAG_KEY) ? 1 : 0);
+}
+
+
+std::vector<double> PacketIndex::KeyframeTimes() const
+{
+  std::vector<double> times;
+  const double tb = av_q2d(timeBase);
+  for (size_t i = 0; i < Count(); ++i)
+  {
+    if (keyframe[i])
+      times.push_back(dts[i] * tb);
+  }
+  return times;
+}
+
+
+int64_t PacketIndex::KeyframeAtOrBefore(int64_t ts) const
+{
+  // packets are in decode order, so dts only ever increases
+  auto it = std::upper_bound(dts.begin(), dts.end(), ts);
+  for (int64_t i = (it - dts.begin()) - 1; i >= 0; --i)
+  {
+    if (keyframe[i])
+      return i;
+  }
+  return -1;
+}
+
+
+void PacketIndex::Serialize(const std::string &key, std::vector<uint8_t> &out) const
+{
+  const uint32_t keySize = (uint32_t)key.size();
+  const int32_t header[3] = { streamIndex, timeBase.num, timeBase.den };
+  const uint64_t count = Count();
+
+  out.clear();
+  out.reserve(sizeof(kMagic) + key.size() + 32 + count * (3 * sizeof(int64_t) + sizeof(int32_t) + 1));
+  Append(out, kMagic, sizeof(kMagic));
+  Append(out, &keySize, 1);
+  Append(out, key.data(), key.size());
+  Append(out, header, 3);
+  Append(out, &count, 1);
+  Append(out, pts.data(), count);
+  Append(out, dts.data(), count);
+  Append(out, pos.data(), count);
+  Append(out, size.data(), count);
+  Append(out, keyframe.data(), count);
+}
+
+
+bool PacketIndex::Deserialize(const std::string &key, const uint8_t *buf, size_t bufSize)
+{
+  Reader r { buf, buf + bufSize };
+
+  char magic[sizeof(kMagic)];
+  uint32_t keySize = 0;
+  if (!r.Read(magic, sizeof(magic)) || std::memcmp(magic, kMagic, sizeof(kMagic)) ||
+      !r.Read(&keySize, 1) || keySize != key.size())
+    return false;
+
+  std::string storedKey(keySize, '\0');
+  if (!r.Read(&storedKey[0], keySize) || storedKey != key)
+    return false;
+
+  int32_t header[3];
+  uint64_t count = 0;
+  if (!r.Read(header, 3) || !r.Read(&count, 1))
+    return false;
+
+  // reject a truncated record before allocating for it
+  const size_t entrySize = 3 * sizeof(int64_t) + sizeof(int32_t) + 1;
+  if (count > (size_t)(r.end - r.ptr) / entrySize)
+    return false;
+
+  pts.resize(count);
+  dts.resize(count);
+  pos.resize(count);
+  size.resize(count);
+  keyframe.resize(count);
+  if (!r.Read(pts.data(), count) || !r.Read(dts.data(), count) || !r.Read(pos.data(), count) ||
+      !r.Read(size.data(), count) || !r.Read(keyframe.data(), count)) {
+    Clear();
+    return false;
+  }
+
+  streamIndex = header[0];
+  timeBase    = AVRational { header[1], header[2] };
+  return true;
+}
+
+
+bool BuildPacketIndex(AVFormatContext *ic, PacketIndex &index)
+{
+  AVStream *st = GetFirstStreamForType(ic, AVMEDIA_TYPE_VIDEO);
+  if (!st)
+    return false;
+
+  index.Clear();
+  index.streamIndex = st->index;
+  index.timeBase    = st->time_base;
+
+  if (st->nb_index_entries > 0)
+  {
+    // one entry per sample, no I/O needed.  Samples an edit list cuts off are
+    // flagged AVINDEX_DISCARD_FRAME: they are read only to prime the decoder,
+    // which drops their frames, so they are neither frames nor seek targets
+    for (int i = 0; i < st->nb_index_entries; ++i)
+    {
+      const AVIndexEntry &e = st->index_entries[i];
+      if (e.flags & AVINDEX_DISCARD_FRAME)
+        continue;
+      index.pts.push_back(AV_NOPTS_VALUE);
+      index.dts.push_back(e.timestamp);
+      index.pos.push_back(e.pos);
+      index.size.push_back(e.size);
+      index.keyframe.push_back((e.flags & AVINDEX_KEYFRAME) ? 1 : 0);
+    }
+    return true;
+  }
+
+  // only the video packets are of interest; let the demuxer skip the rest
+  std::vector<AVDiscard> discard;
+  for (unsigned i = 0; i < ic->nb_streams; ++i) {
+    discard.push_back(ic->streams[i]->discard);
+    if (ic->streams[i] != st)
+      ic->streams[i]->discard = AVDISCARD_ALL;
+  }
+
+  AVPacket packet;
+  while (av_read_frame(ic, &packet) >= 0)
+  {
+    if (packet.stream_index == st->index && !(packet.flags & AV_PKT_FLAG_DISCARD))
+      index.Add(packet);
+    av_packet_unref(&packet);
+  }
+
+  for (unsigned i = 0; i < ic->nb_streams; ++i)
+    ic->streams[i]->discard = discard[i];
+
+  if (av_seek_frame(ic, st->index, st->start_time != AV_NOPTS_VALUE ? st->start_time : 0, AVSEEK_FLAG_BACKWARD) < 0)
+    av_log(NULL, AV_LOG_WARNING, "BuildPacketIndex: could not rewind\n");
+
+  return true;
+}
+
+
+void ApplyPacketIndex(AVFormatContext *ic, const PacketIndex &index)
+{
+  if (index.streamIndex < 0 || index.streamIndex >= (int)ic->nb_streams)
+    return;
+
+  AVStream *st = ic->streams[index.streamIndex];
+  if (st->nb_index_entries > 0)
+    return;
+
+  int distance = 0;
+  for (size_t i = 0; i < index.Count(); ++i)
+  {
+    distance = index.keyframe[i] ? 0 : distance + index.size[i];
+    if (index.keyframe[i] && index.pos[i] >= 0)
+      av_add_index_entry(st, index.pos[i], index.dts[i], index.size[i], distance, AVINDEX_KEYFRAME);
+  }
+}
+
+
+int64_t SeekToGOP(AVFormatContext *ic, const PacketIndex &index, double seconds)
+{
+  if (index.Empty() || index.timeBase.num <= 0)
+    return AVERROR(EINVAL);
+
+  int64_t ts = (int64_t)(seconds / av_q2d(index.timeBase));
+  int64_t entry = index.KeyframeAtOrBefore(ts);
+
+  // before the first keyframe: start from the first one
+  for (size_t i = 0; entry < 0 && i < index.Count(); ++i)
+  {
+    if (index.keyframe[i])
+      entry = i;
+  }
+  if (entry < 0)
+    return AVERROR(EINVAL);
+
+  int ret = av_seek_frame(ic, index.streamIndex, index.dts[entry], AVSEEK_FLAG_BACKWARD);
+  return ret < 0 ? ret : entry;
+}
+
+
+void LoadPacketIndexAsync(const std::string &db, const std::string &key, PacketIndexFunc onDone)
+{
+  if (key.empty()) {
+    onDone(nullptr);
+    return;
+  }
+
+  MetaDataCacheLoadRecordAsync(db, kTable, key,
+                               [=](const uint8_t *buf, size_t size) {
+                                 auto index = std::make_shared<PacketIndex>();
+                                 onDone(buf && index->Deserialize(key, buf, size) ? index : nullptr);
+                               });
+}
+
+
+void StorePacketIndexAsync(const std::string &db, const std::string &key, std::shared_ptr<const PacketIndex> index)
+{
+  if (key.empty() || !index || index->Empty())
+    return;
+
+  // a failed store only costs a rebuild later
+  std::vector<uint8_t> bytes;
+  index->Serialize(key, bytes);
+  MetaDataCacheStoreRecord(db, kTable, key, bytes.data(), bytes.size());
+}
@@ -0,0 +1,65 @@
+#ifndef __VST_PACKET_INDEX_H__
+#define __VST_PACKET_INDEX_H__
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Every packet of one video stream, one array per field so that searches
+// only touch the column they need.  Timestamps are in timeBase units.
+struct PacketIndex
+{
+  int streamIndex = -1;
+  AVRational timeBase = { 0, 1 };
+
+  std::vector<int64_t> pts; // AV_NOPTS_VALUE when built from the demuxer's index
+  std::vector<int64_t> dts;
+  std::vector<int64_t> pos; // byte offset in the file, -1 if unknown
+  std::vector<int32_t> size;
+  std::vector<uint8_t> keyframe;
+
+  size_t Count() const { return dts.size(); }
+  bool Empty() const { return dts.empty(); }
+
+  void Clear();
+  void Add(const AVPacket &packet);
+
+  // decode timestamps (seconds) of every keyframe
+  std::vector<double> KeyframeTimes() const;
+
+  // returns: the entry of the last keyframe with dts <= ts, or -1
+  int64_t KeyframeAtOrBefore(int64_t ts) const;
+
+  // key identifies the file the index was built from (see MetaDataCacheKey())
+  void Serialize(const std::string &key, std::vector<uint8_t> &out) const;
+  // returns: false if buf isn't an index for key
+  bool Deserialize(const std::string &key, const uint8_t *buf, size_t size);
+};
+
+// Fills index for the first video stream: from the demuxer's own index when it
+// has one (MP4/MOV build it from the moov atom), otherwise by reading every
+// video packet and rewinding to the start afterwards.
+bool BuildPacketIndex(AVFormatContext *ic, PacketIndex &index);
+
+// Hands index to a demuxer that had none of its own, so av_seek_frame() lands
+// on the right keyframe instead of searching the file.
+void ApplyPacketIndex(AVFormatContext *ic, const PacketIndex &index);
+
+// Positions ic at the keyframe that starts the GOP containing `seconds`.
+// returns: the index entry of that keyframe, or < 0 on error
+int64_t SeekToGOP(AVFormatContext *ic, const PacketIndex &index, double seconds);
+
+
+// Persisted with the file's cached metadata (see metadatacache.h), under the same key.
+using PacketIndexFunc = std::function<void(std::shared_ptr<PacketIndex> index)>; // null if missing or stale
+
+void LoadPacketIndexAsync(const std::string &db, const std::string &key, PacketIndexFunc onDone);
+void StorePacketIndexAsync(const std::string &db, const std::string &key, std::shared_ptr<const PacketIndex> index);
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef __VST_SPSC_QUEUE_H__
+#define __VST_SPSC_QUEUE_H__
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Bounded lock-free queue between exactly one producer thread and one consumer
+// thread.  Push() blocks while the queue is full, which is what keeps a fast
+// stage from running ahead of a slow one (and from buffering the whole video).
+// Pushes and pops that don't have to wait never take the lock; a blocked thread
+// sleeps on a condition variable instead of spinning.
+template <typename T>
+class SPSCQueue
+{
+public:
+  struct Stats
+  {
+    int64_t pushes = 0;
+    int64_t occupancySum = 0;  // queue length seen by each push, for the average
+    int64_t fullWaits = 0;     // pushes that had to wait for room
+    int64_t emptyWaits = 0;    // pops that had to wait for an item
+    double fullSeconds = 0;    // time the producer spent blocked
+    double emptySeconds = 0;   // time the consumer spent blocked
+
+    double AverageOccupancy() const { return pushes ? (double)occupancySum / pushes : 0; }
+  };
+
+  explicit SPSCQueue(size_t capacity) : slots(capacity ? capacity : 1) {}
+
+  SPSCQueue(const SPSCQueue&) = delete;
+  SPSCQueue& operator=(const SPSCQueue&) = delete;
+
+  size_t Capacity() const { return slots.size(); }
+
+  // returns: false if the queue was closed, in which case item was not queued
+  bool Push(const T &item)
+  {
+    const size_t t = tail.load(std::memory_order_relaxed);
+
+    if (t - head.load(std::memory_order_acquire) == slots.size())
+    {
+      ++stats.fullWaits;
+      auto start = std::chrono::steady_clock::now();
+      Wait([&]() { return t - head.load() != slots.size() || closed.load(); });
+      stats.fullSeconds += Seconds(start);
+    }
+
+    if (closed.load(std::memory_order_acquire))
+      return false;
+
+    ++stats.pushes;
+    stats.occupancySum += t - head.load(std::memory_order_relaxed);
+
+    slots[t % slots.size()] = item;
+    tail.store(t + 1);
+    Wake();
+    return true;
+  }
+
+  // returns: false once the queue is closed and everything pushed before that has been popped
+  bool Pop(T &item)
+  {
+    const size_t h = head.load(std::memory_order_relaxed);
+
+    if (tail.load(std::memory_order_acquire) == h)
+    {
+      ++stats.emptyWaits;
+      auto start = std::chrono::steady_clock::now();
+      Wait([&]() { return tail.load() != h || closed.load(); });
+      stats.emptySeconds += Seconds(start);
+
+      // closed, and everything pushed before that already popped
+      if (tail.load(std::memory_order_acquire) == h)
+        return false;
+    }
+
+    item = slots[h % slots.size()];
+    head.store(h + 1);
+    Wake();
+    return true;
+  }
+
+  // Ends the stream: the consumer drains what is queued and the producer's next
+  // Push() fails.  Either side may call it, so it is also how a stage aborts.
+  void Close()
+  {
+    closed.store(true);
+    std::lock_guard<std::mutex> lock(mutex);
+    wakeup.notify_all();
+  }
+
+  // Only call once both threads are done with the queue, so that items left
+  // behind by an aborted pipeline can be released.
+  bool TryPopRemaining(T &item)
+  {
+    const size_t h = head.load(std::memory_order_relaxed);
+    if (tail.load(std::memory_order_acquire) == h)
+      return false;
+    item = slots[h % slots.size()];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  // pushes update the producer's fields and pops the consumer's, so read these
+  // only after both threads are done
+  const Stats& GetStats() const { return stats; }
+
+private:
+  static double Seconds(std::chrono::steady_clock::time_point start)
+  {
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+  }
+
+  // Blocks until ready() holds.  The waiter count is bumped before ready() is
+  // checked and Wake() reads it after the head/tail store (all sequentially
+  // consistent), so either the waiter sees the store or Wake() sees the waiter,
+  // and Wake() can't notify before the waiter has released the lock in wait().
+  template <typename Ready>
+  void Wait(Ready ready)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    waiters.fetch_add(1);
+    wakeup.wait(lock, ready);
+    waiters.fetch_sub(1);
+  }
+
+  void Wake()
+  {
+    if (waiters.load() == 0)
+      return;
+    std::lock_guard<std::mutex> lock(mutex);
+    wakeup.notify_all();
+  }
+
+  std::vector<T> slots;
+  std::atomic<size_t> head { 0 }; // next slot to pop, only written by the consumer
+  std::atomic<size_t> tail { 0 }; // next slot to push, only written by the producer
+  std::atomic<bool> closed { false };
+  std::atomic<int> waiters { 0 };
+  std::mutex mutex;
+  std::condition_variable wakeup;
+  Stats stats;
+};
+
+#endif
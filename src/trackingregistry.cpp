@@ -0,0 +1,56 @@
+#include "trackingregistry.h"
+
+#include <new>
+
+using vst::VSTVideoTracker;
+
+
+TrackingRegistry::~TrackingRegistry()
+{
+  for (auto &c : contexts)
+    c.second->context.tracker->~VSTVideoTracker();
+}
+
+
+int TrackingRegistry::Create(const cv::Rect &templateArea, int subtractionPeriod)
+{
+  if (freeSlots.empty())
+  {
+    slabs.emplace_back(new Slot[kSlabSize]);
+    for (int i = kSlabSize - 1; i >= 0; --i)
+      freeSlots.push_back(&slabs.back()[i]);
+  }
+
+  Slot *slot = freeSlots.back();
+  freeSlots.pop_back();
+
+  slot->context = TrackingContext();
+  slot->context.id = nextId++;
+  slot->context.tracker = new (&slot->storage) VSTVideoTracker(templateArea, subtractionPeriod);
+
+  contexts[slot->context.id] = slot;
+  return slot->context.id;
+}
+
+
+bool TrackingRegistry::Destroy(int id)
+{
+  auto it = contexts.find(id);
+  if (it == contexts.end())
+    return false;
+
+  Slot *slot = it->second;
+  slot->context.tracker->~VSTVideoTracker();
+  slot->context = TrackingContext();
+
+  contexts.erase(it);
+  freeSlots.push_back(slot);
+  return true;
+}
+
+
+TrackingContext* TrackingRegistry::Find(int id)
+{
+  auto it = contexts.find(id);
+  return it == contexts.end() ? nullptr : &it->second->context;
+}
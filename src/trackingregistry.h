@@ -0,0 +1,68 @@
+#ifndef __VST_TRACKING_REGISTRY_H__
+#define __VST_TRACKING_REGISTRY_H__
+
+#include "objtracking/VSTVideoTracker.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+// One tracked object: its tracker and what it has cost so far
+struct TrackingContext
+{
+  struct Stats
+  {
+    int64_t frames = 0;   // frames tracked
+    int64_t failures = 0; // frames the tracker lost the object in
+    double seconds = 0;   // time spent tracking
+
+    double MsPerFrame() const { return frames ? 1000.0 * seconds / frames : 0; }
+  };
+
+  int id = 0;
+  vst::VSTVideoTracker *tracker = nullptr; // lives in the registry's slab
+  Stats stats;
+};
+
+
+// The tracking contexts of the module, by id.  Trackers are built in place in
+// slabs of slots that are recycled through a free list, so creating and
+// destroying contexts doesn't keep allocating (and fragmenting the WASM heap).
+// Ids are never reused: a stale id fails to find anything.
+class TrackingRegistry
+{
+public:
+  TrackingRegistry() {}
+  ~TrackingRegistry();
+
+  TrackingRegistry(const TrackingRegistry&) = delete;
+  TrackingRegistry& operator=(const TrackingRegistry&) = delete;
+
+  // returns: the new context's id
+  int Create(const cv::Rect &templateArea, int subtractionPeriod);
+  // returns: false if there is no such context
+  bool Destroy(int id);
+
+  // returns: null if there is no such context
+  TrackingContext* Find(int id);
+
+  size_t Size() const { return contexts.size(); }
+
+private:
+  static const int kSlabSize = 8; // contexts per slab
+
+  struct Slot
+  {
+    TrackingContext context;
+    std::aligned_storage<sizeof(vst::VSTVideoTracker), alignof(vst::VSTVideoTracker)>::type storage;
+  };
+
+  int nextId = 1;
+  std::vector<std::unique_ptr<Slot[]>> slabs;
+  std::vector<Slot*> freeSlots;
+  std::unordered_map<int, Slot*> contexts;
+};
+
+#endif
@@ -1,7 +1,11 @@
 #include "videoutils.h"
 #include "ffmpegutils.h"
 #include "indexeddb.h"
+#include "chunkedbuffer.h"
+#include "metadatacache.h"
+#include "packetindex.h"
 
+#include <chrono>
 #include <functional>
 
 #include <cstdio>
@@ -71,24 +75,43 @@ namespace
   }
 
 
-  void sendResponse(int id, const VideoMetaData &meta)
+  // Sends meta as the result of request id, or as entry `index` of a
+  // readMetaDataBatch() request when index >= 0
+  void sendMetaData(int id, int index, const std::string &filename, const VideoMetaData &meta)
   {
 #ifdef __EMSCRIPTEN__
       EM_ASM({
-        const codecStr = UTF8ToString($8);
-
-        self.sendResult($0, {
-          avgFrameRate: $1,
-          realFrameRate: $2,
-          numFrames: $3,
-          duration: $4,
-          rotation: $5,
-          vidWidth: $6,
-          vidHeight: $7,
-          vidCodec: codecStr
+        const meta = ({
+          avgFrameRate: $3,
+          realFrameRate: $4,
+          numFrames: $5,
+          duration: $6,
+          rotation: $7,
+          vidWidth: $8,
+          vidHeight: $9,
+          vidCodec: UTF8ToString($10),
+          vidPixelFormat: UTF8ToString($11),
+          vidBitRate: $12,
+          bitRate: $13,
+          audio: $14 ? ({
+            codec: UTF8ToString($15),
+            sampleRate: $16,
+            channels: $17,
+            bitRate: $18
+          }) : null
         });
+
+        if ($19)
+          meta.keyframeTimes = Array.from(HEAPF64.subarray($20 >> 3, ($20 >> 3) + $21));
+
+        if ($1 < 0)
+          self.sendResult($0, meta);
+        else
+          self.sendProgress($0, ({ index: $1, filename: UTF8ToString($2), meta: meta }));
       },
         id,
+        index,
+        filename.c_str(),
         meta.avgFrameRate,
         meta.realFrameRate,
         meta.numFrames,
@@ -96,10 +119,24 @@ namespace
         meta.rotation,
         meta.vidWidth,
         meta.vidHeight,
-        meta.vidCodec.c_str()
+        meta.vidCodec.c_str(),
+        meta.vidPixelFormat.c_str(),
+        (double)meta.vidBitRate,
+        (double)meta.bitRate,
+        meta.hasAudio,
+        meta.audioCodec.c_str(),
+        meta.audioSampleRate,
+        meta.audioChannels,
+        (double)meta.audioBitRate,
+        meta.packetsScanned,
+        meta.keyframeTimes.data(),
+        (int)meta.keyframeTimes.size()
       );
 #else
-    printf("[***] Success (id=%d)\n", id);
+    if (index < 0)
+      printf("[***] Success (id=%d)\n", id);
+    else
+      printf("[***] %d: %s\n", index, filename.c_str());
     printf("\t === Video MetaData ===\n");
     printf("\t   avgFrameRate: %f\n", meta.avgFrameRate);
     printf("\t   realFrameRate: %f\n", meta.realFrameRate);
@@ -108,6 +145,180 @@ namespace
     printf("\t   rotation: %d\n", meta.rotation);
     printf("\t   vidWidth: %d\n", meta.vidWidth);
     printf("\t   vidHeight: %d\n", meta.vidHeight);
+    printf("\t   vidCodec: %s\n", meta.vidCodec.c_str());
+    printf("\t   vidPixelFormat: %s\n", meta.vidPixelFormat.c_str());
+    printf("\t   vidBitRate: %lld\n", (long long)meta.vidBitRate);
+    printf("\t   bitRate: %lld\n", (long long)meta.bitRate);
+    if (meta.hasAudio)
+      printf("\t   audio: %s, %d Hz, %d channels, %lld bits/sec\n", meta.audioCodec.c_str(),
+             meta.audioSampleRate, meta.audioChannels, (long long)meta.audioBitRate);
+    if (meta.packetsScanned)
+      printf("\t   keyframes: %d\n", (int)meta.keyframeTimes.size());
+#endif
+  }
+
+
+  void sendResponse(int id, const VideoMetaData &meta)
+  {
+    sendMetaData(id, -1, std::string(), meta);
+  }
+
+
+  // one entry of a readMetaDataBatch() request; meta is null when error is set
+  void sendBatchProgress(int id, int index, const std::string &filename,
+                         const VideoMetaData *meta, const char *error)
+  {
+    if (meta)
+    {
+      sendMetaData(id, index, filename, *meta);
+      return;
+    }
+
+#ifdef __EMSCRIPTEN__
+    EM_ASM({
+      self.sendProgress($0, {
+        index: $1,
+        filename: UTF8ToString($2),
+        error: UTF8ToString($3)
+      });
+    }, id, index, filename.c_str(), error);
+#else
+    printf("[***] %d: %s: %s\n", index, filename.c_str(), error);
+#endif
+  }
+
+
+  void sendResponse(int id, const TranscodeReport &report)
+  {
+#ifdef __EMSCRIPTEN__
+    EM_ASM({
+      self.sendResult($0, {
+        reencoded: !!$1,
+        rotation: $2,
+        rotationInFile: !!$3,
+        reason: UTF8ToString($4)
+      });
+    }, id, report.reencoded, report.rotation, report.rotationInFile, report.reason.c_str());
+#else
+    printf("[***] Success (id=%d): %s (%s), rotation %d%s\n", id,
+           report.reencoded ? "re-encoded" : "packets copied", report.reason.c_str(),
+           report.rotation, report.rotationInFile ? " (in the file)" : "");
+#endif
+  }
+
+
+  void sendBatchResponse(int id, int count, int failed, double seconds)
+  {
+    double filesPerSecond = seconds > 0 ? count / seconds : 0;
+#ifdef __EMSCRIPTEN__
+    EM_ASM({
+      self.sendResult($0, {
+        count: $1,
+        failed: $2,
+        seconds: $3,
+        filesPerSecond: $4
+      });
+    }, id, count, failed, seconds, filesPerSecond);
+#else
+    printf("[***] Success (id=%d): %d files (%d failed) in %f sec, %f files/sec\n",
+           id, count, failed, seconds, filesPerSecond);
+#endif
+  }
+
+
+  // returns: nullptr on success, otherwise the reason the metadata couldn't be read
+  const char* ProbeMetaData(const std::string &db, const std::string &filename,
+                            std::shared_ptr<InputSource> file, VideoMetaData &meta)
+  {
+    if (!file)
+      return "Failed to load file";
+
+    std::string key = MetaDataCacheKey(filename, *file);
+    if (MetaDataCacheFind(db, key, meta))
+      return nullptr;
+
+    int result = 0;
+    AVFormatContext *ic = CreateInputFormatContext(file, result, ProbeMode::HeaderOnly);
+    if (0 != result || !ic) {
+      if (ic)
+        FreeInputFormatContext(ic);
+      return "Failed to read video file";
+    }
+
+    bool success = GetVideoMetaData(ic, meta);
+    FreeInputFormatContext(ic);
+
+    if (!success)
+      return "Failed to read file metadata";
+
+    MetaDataCacheStore(db, key, meta);
+    return nullptr;
+  }
+
+
+#ifdef __EMSCRIPTEN__
+  std::vector<IDBSlice> SlicesOf(const ChunkedBuffer &bytes)
+  {
+    std::vector<IDBSlice> slices;
+    slices.reserve(bytes.NumChunks());
+    for (size_t i = 0; i < bytes.NumChunks(); ++i)
+      slices.push_back(IDBSlice { bytes.ChunkData(i), bytes.ChunkSize(i) });
+    return slices;
+  }
+#endif
+
+
+  enum class OutputResult
+  {
+    success,
+    opFailed,
+    storeFailed,
+  };
+
+  // Runs op to produce the file dst and stores it.  In the browser the output is
+  // collected in a ChunkedBuffer and stored in one go; natively it is streamed
+  // straight into the destination file as the muxer writes it.
+  void WriteOutput(const std::string &db,
+                   const std::string &dst,
+                   int64_t sizeHint,
+                   std::function<bool(OutputSink &out)> op,
+                   std::function<void(OutputResult result)> onDone)
+  {
+#ifdef __EMSCRIPTEN__
+    auto *bytes = new ChunkedBuffer;
+    bytes->Reserve(sizeHint); // the resulting file should be of similar size
+    if (!op(*bytes)) {
+      delete bytes;
+      onDone(OutputResult::opFailed);
+      return;
+    }
+
+    // write the file straight from the output chunks
+    IDBStoreAsync(db, dst, SlicesOf(*bytes),
+                  // onSuccess
+                  [=]() {
+                    onDone(OutputResult::success);
+                    delete bytes;
+                  },
+                  // onError
+                  [=]() {
+                    onDone(OutputResult::storeFailed);
+                    delete bytes;
+                  });
+#else
+    auto sink = IDBCreateSink(db, dst);
+    if (!sink) {
+      onDone(OutputResult::storeFailed);
+      return;
+    }
+
+    bool success = op(*sink);
+    sink.reset(); // closes the file
+
+    if (!success)
+      remove(dst.c_str());
+
+    onDone(success ? OutputResult::success : OutputResult::opFailed);
 #endif
   }
 } // end namespace
@@ -124,10 +335,10 @@ void InitVideoUtils()
 void dumpMetaData(int reqId, std::string db, std::string filename)
 {
   ///
-  auto onSuccess = [=](const uint8_t *buf, size_t size)
+  auto onSuccess = [=](std::shared_ptr<InputSource> file)
   {
     int result = 0;
-    AVFormatContext *ic = CreateInputFormatContext((const uint8_t*)buf, size, result);
+    AVFormatContext *ic = CreateInputFormatContext(file, result);
 
     if (0 == result && ic)
     {
@@ -148,25 +359,36 @@ void dumpMetaData(int reqId, std::string db, std::string filename)
     sendError(reqId, "Failed to load file");
   };
 
-  IDBLoadAsync(db, filename, onSuccess, onError);
+  IDBOpenAsync(db, filename, onSuccess, onError);
 }
 
 
 
-void readMetaData(int reqId, std::string db, std::string filename)
+void readMetaData(int reqId, std::string db, std::string filename, bool scanPackets)
 {
-  ///
-  auto onSuccess = [=](const uint8_t *buf, size_t size)
+  // index is the persisted packet index when scanning, if there was one
+  auto probe = [=](std::shared_ptr<InputSource> file, std::string key, std::shared_ptr<PacketIndex> index)
   {
+    // the packets get read anyway when scanning, so let the full probe fill in the pixel format too
     int result = 0;
-    AVFormatContext *ic = CreateInputFormatContext((const uint8_t*)buf, size, result);
+    VideoMetaData meta;
+    AVFormatContext *ic = CreateInputFormatContext(file, result, scanPackets ? ProbeMode::Full : ProbeMode::HeaderOnly);
 
     if (0 == result && ic)
     {
-      VideoMetaData meta;
       bool success = GetVideoMetaData(ic, meta);
-      if (success)
+      if (success) {
+        MetaDataCacheStore(db, key, meta);
+        if (scanPackets)
+        {
+          bool built = !index;
+          if (built)
+            index = std::make_shared<PacketIndex>();
+          if (ScanVideoPackets(ic, meta, index.get()) && built)
+            StorePacketIndexAsync(db, key, index);
+        }
         sendResponse(reqId, meta);
+      }
       else
         sendError(reqId, "Failed to read file metadata");
     }
@@ -175,7 +397,24 @@ void readMetaData(int reqId, std::string db, std::string filename)
 
     if (ic)
       FreeInputFormatContext(ic);
+  };
 
+  ///
+  auto onSuccess = [=](std::shared_ptr<InputSource> file)
+  {
+    VideoMetaData meta;
+    std::string key = MetaDataCacheKey(filename, *file);
+
+    if (scanPackets)
+    {
+      LoadPacketIndexAsync(db, key, [=](std::shared_ptr<PacketIndex> index) {
+        probe(file, key, index);
+      });
+    }
+    else if (MetaDataCacheFind(db, key, meta))
+      sendResponse(reqId, meta);
+    else
+      probe(file, key, nullptr);
   };
 
   ///
@@ -184,43 +423,79 @@ void readMetaData(int reqId, std::string db, std::string filename)
     sendError(reqId, "Failed to load file");
   };
 
-  IDBLoadAsync(db, filename, onSuccess, onError);
+  MetaDataCacheLoadAsync(db, [=]() {
+    IDBOpenAsync(db, filename, onSuccess, onError);
+  });
 }
 
 
 
-void transcodeRotation(int reqId, std::string db, std::string src, std::string dst)
+void readMetaDataBatch(int reqId, std::string db, std::vector<std::string> filenames)
+{
+  struct BatchState
+  {
+    std::vector<std::string> filenames;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int failed = 0;
+  };
+
+  auto state = std::make_shared<BatchState>();
+  state->filenames = filenames;
+
+  // the next records are already being fetched while each one is probed
+  auto onFile = [=](size_t index, std::shared_ptr<InputSource> file)
+  {
+    VideoMetaData meta;
+    const char *error = ProbeMetaData(db, state->filenames[index], file, meta);
+    if (error)
+      ++state->failed;
+    sendBatchProgress(reqId, (int)index, state->filenames[index], error ? nullptr : &meta, error);
+  };
+
+  auto onDone = [=]()
+  {
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - state->start;
+    sendBatchResponse(reqId, (int)state->filenames.size(), state->failed, elapsed.count());
+  };
+
+  MetaDataCacheLoadAsync(db, [=]() {
+    IDBOpenBatchAsync(db, filenames, onFile, onDone);
+  });
+}
+
+
+
+void transcodeRotation(int reqId, std::string db, std::string src, std::string dst, TranscodeOptions options)
 {
   ///
-  auto onSuccess = [=](const uint8_t *buf, size_t size)
+  auto onSuccess = [=](std::shared_ptr<InputSource> file)
   {
     int result = 0;
-    AVFormatContext *ic = CreateInputFormatContext((const uint8_t*)buf, size, result);
+    AVFormatContext *ic = CreateInputFormatContext(file, result);
 
     if (0 == result && ic)
     {
-      int errCode = 0;
-      auto *bytes = new std::vector<uint8_t>;
-      bytes->reserve(size); // the resulting file should be of similar size
-      bool success = TranscodeRotation(ic, dst, *bytes, errCode);
-      if (!success) {
-        fprintf(stderr, "Failed to transcode video: errCode=%d\n", errCode);
-        sendError(reqId, "Failed to transcode video");
-        return;
-      }
-
-      // write the file
-      IDBStoreAsync(db, dst, bytes->data(), bytes->size(),
-                    // onSuccess
-                    [=]() {
-                      sendResponse(reqId);
-                      delete bytes;
-                    },
-                    // onError
-                    [=]() {
-                      sendError(reqId, "Failed to write file");
-                      delete bytes;
-                    });
+      // the packet index comes for free while reading the input; keep it for later operations
+      auto index = std::make_shared<PacketIndex>();
+      auto report = std::make_shared<TranscodeReport>();
+      auto op = [=](OutputSink &out) {
+        int errCode = 0;
+        bool success = TranscodeRotation(ic, dst, out, errCode, options, index.get(), report.get());
+        if (!success)
+          fprintf(stderr, "Failed to transcode video: errCode=%d\n", errCode);
+        return success;
+      };
+
+      WriteOutput(db, dst, file->Size(), op, [=](OutputResult outResult) {
+        switch (outResult) {
+          case OutputResult::success:
+            StorePacketIndexAsync(db, MetaDataCacheKey(src, *file), index);
+            sendResponse(reqId, *report);
+            break;
+          case OutputResult::opFailed:    sendError(reqId, "Failed to transcode video"); break;
+          case OutputResult::storeFailed: sendError(reqId, "Failed to write file"); break;
+        }
+      });
     }
     else
       sendError(reqId, "Failed to read video file");
@@ -235,42 +510,40 @@ void transcodeRotation(int reqId, std::string db, std::string src, std::string d
     sendError(reqId, "Failed to load file");
   };
 
-  IDBLoadAsync(db, src, onSuccess, onError);
+  IDBOpenAsync(db, src, onSuccess, onError);
 }
 
 
-void transmuxStripMeta(int reqId, std::string db, std::string src, std::string dst)
+void transmuxStripMeta(int reqId, std::string db, std::string src, std::string dst, TranscodeOptions options)
 {
   ///
-  auto onSuccess = [=](const uint8_t *buf, size_t size)
+  auto onSuccess = [=](std::shared_ptr<InputSource> file)
   {
     int result = 0;
-    AVFormatContext *ic = CreateInputFormatContext((const uint8_t*)buf, size, result);
+    AVFormatContext *ic = CreateInputFormatContext(file, result);
 
     if (0 == result && ic)
     {
-      int errCode = 0;
-      auto *bytes = new std::vector<uint8_t>;
-      bytes->reserve(size); // the resulting file should be of similar size
-      bool success = TransmuxStripMeta(ic, dst, *bytes, errCode);
-      if (!success) {
-        fprintf(stderr, "Failed to transmux video: errCode=%d\n", errCode);
-        sendError(reqId, "Failed to transmux video");
-        return;
-      }
-
-      // write the file
-      IDBStoreAsync(db, dst, bytes->data(), bytes->size(),
-                    // onSuccess
-                    [=]() {
-                      sendResponse(reqId);
-                      delete bytes;
-                    },
-                    // onError
-                    [=]() {
-                      sendError(reqId, "Failed to write file");
-                      delete bytes;
-                    });
+      // the packet index comes for free while reading the input; keep it for later operations
+      auto index = std::make_shared<PacketIndex>();
+      auto op = [=](OutputSink &out) {
+        int errCode = 0;
+        bool success = TransmuxStripMeta(ic, dst, out, errCode, options, index.get());
+        if (!success)
+          fprintf(stderr, "Failed to transmux video: errCode=%d\n", errCode);
+        return success;
+      };
+
+      WriteOutput(db, dst, file->Size(), op, [=](OutputResult outResult) {
+        switch (outResult) {
+          case OutputResult::success:
+            StorePacketIndexAsync(db, MetaDataCacheKey(src, *file), index);
+            sendResponse(reqId);
+            break;
+          case OutputResult::opFailed:    sendError(reqId, "Failed to transmux video"); break;
+          case OutputResult::storeFailed: sendError(reqId, "Failed to write file"); break;
+        }
+      });
     }
     else
       sendError(reqId, "Failed to read video file");
@@ -285,5 +558,5 @@ void transmuxStripMeta(int reqId, std::string db, std::string src, std::string d
     sendError(reqId, "Failed to load file");
   };
 
-  IDBLoadAsync(db, src, onSuccess, onError);
+  IDBOpenAsync(db, src, onSuccess, onError);
 }
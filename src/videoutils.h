@@ -2,6 +2,9 @@
 #define __VST_VIDEO_UTILS_H__
 
 #include <string>
+#include <vector>
+
+#include "ffmpegutils.h"
 
 #ifdef __EMSCRIPTEN__
 #include <emscripten.h>
@@ -13,13 +16,27 @@
 void InitVideoUtils();
 
 WASM_EXPORT void dumpMetaData     (int reqId, std::string db, std::string filename);
-WASM_EXPORT void readMetaData     (int reqId, std::string db, std::string filename);
-WASM_EXPORT void transcodeRotation(int reqId, std::string db, std::string src, std::string dst);
-WASM_EXPORT void transmuxStripMeta(int reqId, std::string db, std::string src, std::string dst);
+WASM_EXPORT void readMetaData     (int reqId, std::string db, std::string filename, bool scanPackets);
+WASM_EXPORT void readMetaDataBatch(int reqId, std::string db, std::vector<std::string> filenames);
+WASM_EXPORT void transcodeRotation(int reqId, std::string db, std::string src, std::string dst, TranscodeOptions options);
+WASM_EXPORT void transmuxStripMeta(int reqId, std::string db, std::string src, std::string dst, TranscodeOptions options);
 
 // objtracking.cpp
 WASM_EXPORT void createTrackingContext(int reqId, double x, double y, double radius);
 WASM_EXPORT void destroyTrackingContext(int reqId, int trackingCtxId);
-WASM_EXPORT void trackObjectNextFrame(int reqId, int trackingCtxId, double timeStamp, int width, int height, uint32_t pbuf);
+// channels: 4 for RGBA frames, 1 for luma (e.g. the Y plane of a YUV frame)
+WASM_EXPORT void trackObjectNextFrame(int reqId, int trackingCtxId, double timeStamp, int width, int height, int channels, uint32_t pbuf);
+// tracks every context's object in one frame
+WASM_EXPORT void trackObjectsNextFrame(int reqId, std::vector<int> trackingCtxIds, double timeStamp, int width, int height, int channels, uint32_t pbuf);
+WASM_EXPORT void getTrackingStats(int reqId, int trackingCtxId);
+// decodes the video in the worker and tracks the object at x,y from startTime
+// to endTime (0: the end), sending the positions back as it goes
+WASM_EXPORT void trackObjectInVideo(int reqId, std::string db, std::string filename, double x, double y, double radius,
+                                    double startTime, double endTime);
+// persistent frame buffers: JS writes a frame into a slot and passes its index
+WASM_EXPORT void allocateFrameSlots(int reqId, int width, int height, int channels, int count);
+WASM_EXPORT void freeFrameSlots(int reqId);
+WASM_EXPORT void trackObjectNextFrameInSlot(int reqId, int trackingCtxId, double timeStamp, int slot);
+WASM_EXPORT void trackObjectsNextFrameInSlot(int reqId, std::vector<int> trackingCtxIds, double timeStamp, int slot);
 
 #endif
@@ -0,0 +1,907 @@
+///////////////////////////////////////////////////////////////////
+// Native benchmark program
+//
+// usage: vstvideoutils_benchmark <benchmark> file [file ...]
+//
+//   io  - demux every packet with each IOReadMode (and streamed from
+//         disk through IDBOpenAsync) and report the bytes copied and
+//         the number of read/seek callbacks
+//   probe - open each file with every ProbeMode (and the header probe
+//           streamed through IDBOpenAsync, as readMetaData does) and
+//           report the time and bytes read to fill in the VideoMetaData
+//   rotate - rotate the first frames of each file by 90/180/270 with the
+//            filters the transcode falls back to and with FrameRotator,
+//            and report ms/frame and whether they match
+//   transcode - run TranscodeRotation on each file sequentially, pipelined,
+//               in segments (all re-encoding), with the default smart
+//               copy, and with each packet-copy RotationMode, and
+//               report fps and whether the output reopens with every frame
+//               at the expected dimensions and rotation
+//   presets - transcode each file with every EncodeOptions preset and
+//             report fps against output size
+//   downscale - transcode each file at full size and scaled down to 1920
+//               pixels on the longest side, and report the speedup
+//   track - decode each file's luma planes with DecodeVideoLuma, then
+//           decode again tracking an object at the center of the picture,
+//           and report fps for both; also checks a decode from halfway, and
+//           compares the cost of several trackers on their own and sharing
+//           a VSTSharedFrame
+///////////////////////////////////////////////////////////////////
+
+#include "chunkedbuffer.h"
+#include "ffmpegutils.h"
+#include "framerotator.h"
+#include "indexeddb.h"
+#include "mappedfile.h"
+#include "objtracking/VSTSharedFrame.hpp"
+#include "objtracking/VSTVideoTracker.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+extern "C" {
+  #include <libavformat/avformat.h>
+  #include <libavfilter/avfilter.h>
+  #include <libavfilter/buffersink.h>
+  #include <libavfilter/buffersrc.h>
+  #include <libavutil/pixdesc.h>
+}
+
+
+namespace
+{
+  std::string baseName(const std::string &path)
+  {
+    auto pos = path.find_last_of("/\\");
+    return pos == std::string::npos ? path : path.substr(pos + 1);
+  }
+
+
+  double secondsSince(std::chrono::steady_clock::time_point start)
+  {
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+  }
+
+
+  //////////////////////////////
+  // io benchmark
+  void printIOResult(const std::string &filename, const char *mode, int64_t size,
+                     AVFormatContext *ic, double secs, int64_t numPackets)
+  {
+    IOReadStats stats = GetIOReadStats(ic->pb);
+    int64_t totalCopied = stats.bytesCopied + stats.bytesBuffered;
+    printf("%-32s %-9s %10.1f %10.1f %8.2f %9lld %9lld %9lld %8.3f\n",
+           baseName(filename).c_str(), mode,
+           size / 1024.0,
+           totalCopied / 1024.0,
+           (double)totalCopied / FFMAX(1, size),
+           (long long)stats.readCalls,
+           (long long)stats.seekCalls,
+           (long long)numPackets,
+           secs);
+  }
+
+
+  int64_t readAllPackets(AVFormatContext *ic)
+  {
+    int64_t numPackets = 0;
+    AVPacket packet;
+    while (av_read_frame(ic, &packet) >= 0) {
+      ++numPackets;
+      av_packet_unref(&packet);
+    }
+    return numPackets;
+  }
+
+
+  bool benchmarkIO(const std::string &filename)
+  {
+    auto file = MappedFile::Open(filename);
+    if (!file) {
+      fprintf(stderr, "Failed to load: %s\n", filename.c_str());
+      return false;
+    }
+
+    const struct { IOReadMode mode; const char *name; } modes[] = {
+      { IOReadMode::Buffered, "buffered" },
+      { IOReadMode::Direct,   "direct"   },
+    };
+
+    for (const auto &m : modes)
+    {
+      auto start = std::chrono::steady_clock::now();
+
+      int errCode = 0;
+      AVFormatContext *ic = CreateInputFormatContext(file->Data(), file->Size(), errCode, m.mode);
+      if (!ic) {
+        fprintf(stderr, "Failed to open: %s (%d)\n", filename.c_str(), errCode);
+        return false;
+      }
+
+      int64_t numPackets = readAllPackets(ic);
+      printIOResult(filename, m.name, file->Size(), ic, secondsSince(start), numPackets);
+      FreeInputFormatContext(ic);
+    }
+
+    // on demand reads through the read-ahead buffer
+    bool success = false;
+    auto start = std::chrono::steady_clock::now();
+    IDBOpenAsync("", filename,
+                 [&](std::shared_ptr<InputSource> file) {
+                   int errCode = 0;
+                   AVFormatContext *ic = CreateInputFormatContext(file, errCode);
+                   if (ic) {
+                     int64_t numPackets = readAllPackets(ic);
+                     printIOResult(filename, "streamed", file->Size(), ic, secondsSince(start), numPackets);
+                     FreeInputFormatContext(ic);
+                     success = true;
+                   }
+                 },
+                 [&]() {});
+
+    return success;
+  }
+
+
+  //////////////////////////////
+  // probe benchmark
+  // the header probe can't tell full range (yuvj420p) from yuv420p
+  std::string rangeless(std::string pixfmt)
+  {
+    if (pixfmt.compare(0, 4, "yuvj") == 0)
+      pixfmt.erase(3, 1);
+    return pixfmt;
+  }
+
+  // true when a header probe got what the full probe gets
+  bool sameProbeResult(const VideoMetaData &a, const VideoMetaData &b)
+  {
+    return a.vidWidth == b.vidWidth && a.vidHeight == b.vidHeight &&
+           fabs(a.avgFrameRate - b.avgFrameRate) < 0.01 &&
+           fabs(a.realFrameRate - b.realFrameRate) < 0.01 &&
+           rangeless(a.vidPixelFormat) == rangeless(b.vidPixelFormat);
+  }
+
+
+  bool printProbeResult(const std::string &filename, const char *mode, int64_t size,
+                        AVFormatContext *ic, int errCode, double secs,
+                        VideoMetaData &meta, const VideoMetaData *full)
+  {
+    if (!ic || !GetVideoMetaData(ic, meta)) {
+      fprintf(stderr, "Failed to read metadata: %s (%d)\n", filename.c_str(), errCode);
+      return false;
+    }
+
+    // bytes pulled from the file: source fetches when streamed, copies out of memory otherwise
+    IOReadStats stats = GetIOReadStats(ic->pb);
+    int64_t bytesRead = stats.sourceReads ? stats.sourceBytes : stats.bytesCopied;
+
+    bool match = !full || sameProbeResult(meta, *full);
+    printf("%-32s %-8s %10.1f %10.1f %5dx%-5d %8.3f %8.3f %-12s %7d %9.3f %9.2f %6s\n",
+           baseName(filename).c_str(), mode,
+           size / 1024.0,
+           bytesRead / 1024.0,
+           meta.vidWidth, meta.vidHeight,
+           meta.avgFrameRate,
+           meta.realFrameRate,
+           meta.vidPixelFormat.c_str(),
+           meta.numFrames,
+           meta.duration,
+           secs * 1000.0,
+           match ? "yes" : "NO");
+    return match;
+  }
+
+
+  bool benchmarkProbe(const std::string &filename)
+  {
+    auto file = MappedFile::Open(filename);
+    if (!file) {
+      fprintf(stderr, "Failed to load: %s\n", filename.c_str());
+      return false;
+    }
+
+    const struct { ProbeMode mode; const char *name; } modes[] = {
+      { ProbeMode::Full,       "full"   },
+      { ProbeMode::HeaderOnly, "header" },
+    };
+
+    // the header probes are checked against the full one, which comes first
+    bool success = true;
+    VideoMetaData full;
+    for (const auto &m : modes)
+    {
+      auto start = std::chrono::steady_clock::now();
+
+      int errCode = 0;
+      VideoMetaData meta;
+      AVFormatContext *ic = CreateInputFormatContext(file->Data(), file->Size(), errCode,
+                                                     IOReadMode::Direct, m.mode);
+      success = printProbeResult(filename, m.name, file->Size(), ic, errCode, secondsSince(start),
+                                 m.mode == ProbeMode::Full ? full : meta,
+                                 m.mode == ProbeMode::Full ? nullptr : &full) && success;
+      if (ic)
+        FreeInputFormatContext(ic);
+    }
+
+    // the readMetaData() path: range reads through IDBOpenAsync
+    bool opened = false;
+    auto start = std::chrono::steady_clock::now();
+    IDBOpenAsync("", filename,
+                 [&](std::shared_ptr<InputSource> file) {
+                   int errCode = 0;
+                   AVFormatContext *ic = CreateInputFormatContext(file, errCode, ProbeMode::HeaderOnly);
+                   VideoMetaData meta;
+                   opened = printProbeResult(filename, "streamed", file->Size(), ic, errCode, secondsSince(start),
+                                             meta, &full);
+                   if (ic)
+                     FreeInputFormatContext(ic);
+                 },
+                 [&]() {});
+
+    return success && opened;
+  }
+
+
+  //////////////////////////////
+  // rotate benchmark
+  const int kRotateFrames = 60;
+
+  // what TranscodeContext::setRotation() builds for formats the rotation kernel doesn't take
+  const char* rotationFilter(int rotation)
+  {
+    switch (rotation) {
+      case 90:  return "transpose=clock";
+      case 180: return "hflip,vflip";
+      default:  return "transpose=cclock";
+    }
+  }
+
+
+  bool decodeFrames(AVFormatContext *ic, int maxFrames, std::vector<AVFrame*> &frames)
+  {
+    AVCodec *dec = nullptr;
+    int stream = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO, -1, -1, &dec, 0);
+    if (stream < 0)
+      return false;
+
+    AVCodecContext *dc = avcodec_alloc_context3(dec);
+    if (!dc)
+      return false;
+    avcodec_parameters_to_context(dc, ic->streams[stream]->codecpar);
+    if (avcodec_open2(dc, dec, NULL) < 0) {
+      avcodec_free_context(&dc);
+      return false;
+    }
+
+    AVPacket packet;
+    AVFrame *frame = av_frame_alloc();
+    while (frame && (int)frames.size() < maxFrames && av_read_frame(ic, &packet) >= 0)
+    {
+      if (packet.stream_index == stream && avcodec_send_packet(dc, &packet) >= 0)
+      {
+        while (frame && (int)frames.size() < maxFrames && avcodec_receive_frame(dc, frame) >= 0) {
+          frames.push_back(frame);
+          frame = av_frame_alloc();
+        }
+      }
+      av_packet_unref(&packet);
+    }
+
+    av_frame_free(&frame);
+    avcodec_free_context(&dc);
+    return !frames.empty();
+  }
+
+
+  void freeFrames(std::vector<AVFrame*> &frames)
+  {
+    for (AVFrame *&frame : frames)
+      av_frame_free(&frame);
+    frames.clear();
+  }
+
+
+  // returns: seconds to rotate every frame into out, or < 0 on error
+  double rotateWithFilters(const std::vector<AVFrame*> &frames, int rotation, std::vector<AVFrame*> &out)
+  {
+    const AVFrame *first = frames[0];
+    char args[256];
+    snprintf(args, sizeof(args), "video_size=%dx%d:pix_fmt=%d:time_base=1/30:pixel_aspect=1/1",
+             first->width, first->height, first->format);
+
+    AVFilterGraph *graph = avfilter_graph_alloc();
+    AVFilterInOut *outputs = avfilter_inout_alloc();
+    AVFilterInOut *inputs = avfilter_inout_alloc();
+    AVFilterContext *src = nullptr;
+    AVFilterContext *sink = nullptr;
+
+    double secs = -1;
+    if (graph && outputs && inputs &&
+        avfilter_graph_create_filter(&src, avfilter_get_by_name("buffer"), "in", args, NULL, graph) >= 0 &&
+        avfilter_graph_create_filter(&sink, avfilter_get_by_name("buffersink"), "out", NULL, NULL, graph) >= 0)
+    {
+      outputs->name = av_strdup("in");
+      outputs->filter_ctx = src;
+      inputs->name = av_strdup("out");
+      inputs->filter_ctx = sink;
+
+      if (avfilter_graph_parse_ptr(graph, rotationFilter(rotation), &inputs, &outputs, NULL) >= 0 &&
+          avfilter_graph_config(graph, NULL) >= 0)
+      {
+        auto start = std::chrono::steady_clock::now();
+        for (AVFrame *frame : frames)
+        {
+          if (av_buffersrc_add_frame_flags(src, frame, AV_BUFFERSRC_FLAG_KEEP_REF) < 0)
+            break;
+
+          AVFrame *rotated = av_frame_alloc();
+          while (rotated && av_buffersink_get_frame(sink, rotated) >= 0) {
+            out.push_back(rotated);
+            rotated = av_frame_alloc();
+          }
+          av_frame_free(&rotated);
+        }
+        secs = secondsSince(start);
+      }
+    }
+
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+    avfilter_graph_free(&graph);
+    return secs;
+  }
+
+
+  double rotateWithKernel(const std::vector<AVFrame*> &frames, int rotation, std::vector<AVFrame*> &out)
+  {
+    FrameRotator rotator(rotation);
+
+    auto start = std::chrono::steady_clock::now();
+    for (AVFrame *frame : frames)
+    {
+      AVFrame *rotated = av_frame_alloc();
+      if (!rotated || rotator.Rotate(frame, rotated) < 0) {
+        av_frame_free(&rotated);
+        return -1;
+      }
+      out.push_back(rotated);
+    }
+    return secondsSince(start);
+  }
+
+
+  bool samePicture(const AVFrame *a, const AVFrame *b)
+  {
+    if (a->format != b->format || a->width != b->width || a->height != b->height)
+      return false;
+
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat)a->format);
+    for (int i = 0; i < av_pix_fmt_count_planes((AVPixelFormat)a->format); ++i)
+    {
+      const bool chroma = i == 1 || i == 2;
+      const int w = chroma ? AV_CEIL_RSHIFT(a->width, desc->log2_chroma_w) : a->width;
+      const int h = chroma ? AV_CEIL_RSHIFT(a->height, desc->log2_chroma_h) : a->height;
+      for (int y = 0; y < h; ++y)
+      {
+        if (memcmp(a->data[i] + y * a->linesize[i], b->data[i] + y * b->linesize[i], w))
+          return false;
+      }
+    }
+    return true;
+  }
+
+
+  bool benchmarkRotate(const std::string &filename)
+  {
+    auto file = MappedFile::Open(filename);
+    if (!file) {
+      fprintf(stderr, "Failed to load: %s\n", filename.c_str());
+      return false;
+    }
+
+    int errCode = 0;
+    AVFormatContext *ic = CreateInputFormatContext(file->Data(), file->Size(), errCode);
+    std::vector<AVFrame*> frames;
+    bool decoded = ic && decodeFrames(ic, kRotateFrames, frames);
+    if (ic)
+      FreeInputFormatContext(ic);
+    if (!decoded) {
+      fprintf(stderr, "Failed to decode: %s (%d)\n", filename.c_str(), errCode);
+      return false;
+    }
+
+    bool success = true;
+    for (int rotation : { 90, 180, 270 })
+    {
+      if (!FrameRotator::Supports((AVPixelFormat)frames[0]->format, rotation)) {
+        printf("%-32s %8d  unsupported pixel format\n", baseName(filename).c_str(), rotation);
+        continue;
+      }
+
+      std::vector<AVFrame*> filtered, rotated;
+      double filterSecs = rotateWithFilters(frames, rotation, filtered);
+      double kernelSecs = rotateWithKernel(frames, rotation, rotated);
+
+      bool match = filterSecs >= 0 && kernelSecs >= 0 && filtered.size() == rotated.size();
+      for (size_t i = 0; match && i < rotated.size(); ++i)
+        match = samePicture(filtered[i], rotated[i]);
+
+      const double n = (double)frames.size();
+      printf("%-32s %8d %5dx%-5d %7zu %10.3f %10.3f %8.2f %6s\n",
+             baseName(filename).c_str(), rotation,
+             frames[0]->width, frames[0]->height, frames.size(),
+             filterSecs * 1000.0 / n,
+             kernelSecs * 1000.0 / n,
+             kernelSecs > 0 ? filterSecs / kernelSecs : 0.0,
+             match ? "yes" : "NO");
+
+      success = success && match;
+      freeFrames(filtered);
+      freeFrames(rotated);
+    }
+
+    freeFrames(frames);
+    return success;
+  }
+
+
+  //////////////////////////////
+  // transcode benchmarks
+
+  // the analysis UI never shows more than 1080p
+  const int kDownscaleDimension = 1920;
+
+  // decodes the whole video stream, draining the decoder at the end
+  // returns: the number of frames, or < 0 on error
+  int64_t countFrames(AVFormatContext *ic, int &outWidth, int &outHeight)
+  {
+    AVCodec *dec = nullptr;
+    int stream = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO, -1, -1, &dec, 0);
+    if (stream < 0)
+      return -1;
+
+    AVCodecContext *dc = avcodec_alloc_context3(dec);
+    AVFrame *frame = av_frame_alloc();
+    if (!dc || !frame || avcodec_parameters_to_context(dc, ic->streams[stream]->codecpar) < 0 ||
+        avcodec_open2(dc, dec, NULL) < 0) {
+      av_frame_free(&frame);
+      avcodec_free_context(&dc);
+      return -1;
+    }
+
+    int64_t numFrames = 0;
+    AVPacket packet;
+    bool eof = false;
+    while (!eof)
+    {
+      eof = av_read_frame(ic, &packet) < 0;
+      if (eof || packet.stream_index == stream)
+      {
+        if (avcodec_send_packet(dc, eof ? NULL : &packet) >= 0) {
+          while (avcodec_receive_frame(dc, frame) >= 0) {
+            outWidth = frame->width;
+            outHeight = frame->height;
+            ++numFrames;
+            av_frame_unref(frame);
+          }
+        }
+      }
+      if (!eof)
+        av_packet_unref(&packet);
+    }
+
+    av_frame_free(&frame);
+    avcodec_free_context(&dc);
+    return numFrames;
+  }
+
+
+  // decodes the input once, outside the timed transcodes
+  // returns: the number of frames, with their size after meta.rotation
+  int64_t decodeInput(const MappedFile &file, int &width, int &height, VideoMetaData &meta)
+  {
+    int errCode = 0;
+    AVFormatContext *ic = CreateInputFormatContext(file.Data(), file.Size(), errCode);
+    if (!ic)
+      return -1;
+
+    int64_t numFrames = countFrames(ic, width, height);
+    (void)GetVideoMetaData(ic, meta);
+    FreeInputFormatContext(ic);
+
+    if (meta.rotation == 90 || meta.rotation == 270)
+      std::swap(width, height);
+    return numFrames;
+  }
+
+
+  struct TranscodeResult
+  {
+    double seconds = 0;
+    int64_t bytes = 0;
+    int64_t frames = -1; // decoded back from the output
+    int width = 0;
+    int height = 0;
+    int rotation = 0; // what the output's metadata says
+  };
+
+
+  // times TranscodeRotation on file, then reopens the output and decodes it
+  // returns: false if either step failed
+  bool transcodeAndReopen(const MappedFile &file, const TranscodeOptions &options, TranscodeResult &result)
+  {
+    int errCode = 0;
+    ChunkedBuffer out;
+    auto start = std::chrono::steady_clock::now();
+    AVFormatContext *ic = CreateInputFormatContext(file.Data(), file.Size(), errCode);
+    bool transcoded = ic && TranscodeRotation(ic, "out.mp4", out, errCode, options);
+    result.seconds = secondsSince(start);
+    if (ic)
+      FreeInputFormatContext(ic);
+
+    // the output reopened from one contiguous copy
+    std::vector<uint8_t> bytes;
+    bytes.reserve(out.Size());
+    for (size_t i = 0; i < out.NumChunks(); ++i)
+      bytes.insert(bytes.end(), out.ChunkData(i), out.ChunkData(i) + out.ChunkSize(i));
+    out.Clear();
+    result.bytes = bytes.size();
+
+    AVFormatContext *oc = transcoded ? CreateInputFormatContext(bytes.data(), bytes.size(), errCode) : nullptr;
+    if (!oc)
+      return false;
+    result.frames = countFrames(oc, result.width, result.height);
+    VideoMetaData meta;
+    if (GetVideoMetaData(oc, meta))
+      result.rotation = meta.rotation;
+    FreeInputFormatContext(oc);
+    return result.frames > 0;
+  }
+
+
+  bool benchmarkTranscode(const std::string &filename)
+  {
+    auto file = MappedFile::Open(filename);
+    if (!file) {
+      fprintf(stderr, "Failed to load: %s\n", filename.c_str());
+      return false;
+    }
+
+    int width = 0, height = 0;
+    VideoMetaData meta;
+    int64_t inFrames = decodeInput(*file, width, height, meta);
+    if (inFrames <= 0) {
+      fprintf(stderr, "Failed to decode: %s\n", filename.c_str());
+      return false;
+    }
+
+    struct Mode { const char *name; TranscodeOptions options; };
+    std::vector<Mode> modes(6);
+    modes[0].name = "sequential";
+    modes[0].options.pipelined = false;
+    modes[0].options.alwaysReencode = true;
+    modes[1].name = "pipelined";
+    modes[1].options.alwaysReencode = true;
+    modes[2].name = "segmented";
+    modes[2].options.segments = 4;
+    modes[2].options.alwaysReencode = true;
+    modes[3].name = "smart"; // copies what doesn't need re-encoding
+    modes[4].name = "matrix";
+    modes[4].options.rotationMode = RotationMode::Matrix;
+    modes[5].name = "strip";
+    modes[5].options.rotationMode = RotationMode::Strip;
+
+    bool success = true;
+    for (const Mode &m : modes)
+    {
+      TranscodeResult r;
+      (void)transcodeAndReopen(*file, m.options, r);
+
+      // copied packets keep their orientation; only the matrix remembers the rotation
+      const bool baked = m.options.rotationMode == RotationMode::Bake;
+      const bool transposed = !baked && (meta.rotation == 90 || meta.rotation == 270);
+      const int expectWidth = transposed ? height : width;
+      const int expectHeight = transposed ? width : height;
+      const int expectRotation = m.options.rotationMode == RotationMode::Matrix ? meta.rotation : 0;
+
+      bool valid = r.frames == inFrames &&
+                   r.width == expectWidth && r.height == expectHeight &&
+                   r.rotation == expectRotation;
+
+      printf("%-32s %-10s %8d %5dx%-5d %7lld %7lld %10.1f %8.2f %8.1f %6s\n",
+             baseName(filename).c_str(), m.name, meta.rotation,
+             expectWidth, expectHeight,
+             (long long)inFrames, (long long)r.frames,
+             r.bytes / 1024.0,
+             r.seconds,
+             r.seconds > 0 ? inFrames / r.seconds : 0.0,
+             valid ? "yes" : "NO");
+
+      success = success && valid;
+    }
+
+    return success;
+  }
+
+
+  bool benchmarkPresets(const std::string &filename)
+  {
+    auto file = MappedFile::Open(filename);
+    if (!file) {
+      fprintf(stderr, "Failed to load: %s\n", filename.c_str());
+      return false;
+    }
+
+    int width = 0, height = 0;
+    VideoMetaData meta;
+    int64_t inFrames = decodeInput(*file, width, height, meta);
+    if (inFrames <= 0) {
+      fprintf(stderr, "Failed to decode: %s\n", filename.c_str());
+      return false;
+    }
+
+    bool success = true;
+    for (const char *preset : { "fast", "balanced", "archival" })
+    {
+      TranscodeOptions options;
+      options.alwaysReencode = true; // balanced would copy unrotated H.264
+      EncodeOptions::FromPreset(preset, options.encode);
+
+      TranscodeResult r;
+      bool valid = transcodeAndReopen(*file, options, r);
+
+      printf("%-32s %-9s %5dx%-5d %8.2f %8.1f %10.1f %8.0f %6s\n",
+             baseName(filename).c_str(), preset,
+             r.width, r.height,
+             r.seconds,
+             r.seconds > 0 ? inFrames / r.seconds : 0.0,
+             r.bytes / 1024.0,
+             meta.duration > 0 ? r.bytes * 8 / meta.duration / 1000.0 : 0.0,
+             valid ? "yes" : "NO");
+
+      success = success && valid;
+    }
+
+    return success;
+  }
+
+
+  bool benchmarkDownscale(const std::string &filename)
+  {
+    auto file = MappedFile::Open(filename);
+    if (!file) {
+      fprintf(stderr, "Failed to load: %s\n", filename.c_str());
+      return false;
+    }
+
+    int width = 0, height = 0;
+    VideoMetaData meta;
+    int64_t inFrames = decodeInput(*file, width, height, meta);
+    if (inFrames <= 0) {
+      fprintf(stderr, "Failed to decode: %s\n", filename.c_str());
+      return false;
+    }
+
+    TranscodeOptions full;
+    full.alwaysReencode = true;
+    TranscodeOptions scaled;
+    scaled.encode.maxDimension = kDownscaleDimension;
+
+    int scaledWidth = width, scaledHeight = height;
+    ScaleToFit(scaledWidth, scaledHeight, kDownscaleDimension);
+
+    TranscodeResult a, b;
+    bool valid = transcodeAndReopen(*file, full, a) && transcodeAndReopen(*file, scaled, b) &&
+                 b.frames == inFrames && b.width == scaledWidth && b.height == scaledHeight;
+
+    printf("%-32s %8d %5dx%-5d %5dx%-5d %8.1f %8.1f %8.2f %10.1f %10.1f %6s\n",
+           baseName(filename).c_str(), meta.rotation,
+           width, height, b.width, b.height,
+           a.seconds > 0 ? inFrames / a.seconds : 0.0,
+           b.seconds > 0 ? inFrames / b.seconds : 0.0,
+           b.seconds > 0 ? a.seconds / b.seconds : 0.0,
+           a.bytes / 1024.0, b.bytes / 1024.0,
+           valid ? "yes" : "NO");
+
+    return valid;
+  }
+
+
+  //////////////////////////////
+  // track benchmark
+  const int kSharedTrackers = 4;
+
+  struct TrackResult
+  {
+    double seconds = 0;
+    int64_t frames = 0;
+    int64_t failures = 0;
+    int width = 0;
+    int height = 0;
+    double firstTime = -1;
+  };
+
+
+  // Decodes file's luma planes from startTime, tracking `trackers` objects
+  // spread across the middle of the picture (one: the center).  shared: the
+  // trackers take each frame through one VSTSharedFrame, as trackObjectsNextFrame does.
+  bool decodeLuma(const MappedFile &file, double startTime, int trackers, bool shared, TrackResult &result)
+  {
+    int errCode = 0;
+    AVFormatContext *ic = CreateInputFormatContext(file.Data(), file.Size(), errCode);
+    if (!ic)
+      return false;
+
+    std::vector<std::unique_ptr<vst::VSTVideoTracker>> tracking;
+    vst::VSTSharedFrame sharedFrame;
+    auto onFrame = [&](const LumaFrame &luma) {
+      if (result.frames++ == 0) {
+        result.width = luma.width;
+        result.height = luma.height;
+        result.firstTime = luma.time;
+      }
+
+      if (tracking.empty()) {
+        int radius = FFMIN(luma.width, luma.height) / 20;
+        for (int i = 0; i < trackers; ++i) {
+          int x = luma.width * (i + 1) / (trackers + 1);
+          tracking.emplace_back(new vst::VSTVideoTracker(cv::Rect(x - radius, luma.height / 2 - radius,
+                                                                  2 * radius, 2 * radius), 1));
+        }
+      }
+
+      cv::Mat frame(luma.height, luma.width, CV_8UC1, (void*)luma.data, luma.stride);
+      if (shared)
+        sharedFrame.SetFrame(frame);
+      for (auto &tracker : tracking)
+      {
+        auto status = shared ? tracker->TrackObjectInFrame(sharedFrame, luma.time).Status()
+                             : tracker->TrackObjectInFrame(frame, luma.time).Status();
+        if (status != vst::TrackerResult::success)
+          ++result.failures;
+      }
+      sharedFrame.Clear();
+      return true;
+    };
+
+    DecodeOptions options;
+    options.startTime = startTime;
+
+    auto start = std::chrono::steady_clock::now();
+    bool success = DecodeVideoLuma(ic, options, onFrame, errCode);
+    result.seconds = secondsSince(start);
+    FreeInputFormatContext(ic);
+    return success;
+  }
+
+
+  bool benchmarkTrack(const std::string &filename)
+  {
+    auto file = MappedFile::Open(filename);
+    if (!file) {
+      fprintf(stderr, "Failed to load: %s\n", filename.c_str());
+      return false;
+    }
+
+    int width = 0, height = 0;
+    VideoMetaData meta;
+    int64_t inFrames = decodeInput(*file, width, height, meta);
+    if (inFrames <= 0) {
+      fprintf(stderr, "Failed to decode: %s\n", filename.c_str());
+      return false;
+    }
+
+    // the frames come out turned the way the video is shown, from the time asked for
+    const double halfway = meta.duration / 2;
+    TrackResult decoded, tracked, seeked, separate, together;
+    bool valid = decodeLuma(*file, 0, 0, false, decoded) && decodeLuma(*file, 0, 1, false, tracked) &&
+                 decodeLuma(*file, halfway, 0, false, seeked) &&
+                 decodeLuma(*file, 0, kSharedTrackers, false, separate) &&
+                 decodeLuma(*file, 0, kSharedTrackers, true, together) &&
+                 decoded.frames == inFrames && tracked.frames == inFrames &&
+                 separate.frames == inFrames && together.frames == inFrames &&
+                 decoded.width == width && decoded.height == height &&
+                 seeked.frames > 0 && seeked.frames < inFrames && seeked.firstTime >= halfway;
+
+    // tracking ms/frame, over what the decode alone takes
+    const auto trackMs = [&](const TrackResult &r) {
+      return r.frames ? 1000.0 * FFMAX(0.0, r.seconds - decoded.seconds) / r.frames : 0.0;
+    };
+
+    printf("%-32s %8d %5dx%-5d %7lld %10.1f %10.1f %8lld %7lld %8.2f %9.2f %9.2f %6s\n",
+           baseName(filename).c_str(), meta.rotation,
+           decoded.width, decoded.height,
+           (long long)decoded.frames,
+           decoded.seconds > 0 ? decoded.frames / decoded.seconds : 0.0,
+           tracked.seconds > 0 ? tracked.frames / tracked.seconds : 0.0,
+           (long long)tracked.failures,
+           (long long)seeked.frames,
+           trackMs(tracked),
+           trackMs(separate),
+           trackMs(together),
+           valid ? "yes" : "NO");
+
+    return valid;
+  }
+}
+
+
+int main(int argc, char **argv)
+{
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s io|probe|rotate|transcode|presets|downscale|track file [file ...]\n", argv[0]);
+    return 1;
+  }
+
+  InitFFmpegUtils();
+  av_log_set_level(AV_LOG_ERROR);
+
+  std::string which = argv[1];
+  int failures = 0;
+
+  if (which == "io")
+  {
+    printf("%-32s %-9s %10s %10s %8s %9s %9s %9s %8s\n",
+           "file", "mode", "size(KB)", "copied(KB)", "copies", "reads", "seeks", "packets", "sec");
+    for (int i = 2; i < argc; ++i)
+      failures += benchmarkIO(argv[i]) ? 0 : 1;
+  }
+  else if (which == "probe")
+  {
+    printf("%-32s %-8s %10s %10s %11s %8s %8s %-12s %7s %9s %9s %6s\n",
+           "file", "mode", "size(KB)", "read(KB)", "dimensions", "fps", "real fps", "pixfmt", "frames", "duration", "ms", "match");
+    for (int i = 2; i < argc; ++i)
+      failures += benchmarkProbe(argv[i]) ? 0 : 1;
+  }
+  else if (which == "rotate")
+  {
+    printf("%-32s %8s %11s %7s %10s %10s %8s %6s\n",
+           "file", "rotation", "dimensions", "frames", "filter ms", "kernel ms", "speedup", "match");
+    for (int i = 2; i < argc; ++i)
+      failures += benchmarkRotate(argv[i]) ? 0 : 1;
+  }
+  else if (which == "transcode")
+  {
+    printf("%-32s %-10s %8s %11s %7s %7s %10s %8s %8s %6s\n",
+           "file", "mode", "rotation", "output", "frames", "out", "size(KB)", "sec", "fps", "valid");
+    for (int i = 2; i < argc; ++i)
+      failures += benchmarkTranscode(argv[i]) ? 0 : 1;
+  }
+  else if (which == "presets")
+  {
+    printf("%-32s %-9s %11s %8s %8s %10s %8s %6s\n",
+           "file", "preset", "output", "sec", "fps", "size(KB)", "kbps", "valid");
+    for (int i = 2; i < argc; ++i)
+      failures += benchmarkPresets(argv[i]) ? 0 : 1;
+  }
+  else if (which == "downscale")
+  {
+    printf("%-32s %8s %11s %11s %8s %8s %8s %10s %10s %6s\n",
+           "file", "rotation", "input", "scaled", "full fps", "fps", "speedup", "full(KB)", "size(KB)", "valid");
+    for (int i = 2; i < argc; ++i)
+      failures += benchmarkDownscale(argv[i]) ? 0 : 1;
+  }
+  else if (which == "track")
+  {
+    printf("%-32s %8s %11s %7s %10s %10s %8s %7s %8s %9s %9s %6s\n",
+           "file", "rotation", "luma", "frames", "decode fps", "track fps", "failures", "halfway",
+           "1 trk ms", "4 sep ms", "4 shr ms", "valid");
+    for (int i = 2; i < argc; ++i)
+      failures += benchmarkTrack(argv[i]) ? 0 : 1;
+  }
+  else
+  {
+    fprintf(stderr, "Unknown benchmark: %s\n", which.c_str());
+    return 1;
+  }
+
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,490 @@
+///////////////////////////////////////////////////////////////////
+// Native test program
+//
+// usage: vstvideoutils_tests <test> file [file ...]
+//
+//   segments - transcode each file (and a copy of it re-encoded with a
+//              keyframe every 15 frames, so it has several GOPs) in 4
+//              segments and without, and check that both outputs decode
+//              to the same frames at the same timestamps
+//   pipelined - transcode each file pipelined and sequentially, and check
+//               that both outputs decode to the same pictures
+//   shared - track several objects through each file with trackers of
+//            their own and sharing a VSTSharedFrame, and check that both
+//            find the same positions
+//   packetindex - store each file's packet index the way readMetaData and
+//                 a transcode do, load it back under the file's cache key
+//                 as trackObjectInVideo does, and check that tracking from
+//                 halfway with it gives what tracking without it does
+//
+// The tests need real videos, which aren't in the tree; configure with
+// -DVST_TEST_SAMPLES="a.mov;b.mp4" to have ctest run them on those.
+///////////////////////////////////////////////////////////////////
+
+#include "chunkedbuffer.h"
+#include "ffmpegutils.h"
+#include "indexeddb.h"
+#include "mappedfile.h"
+#include "metadatacache.h"
+#include "packetindex.h"
+#include "objtracking/VSTSharedFrame.hpp"
+#include "objtracking/VSTVideoTracker.hpp"
+
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C" {
+  #include <libavformat/avformat.h>
+  #include <libavutil/adler32.h>
+  #include <libavutil/pixdesc.h>
+}
+
+
+namespace
+{
+  std::string baseName(const std::string &path)
+  {
+    auto pos = path.find_last_of("/\\");
+    return pos == std::string::npos ? path : path.substr(pos + 1);
+  }
+
+
+  // returns: false if the transcode failed
+  bool transcode(const uint8_t *data, size_t size, const TranscodeOptions &options, std::vector<uint8_t> &bytes)
+  {
+    int errCode = 0;
+    ChunkedBuffer out;
+    AVFormatContext *ic = CreateInputFormatContext(data, size, errCode);
+    bool transcoded = ic && TranscodeRotation(ic, "out.mp4", out, errCode, options);
+    if (ic)
+      FreeInputFormatContext(ic);
+
+    bytes.clear();
+    bytes.reserve(out.Size());
+    for (size_t i = 0; i < out.NumChunks(); ++i)
+      bytes.insert(bytes.end(), out.ChunkData(i), out.ChunkData(i) + out.ChunkSize(i));
+    return transcoded;
+  }
+
+
+  // what a video stream decodes to
+  struct DecodedVideo
+  {
+    std::vector<int64_t> times; // frame timestamps, in AV_TIME_BASE units
+    std::vector<uint32_t> sums; // checksum of each frame's picture
+    int64_t keyframes = 0;      // key packets
+  };
+
+
+  // Adler-32 of the visible part of every plane
+  uint32_t pictureSum(const AVFrame *frame)
+  {
+    unsigned long sum = 1;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+    for (int i = 0; desc && i < av_pix_fmt_count_planes((AVPixelFormat)frame->format); ++i)
+    {
+      const bool chroma = i == 1 || i == 2;
+      const int w = chroma ? AV_CEIL_RSHIFT(frame->width, desc->log2_chroma_w) : frame->width;
+      const int h = chroma ? AV_CEIL_RSHIFT(frame->height, desc->log2_chroma_h) : frame->height;
+      for (int y = 0; y < h; ++y)
+        sum = av_adler32_update(sum, frame->data[i] + y * frame->linesize[i], w);
+    }
+    return (uint32_t)sum;
+  }
+
+
+  // decodes the whole video stream, draining the decoder at the end
+  bool decodeVideo(const uint8_t *data, size_t size, DecodedVideo &video)
+  {
+    int errCode = 0;
+    AVFormatContext *ic = CreateInputFormatContext(data, size, errCode);
+    if (!ic)
+      return false;
+
+    AVCodec *dec = nullptr;
+    int stream = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO, -1, -1, &dec, 0);
+    AVCodecContext *dc = stream >= 0 ? avcodec_alloc_context3(dec) : nullptr;
+    AVFrame *frame = av_frame_alloc();
+    if (!dc || !frame || avcodec_parameters_to_context(dc, ic->streams[stream]->codecpar) < 0 ||
+        avcodec_open2(dc, dec, NULL) < 0) {
+      av_frame_free(&frame);
+      avcodec_free_context(&dc);
+      FreeInputFormatContext(ic);
+      return false;
+    }
+
+    const AVRational timeBase = ic->streams[stream]->time_base;
+    AVPacket packet;
+    bool eof = false;
+    while (!eof)
+    {
+      eof = av_read_frame(ic, &packet) < 0;
+      if (eof || packet.stream_index == stream)
+      {
+        if (!eof && (packet.flags & AV_PKT_FLAG_KEY))
+          ++video.keyframes;
+
+        if (avcodec_send_packet(dc, eof ? NULL : &packet) >= 0) {
+          while (avcodec_receive_frame(dc, frame) >= 0) {
+            video.times.push_back(av_rescale_q(frame->best_effort_timestamp, timeBase, AV_TIME_BASE_Q));
+            video.sums.push_back(pictureSum(frame));
+            av_frame_unref(frame);
+          }
+        }
+      }
+      if (!eof)
+        av_packet_unref(&packet);
+    }
+
+    av_frame_free(&frame);
+    avcodec_free_context(&dc);
+    FreeInputFormatContext(ic);
+    return !video.times.empty();
+  }
+
+
+  // returns: the index of the first frame at which a and b differ, or -1
+  template <typename T>
+  int64_t firstDifference(const std::vector<T> &a, const std::vector<T> &b)
+  {
+    for (size_t i = 0; i < a.size() || i < b.size(); ++i)
+    {
+      if (i >= a.size() || i >= b.size() || a[i] != b[i])
+        return (int64_t)i;
+    }
+    return -1;
+  }
+
+
+  //////////////////////////////
+  // segments test
+  bool testSegmentsOn(const std::string &name, const uint8_t *data, size_t size)
+  {
+    TranscodeOptions serial;
+    serial.pipelined = false;
+    serial.alwaysReencode = true;
+    TranscodeOptions segmented;
+    segmented.segments = 4;
+    segmented.alwaysReencode = true;
+
+    DecodedVideo input, a, b;
+    std::vector<uint8_t> serialBytes, segmentedBytes;
+    bool ok = decodeVideo(data, size, input) &&
+              transcode(data, size, serial, serialBytes) &&
+              transcode(data, size, segmented, segmentedBytes) &&
+              decodeVideo(serialBytes.data(), serialBytes.size(), a) &&
+              decodeVideo(segmentedBytes.data(), segmentedBytes.size(), b);
+
+    const int64_t diff = ok ? firstDifference(a.times, b.times) : -1;
+    const bool valid = ok && diff < 0 && a.times.size() == input.times.size();
+
+    printf("%-40s %6lld %7lld %7lld %7lld %8s %6s\n",
+           name.c_str(),
+           (long long)input.keyframes,
+           (long long)input.times.size(),
+           (long long)a.times.size(),
+           (long long)b.times.size(),
+           diff >= 0 ? std::to_string(diff).c_str() : "-",
+           valid ? "yes" : "NO");
+    return valid;
+  }
+
+
+  bool testSegments(const std::string &filename)
+  {
+    auto file = MappedFile::Open(filename);
+    if (!file) {
+      fprintf(stderr, "Failed to load: %s\n", filename.c_str());
+      return false;
+    }
+
+    // short GOPs, so that even a short clip is cut into several segments
+    TranscodeOptions shortGOPs;
+    shortGOPs.pipelined = false;
+    shortGOPs.alwaysReencode = true;
+    shortGOPs.encode.gopSize = 15;
+    std::vector<uint8_t> reencoded;
+    if (!transcode(file->Data(), file->Size(), shortGOPs, reencoded)) {
+      fprintf(stderr, "Failed to transcode: %s\n", filename.c_str());
+      return false;
+    }
+
+    bool asIs = testSegmentsOn(baseName(filename), file->Data(), file->Size());
+    bool gop15 = testSegmentsOn(baseName(filename) + " (gop 15)", reencoded.data(), reencoded.size());
+    return asIs && gop15;
+  }
+
+
+  //////////////////////////////
+  // pipelined test
+  bool testPipelined(const std::string &filename)
+  {
+    auto file = MappedFile::Open(filename);
+    if (!file) {
+      fprintf(stderr, "Failed to load: %s\n", filename.c_str());
+      return false;
+    }
+
+    TranscodeOptions sequential;
+    sequential.pipelined = false;
+    sequential.alwaysReencode = true;
+    TranscodeOptions pipelined;
+    pipelined.alwaysReencode = true;
+
+    // the same frames go through the same encoder settings in the same order,
+    // so the pictures have to come out the same whatever thread did the work
+    DecodedVideo a, b;
+    std::vector<uint8_t> sequentialBytes, pipelinedBytes;
+    bool ok = transcode(file->Data(), file->Size(), sequential, sequentialBytes) &&
+              transcode(file->Data(), file->Size(), pipelined, pipelinedBytes) &&
+              decodeVideo(sequentialBytes.data(), sequentialBytes.size(), a) &&
+              decodeVideo(pipelinedBytes.data(), pipelinedBytes.size(), b);
+
+    const int64_t timeDiff = ok ? firstDifference(a.times, b.times) : -1;
+    const int64_t pictureDiff = ok ? firstDifference(a.sums, b.sums) : -1;
+    const bool sameBytes = ok && sequentialBytes == pipelinedBytes;
+    const bool valid = ok && timeDiff < 0 && pictureDiff < 0;
+
+    printf("%-32s %7lld %7lld %10s %10s %6s %6s\n",
+           baseName(filename).c_str(),
+           (long long)a.times.size(),
+           (long long)b.times.size(),
+           timeDiff >= 0 ? std::to_string(timeDiff).c_str() : "-",
+           pictureDiff >= 0 ? std::to_string(pictureDiff).c_str() : "-",
+           sameBytes ? "yes" : "no",
+           valid ? "yes" : "NO");
+    return valid;
+  }
+
+
+  //////////////////////////////
+  // shared test
+  const int kSharedTrackers = 4;
+
+  bool sameResult(const vst::TrackerResult &a, const vst::TrackerResult &b)
+  {
+    return a.Status() == b.Status() &&
+           (a.Status() != vst::TrackerResult::success || a.ObjectCenter() == b.ObjectCenter());
+  }
+
+
+  bool testShared(const std::string &filename)
+  {
+    auto file = MappedFile::Open(filename);
+    if (!file) {
+      fprintf(stderr, "Failed to load: %s\n", filename.c_str());
+      return false;
+    }
+
+    int errCode = 0;
+    AVFormatContext *ic = CreateInputFormatContext(file->Data(), file->Size(), errCode);
+    if (!ic) {
+      fprintf(stderr, "Failed to open: %s (%d)\n", filename.c_str(), errCode);
+      return false;
+    }
+
+    // Both sets of trackers see every frame.  Their background models learn from
+    // every frame as long as the subtraction period stays at 1, which it does
+    // unless tracking takes over 0.4 sec a frame.
+    std::vector<std::unique_ptr<vst::VSTVideoTracker>> separate, together;
+    vst::VSTSharedFrame shared;
+    int64_t frames = 0, failures = 0, mismatches = 0, firstMismatch = -1;
+    auto onFrame = [&](const LumaFrame &luma) {
+      if (separate.empty()) {
+        int radius = FFMIN(luma.width, luma.height) / 20;
+        for (int i = 0; i < kSharedTrackers; ++i) {
+          int x = luma.width * (i + 1) / (kSharedTrackers + 1);
+          cv::Rect area(x - radius, luma.height / 2 - radius, 2 * radius, 2 * radius);
+          separate.emplace_back(new vst::VSTVideoTracker(area, 1));
+          together.emplace_back(new vst::VSTVideoTracker(area, 1));
+        }
+      }
+
+      cv::Mat frame(luma.height, luma.width, CV_8UC1, (void*)luma.data, luma.stride);
+      shared.SetFrame(frame);
+      for (int i = 0; i < kSharedTrackers; ++i)
+      {
+        auto a = separate[i]->TrackObjectInFrame(frame, luma.time);
+        auto b = together[i]->TrackObjectInFrame(shared, luma.time);
+        if (a.Status() != vst::TrackerResult::success)
+          ++failures;
+        if (!sameResult(a, b)) {
+          if (firstMismatch < 0)
+            firstMismatch = frames;
+          ++mismatches;
+        }
+      }
+      shared.Clear();
+      ++frames;
+      return true;
+    };
+
+    bool decoded = DecodeVideoLuma(ic, DecodeOptions(), onFrame, errCode);
+    FreeInputFormatContext(ic);
+
+    const bool valid = decoded && frames > 0 && mismatches == 0;
+    printf("%-32s %7lld %8d %8lld %10lld %8s %6s\n",
+           baseName(filename).c_str(),
+           (long long)frames,
+           kSharedTrackers,
+           (long long)failures,
+           (long long)mismatches,
+           firstMismatch >= 0 ? std::to_string(firstMismatch).c_str() : "-",
+           valid ? "yes" : "NO");
+    return valid;
+  }
+
+
+  //////////////////////////////
+  // packetindex test
+  struct TrackedVideo
+  {
+    std::vector<double> times;
+    std::vector<vst::TrackerResult> results;
+  };
+
+
+  // what trackObjectInVideo does: track the object at the center of the picture from startTime
+  bool trackFrom(std::shared_ptr<InputSource> file, double startTime, const PacketIndex *index, TrackedVideo &tracked)
+  {
+    int errCode = 0;
+    AVFormatContext *ic = CreateInputFormatContext(file, errCode);
+    if (!ic)
+      return false;
+
+    std::unique_ptr<vst::VSTVideoTracker> tracker;
+    auto onFrame = [&](const LumaFrame &luma) {
+      if (!tracker) {
+        int radius = FFMIN(luma.width, luma.height) / 20;
+        tracker.reset(new vst::VSTVideoTracker(cv::Rect(luma.width / 2 - radius, luma.height / 2 - radius,
+                                                        2 * radius, 2 * radius), 1));
+      }
+
+      cv::Mat frame(luma.height, luma.width, CV_8UC1, (void*)luma.data, luma.stride);
+      tracked.times.push_back(luma.time);
+      tracked.results.push_back(tracker->TrackObjectInFrame(frame, luma.time));
+      return true;
+    };
+
+    DecodeOptions options;
+    options.startTime = startTime;
+    options.index = index;
+
+    bool decoded = DecodeVideoLuma(ic, options, onFrame, errCode);
+    FreeInputFormatContext(ic);
+    return decoded && !tracked.times.empty();
+  }
+
+
+  bool testPacketIndex(const std::string &filename)
+  {
+    bool valid = false;
+
+    // natively the file is read from disk and the index stored next to it
+    // ("<filename>.pktidx"); both calls finish before they return
+    IDBOpenAsync("", filename,
+                 [&](std::shared_ptr<InputSource> file) {
+                   const std::string key = MetaDataCacheKey(filename, *file);
+
+                   int errCode = 0;
+                   AVFormatContext *ic = CreateInputFormatContext(file, errCode);
+                   auto built = std::make_shared<PacketIndex>();
+                   VideoMetaData meta;
+                   bool ok = ic && BuildPacketIndex(ic, *built) && GetVideoMetaData(ic, meta) && !key.empty();
+                   if (ic)
+                     FreeInputFormatContext(ic);
+
+                   std::shared_ptr<PacketIndex> loaded;
+                   if (ok) {
+                     StorePacketIndexAsync("", key, built);
+                     LoadPacketIndexAsync("", key, [&](std::shared_ptr<PacketIndex> index) { loaded = index; });
+                   }
+                   const bool stored = loaded && loaded->Count() == built->Count() &&
+                                       loaded->KeyframeTimes() == built->KeyframeTimes();
+
+                   const double halfway = meta.duration / 2;
+                   TrackedVideo a, b;
+                   ok = stored && halfway > 0 && trackFrom(file, halfway, loaded.get(), a) && trackFrom(file, halfway, nullptr, b);
+
+                   int64_t diff = -1;
+                   if (ok) {
+                     diff = firstDifference(a.times, b.times);
+                     for (size_t i = 0; diff < 0 && i < a.results.size(); ++i) {
+                       if (!sameResult(a.results[i], b.results[i]))
+                         diff = (int64_t)i;
+                     }
+                   }
+                   valid = ok && diff < 0 && a.times[0] >= halfway;
+
+                   printf("%-32s %8lld %8lld %6s %9.3f %9.3f %7lld %7lld %8s %6s\n",
+                          baseName(filename).c_str(),
+                          (long long)built->Count(),
+                          (long long)built->KeyframeTimes().size(),
+                          stored ? "yes" : "NO",
+                          halfway,
+                          a.times.empty() ? 0.0 : a.times[0],
+                          (long long)a.times.size(),
+                          (long long)b.times.size(),
+                          diff >= 0 ? std::to_string(diff).c_str() : "-",
+                          valid ? "yes" : "NO");
+                 },
+                 [&]() {
+                   fprintf(stderr, "Failed to load: %s\n", filename.c_str());
+                 });
+
+    return valid;
+  }
+}
+
+
+int main(int argc, char **argv)
+{
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s segments|pipelined|shared|packetindex file [file ...]\n", argv[0]);
+    return 1;
+  }
+
+  InitFFmpegUtils();
+  av_log_set_level(AV_LOG_ERROR);
+
+  std::string which = argv[1];
+  int failures = 0;
+
+  if (which == "segments")
+  {
+    printf("%-40s %6s %7s %7s %7s %8s %6s\n",
+           "file", "GOPs", "frames", "serial", "segment", "differs", "valid");
+    for (int i = 2; i < argc; ++i)
+      failures += testSegments(argv[i]) ? 0 : 1;
+  }
+  else if (which == "pipelined")
+  {
+    printf("%-32s %7s %7s %10s %10s %6s %6s\n",
+           "file", "serial", "piped", "time diff", "pic diff", "bytes", "valid");
+    for (int i = 2; i < argc; ++i)
+      failures += testPipelined(argv[i]) ? 0 : 1;
+  }
+  else if (which == "shared")
+  {
+    printf("%-32s %7s %8s %8s %10s %8s %6s\n",
+           "file", "frames", "trackers", "failures", "mismatches", "first", "valid");
+    for (int i = 2; i < argc; ++i)
+      failures += testShared(argv[i]) ? 0 : 1;
+  }
+  else if (which == "packetindex")
+  {
+    printf("%-32s %8s %8s %6s %9s %9s %7s %7s %8s %6s\n",
+           "file", "packets", "GOPs", "stored", "from", "first", "indexed", "search", "differs", "valid");
+    for (int i = 2; i < argc; ++i)
+      failures += testPacketIndex(argv[i]) ? 0 : 1;
+  }
+  else
+  {
+    fprintf(stderr, "Unknown test: %s\n", which.c_str());
+    return 1;
+  }
+
+  return failures ? 1 : 0;
+}